@@ -2,7 +2,7 @@ import json
 import numpy as np
 from flare_pp import _C_flare
 from flare_pp._C_flare import SparseGP, Structure, NormalizedDotProduct
-from scipy.optimize import minimize
+from scipy.optimize import minimize, OptimizeResult
 from typing import List
 import warnings
 from flare import struc
@@ -478,8 +478,22 @@ def optimize_hyperparameters(
     max_iterations=10,
     bounds=None,
     method="BFGS",
+    batch_size=10,
+    learning_rate=0.01,
+    n_probes=0,
 ):
-    """Optimize the hyperparameters of a sparse GP model."""
+    """Optimize the hyperparameters of a sparse GP model. The "Adam" method
+    takes max_iterations steps on random batches of batch_size training
+    structures in C++, with the trace terms estimated from n_probes random
+    vectors if n_probes is positive."""
+
+    if method == "Adam":
+        hyperparameters = sparse_gp.optimize_hyperparameters_adam(
+            max_iterations, batch_size, learning_rate, n_probes
+        )
+        return OptimizeResult(
+            x=hyperparameters, fun=-sparse_gp.log_marginal_likelihood
+        )
 
     initial_guess = sparse_gp.hyperparameters
     arguments = sparse_gp
@@ -531,8 +545,10 @@ def optimize_hyperparameters(
             },
         )
 
-    # Set the hyperparameters to the optimal value.
+    # Set the hyperparameters to the optimal value, and release the kernels
+    # cached for the likelihood sweeps.
     sparse_gp.set_hyperparameters(optimization_result.x)
+    sparse_gp.clear_kernel_caches()
     sparse_gp.log_marginal_likelihood = -optimization_result.fun
 
     return optimization_result
@@ -1,5 +1,5 @@
 from ase.calculators.calculator import Calculator, all_changes
-from flare_pp._C_flare import SparseGP, Structure
+from flare_pp._C_flare import SparseGP, Structure, NeighborList
 import numpy as np
 import time
 
@@ -8,13 +8,19 @@ class SGP_Calculator(Calculator):
 
     implemented_properties = ["energy", "forces", "stress", "stds"]
 
-    def __init__(self, sgp_model):
+    def __init__(self, sgp_model, neighbor_skin=0.5):
         super().__init__()
         self.gp_model = sgp_model
         self.results = {}
         self.use_mapping = False
         self.mgp_model = None
 
+        # Neighbor list reused across MD steps. Candidates are stored out to
+        # the cutoff plus the skin, and are only searched for again once an
+        # atom has moved more than half the skin.
+        self.neighbor_skin = neighbor_skin
+        self.neighbor_list = None
+
     # TODO: Figure out why this is called twice per MD step.
     def calculate(self, atoms=None, properties=None, system_changes=all_changes):
         """
@@ -35,11 +41,17 @@ class SGP_Calculator(Calculator):
             coded_species.append(self.gp_model.species_map[spec])
 
         # Create structure descriptor.
+        if (self.neighbor_list is None) or (
+            self.neighbor_list.cutoff != self.gp_model.cutoff
+        ):
+            self.neighbor_list = NeighborList(
+                self.gp_model.cutoff, self.neighbor_skin
+            )
         structure_descriptor = Structure(
             atoms.cell,
             coded_species,
             atoms.positions,
-            self.gp_model.cutoff,
+            self.neighbor_list,
             self.gp_model.descriptor_calculators,
         )
 
@@ -39,10 +39,10 @@ protected:
   int n_species, n_max, l_max, n_descriptors, beta_size;
 
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       basis_function;
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_function;
 
   std::vector<double> radial_hyps, cutoff_hyps;
@@ -1,17 +1,64 @@
 #include "lammps_descriptor.h"
 #include "radial.h"
 #include "y_grad.h"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
+void DescriptorWorkspace ::resize(int n_species, int N, int lmax,
+                                  int n_neighbors) {
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  int n_radial = n_species * N;
+  int n_bond = n_radial * n_harmonics;
+  int n_descriptors = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+
+  // Resizing to the current size doesn't reallocate.
+  g.resize(N);
+  gx.resize(N);
+  gy.resize(N);
+  gz.resize(N);
+  h.resize(n_harmonics);
+  hx.resize(n_harmonics);
+  hy.resize(n_harmonics);
+  hz.resize(n_harmonics);
+  rcut_vals.resize(2);
+  basis_vals.resize(N);
+  basis_derivs.resize(N);
+  single_bond_vals.resize(n_bond);
+  B2_vals.resize(n_descriptors);
+  beta_p.resize(n_descriptors);
+
+  if (n_neighbors > max_neighbors || single_bond_env_dervs.cols() != n_bond ||
+      B2_env_dervs.cols() != n_descriptors) {
+    max_neighbors = std::max(n_neighbors, max_neighbors);
+    single_bond_env_dervs.resize(max_neighbors * 3, n_bond);
+    B2_env_dervs.resize(max_neighbors * 3, n_descriptors);
+    B2_env_dot.resize(max_neighbors * 3);
+    partial_forces.resize(max_neighbors * 3);
+  }
+}
+
+double DescriptorWorkspace ::memory_usage() const {
+  double bytes = 0;
+  for (const std::vector<double> *v :
+       {&g, &gx, &gy, &gz, &h, &hx, &hy, &hz, &rcut_vals, &basis_vals,
+        &basis_derivs, &radial_hyps})
+    bytes += v->capacity() * sizeof(double);
+  bytes += (single_bond_vals.size() + B2_vals.size() + B2_env_dot.size() +
+            beta_p.size() + partial_forces.size() +
+            single_bond_env_dervs.size() + B2_env_dervs.size()) *
+           sizeof(double);
+  return bytes;
+}
+
 void single_bond_multiple_cutoffs(
     double **x, int *type, int jnum, int n_inner, int i, double xtmp,
     double ytmp, double ztmp, int *jlist,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         basis_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int n_species, int N, int lmax,
     const std::vector<double> &radial_hyps,
@@ -19,17 +66,35 @@ void single_bond_multiple_cutoffs(
     Eigen::MatrixXd &single_bond_env_dervs,
     const Eigen::MatrixXd &cutoff_matrix) {
 
-  // Initialize basis vectors and spherical harmonics.
-  std::vector<double> g = std::vector<double>(N, 0);
-  std::vector<double> gx = std::vector<double>(N, 0);
-  std::vector<double> gy = std::vector<double>(N, 0);
-  std::vector<double> gz = std::vector<double>(N, 0);
+  DescriptorWorkspace work;
+  work.resize(n_species, N, lmax, n_inner);
+  single_bond_multiple_cutoffs(x, type, jnum, n_inner, i, xtmp, ytmp, ztmp,
+                               jlist, basis_function, cutoff_function,
+                               n_species, N, lmax, radial_hyps, cutoff_hyps,
+                               cutoff_matrix, work);
+  single_bond_vals = work.single_bond_vals;
+  single_bond_env_dervs = work.single_bond_env_dervs.topRows(n_inner * 3);
+}
 
+void single_bond_multiple_cutoffs(
+    double **x, int *type, int jnum, int n_inner, int i, double xtmp,
+    double ytmp, double ztmp, int *jlist,
+    const std::function<void(std::vector<double> &, std::vector<double> &,
+                             double, int, const std::vector<double> &)>
+        &basis_function,
+    const std::function<void(std::vector<double> &, double, double,
+                             const std::vector<double> &)> &cutoff_function,
+    int /*n_species*/, int N, int lmax,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps,
+    const Eigen::MatrixXd &cutoff_matrix, DescriptorWorkspace &work) {
+
+  // Basis vectors and spherical harmonics.
+  std::vector<double> &g = work.g, &gx = work.gx, &gy = work.gy,
+                      &gz = work.gz;
   int n_harmonics = (lmax + 1) * (lmax + 1);
-  std::vector<double> h = std::vector<double>(n_harmonics, 0);
-  std::vector<double> hx = std::vector<double>(n_harmonics, 0);
-  std::vector<double> hy = std::vector<double>(n_harmonics, 0);
-  std::vector<double> hz = std::vector<double>(n_harmonics, 0);
+  std::vector<double> &h = work.h, &hx = work.hx, &hy = work.hy,
+                      &hz = work.hz;
 
   // Prepare LAMMPS variables.
   int central_species = type[i] - 1;
@@ -37,14 +102,15 @@ void single_bond_multiple_cutoffs(
       gy_val, gz_val, h_val;
   int j, s, descriptor_counter;
 
-  // Initialize vectors.
-  int n_radial = n_species * N;
-  int n_bond = n_radial * n_harmonics;
-  single_bond_vals = Eigen::VectorXd::Zero(n_bond);
-  single_bond_env_dervs = Eigen::MatrixXd::Zero(n_inner * 3, n_bond);
+  // Zero the rows used by this environment.
+  Eigen::VectorXd &single_bond_vals = work.single_bond_vals;
+  Eigen::MatrixXd &single_bond_env_dervs = work.single_bond_env_dervs;
+  single_bond_vals.setZero();
+  single_bond_env_dervs.topRows(n_inner * 3).setZero();
 
   // Initialize radial hyperparameters.
-  std::vector<double> new_radial_hyps = radial_hyps;
+  std::vector<double> &new_radial_hyps = work.radial_hyps;
+  new_radial_hyps.assign(radial_hyps.begin(), radial_hyps.end());
 
   // Loop over neighbors.
   int n_count = 0;
@@ -67,7 +133,8 @@ void single_bond_multiple_cutoffs(
       new_radial_hyps[1] = cutoff;
 
       calculate_radial(g, gx, gy, gz, basis_function, cutoff_function, delx,
-                       dely, delz, r, cutoff, N, new_radial_hyps, cutoff_hyps);
+                       dely, delz, r, cutoff, N, new_radial_hyps, cutoff_hyps,
+                       work.rcut_vals, work.basis_vals, work.basis_derivs);
       get_Y(h, hx, hy, hz, delx, dely, delz, lmax);
 
       // Store the products and their derivatives.
@@ -110,10 +177,10 @@ void single_bond(
     double **x, int *type, int jnum, int n_inner, int i, double xtmp,
     double ytmp, double ztmp, int *jlist,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         basis_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     double cutoff, int n_species, int N, int lmax,
     const std::vector<double> &radial_hyps,
@@ -198,24 +265,26 @@ void single_bond(
   }
 }
 
-void B2_descriptor(Eigen::VectorXd &B2_vals, Eigen::MatrixXd &B2_env_dervs,
-                   double &norm_squared, Eigen::VectorXd &B2_env_dot,
-                   const Eigen::VectorXd &single_bond_vals,
-                   const Eigen::MatrixXd &single_bond_env_dervs, int n_species,
-                   int N, int lmax) {
+// Computes the B2 descriptor of a block of single bond values, storing it in
+// blocks of the caller's arrays so that no temporaries are allocated.
+static void B2_descriptor_block(
+    Eigen::Ref<Eigen::VectorXd> B2_vals,
+    Eigen::Ref<Eigen::MatrixXd> B2_env_dervs, double &norm_squared,
+    Eigen::Ref<Eigen::VectorXd> B2_env_dot,
+    const Eigen::Ref<const Eigen::VectorXd> &single_bond_vals,
+    const Eigen::Ref<const Eigen::MatrixXd> &single_bond_env_dervs,
+    int n_species, int N, int lmax) {
 
   int env_derv_size = single_bond_env_dervs.rows();
   int neigh_size = env_derv_size / 3;
   int n_radial = n_species * N;
   int n_harmonics = (lmax + 1) * (lmax + 1);
-  int n_descriptors = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
 
   int n1_l, n2_l, counter, n1_count, n2_count;
 
   // Zero the B2 vectors and matrices.
-  B2_vals = Eigen::VectorXd::Zero(n_descriptors);
-  B2_env_dervs = Eigen::MatrixXd::Zero(env_derv_size, n_descriptors);
-  B2_env_dot = Eigen::VectorXd::Zero(env_derv_size);
+  B2_vals.setZero();
+  B2_env_dervs.setZero();
 
   // Compute the descriptor.
   for (int n1 = n_radial - 1; n1 >= 0; n1--) {
@@ -251,5 +320,81 @@ void B2_descriptor(Eigen::VectorXd &B2_vals, Eigen::MatrixXd &B2_env_dervs,
 
   // Compute descriptor norm and dot products.
   norm_squared = B2_vals.dot(B2_vals);
-  B2_env_dot = B2_env_dervs * B2_vals;
+  B2_env_dot.noalias() = B2_env_dervs * B2_vals;
+}
+
+void B2_descriptor(double &norm_squared, int n_inner, int n_species, int N,
+                   int lmax, DescriptorWorkspace &work) {
+  int env_derv_size = n_inner * 3;
+  B2_descriptor_block(work.B2_vals, work.B2_env_dervs.topRows(env_derv_size),
+                      norm_squared, work.B2_env_dot.head(env_derv_size),
+                      work.single_bond_vals,
+                      work.single_bond_env_dervs.topRows(env_derv_size),
+                      n_species, N, lmax);
+}
+
+void B2_descriptor(Eigen::VectorXd &B2_vals, Eigen::MatrixXd &B2_env_dervs,
+                   double &norm_squared, Eigen::VectorXd &B2_env_dot,
+                   const Eigen::VectorXd &single_bond_vals,
+                   const Eigen::MatrixXd &single_bond_env_dervs, int n_species,
+                   int N, int lmax) {
+
+  int env_derv_size = single_bond_env_dervs.rows();
+  int n_radial = n_species * N;
+  int n_descriptors = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+
+  B2_vals.resize(n_descriptors);
+  B2_env_dervs.resize(env_derv_size, n_descriptors);
+  B2_env_dot.resize(env_derv_size);
+  B2_descriptor_block(B2_vals, B2_env_dervs, norm_squared, B2_env_dot,
+                      single_bond_vals, single_bond_env_dervs, n_species, N,
+                      lmax);
+}
+
+void packed_symv(int n, const double *packed,
+                 const Eigen::Ref<const Eigen::VectorXd> &x,
+                 Eigen::Ref<Eigen::VectorXd> y) {
+  y.setZero();
+  long offset = 0;
+  for (int i = 0; i < n; i++) {
+    // Row i of the upper triangle, starting at the diagonal.
+    Eigen::Map<const Eigen::VectorXd> row(packed + offset, n - i);
+    y(i) += row.dot(x.tail(n - i));
+    y.tail(n - i - 1) += x(i) * row.tail(n - i - 1);
+    offset += n - i;
+  }
+}
+
+void packed_symm(int n, const double *packed,
+                 const Eigen::Ref<const Eigen::MatrixXd> &X,
+                 Eigen::Ref<Eigen::MatrixXd> Y, PackedPanel &panel) {
+  // Rows r0 to r0 + n_rows - 1 of the upper triangle are unpacked into a
+  // dense panel, with the diagonal block filled in symmetrically. The panel
+  // gives these rows of Y, and the transpose of its part right of the
+  // diagonal block gives the contribution of the lower triangle to the
+  // rows of Y below them. Both are matrix products, and each stored entry
+  // is read once.
+  if (panel.rows() < packed_panel_rows || panel.cols() < n)
+    panel.resize(packed_panel_rows, n);
+
+  Y.setZero();
+  long offset = 0;
+  for (int r0 = 0; r0 < n; r0 += packed_panel_rows) {
+    int n_rows = std::min(packed_panel_rows, n - r0);
+    int n_cols = n - r0;
+    auto block = panel.topLeftCorner(n_rows, n_cols);
+    for (int k = 0; k < n_rows; k++) {
+      block.row(k).tail(n_cols - k) =
+          Eigen::Map<const Eigen::RowVectorXd>(packed + offset, n_cols - k);
+      for (int l = 0; l < k; l++)
+        block(k, l) = block(l, k);
+      offset += n_cols - k;
+    }
+
+    Y.middleRows(r0, n_rows).noalias() += block * X.bottomRows(n_cols);
+    if (n_cols > n_rows)
+      Y.bottomRows(n_cols - n_rows).noalias() +=
+          block.rightCols(n_cols - n_rows).transpose() *
+          X.middleRows(r0, n_rows);
+  }
 }
@@ -10,24 +10,44 @@ void single_bond(
     double **x, int *type, int jnum, int n_inner, int i, double xtmp,
     double ytmp, double ztmp, int *jlist,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         basis_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     double cutoff, int n_species, int N, int lmax,
     const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, Eigen::VectorXd &single_bond_vals,
     Eigen::MatrixXd &single_bond_env_dervs);
 
+// Buffers of the per-atom descriptor routines. resize only reallocates when
+// an environment has more neighbors than any before it, so that evaluating
+// an environment doesn't allocate once the workspace has reached its size.
+// The matrices have 3 * max_neighbors rows, of which the first 3 * n_inner
+// are used.
+class DescriptorWorkspace {
+public:
+  void resize(int n_species, int N, int lmax, int n_neighbors);
+
+  // Bytes held by the buffers.
+  double memory_usage() const;
+
+  int max_neighbors = 0;
+  std::vector<double> g, gx, gy, gz, h, hx, hy, hz, rcut_vals, basis_vals,
+      basis_derivs, radial_hyps;
+  Eigen::VectorXd single_bond_vals, B2_vals, B2_env_dot, beta_p,
+      partial_forces;
+  Eigen::MatrixXd single_bond_env_dervs, B2_env_dervs;
+};
+
 void single_bond_multiple_cutoffs(
     double **x, int *type, int jnum, int n_inner, int i, double xtmp,
     double ytmp, double ztmp, int *jlist,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         basis_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int n_species, int N, int lmax,
     const std::vector<double> &radial_hyps,
@@ -35,10 +55,47 @@ void single_bond_multiple_cutoffs(
     Eigen::MatrixXd &single_bond_env_dervs,
     const Eigen::MatrixXd &cutoff_matrix);
 
+// Versions of single_bond_multiple_cutoffs and B2_descriptor that use the
+// buffers of a workspace sized for at least n_inner neighbors, and store
+// their results in it.
+void single_bond_multiple_cutoffs(
+    double **x, int *type, int jnum, int n_inner, int i, double xtmp,
+    double ytmp, double ztmp, int *jlist,
+    const std::function<void(std::vector<double> &, std::vector<double> &,
+                             double, int, const std::vector<double> &)>
+        &basis_function,
+    const std::function<void(std::vector<double> &, double, double,
+                             const std::vector<double> &)> &cutoff_function,
+    int n_species, int N, int lmax, const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps,
+    const Eigen::MatrixXd &cutoff_matrix, DescriptorWorkspace &work);
+
+void B2_descriptor(double &norm_squared, int n_inner, int n_species, int N,
+                   int lmax, DescriptorWorkspace &work);
+
 void B2_descriptor(Eigen::VectorXd &B2_vals, Eigen::MatrixXd &B2_env_dervs,
                    double &norm_squared, Eigen::VectorXd &B2_env_dot,
                    const Eigen::VectorXd &single_bond_vals,
                    const Eigen::MatrixXd &single_bond_env_dervs, int n_species,
                    int N, int lmax);
 
+// Products with a symmetric matrix of size n stored as the packed upper
+// triangle of its rows, A(0, 0), A(0, 1), ..., A(0, n - 1), A(1, 1), ....
+// Each stored entry is read once, so that half as much of the matrix is
+// read as for the full matrix. packed_symv computes y = A x, using each
+// entry for both of the entries it represents. packed_symm computes
+// Y = A X with matrix products on dense panels of packed_panel_rows rows,
+// unpacked into a caller-provided buffer.
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+    PackedPanel;
+const int packed_panel_rows = 64;
+
+void packed_symv(int n, const double *packed,
+                 const Eigen::Ref<const Eigen::VectorXd> &x,
+                 Eigen::Ref<Eigen::VectorXd> y);
+
+void packed_symm(int n, const double *packed,
+                 const Eigen::Ref<const Eigen::MatrixXd> &X,
+                 Eigen::Ref<Eigen::MatrixXd> Y, PackedPanel &panel);
+
 #endif
@@ -8,6 +8,7 @@
 #include "neigh_request.h"
 #include "neighbor.h"
 #include <Eigen/Dense>
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
@@ -24,6 +25,7 @@
 using namespace LAMMPS_NS;
 
 #define MAXLINE 1024
+#define MAXBATCH 1024
 
 /* ---------------------------------------------------------------------- */
 
@@ -32,6 +34,7 @@ PairFLARE::PairFLARE(LAMMPS *lmp) : Pair(lmp) {
   manybody_flag = 1;
 
   beta = NULL;
+  batch_size = 0;
 }
 
 /* ----------------------------------------------------------------------
@@ -53,115 +56,255 @@ PairFLARE::~PairFLARE() {
 /* ---------------------------------------------------------------------- */
 
 void PairFLARE::compute(int eflag, int vflag) {
-  int i, j, ii, jj, inum, jnum, itype, jtype, n_inner, n_count;
-  double evdwl, delx, dely, delz, xtmp, ytmp, ztmp, rsq;
-  double *coeff;
-  int *ilist, *jlist, *numneigh, **firstneigh;
+  if (batch_size > 0) {
+    compute_batched(eflag, vflag);
+    return;
+  }
 
-  evdwl = 0.0;
   ev_init(eflag, vflag);
 
-  double **x = atom->x;
-  double **f = atom->f;
-  int *type = atom->type;
-  int nlocal = atom->nlocal;
-  int nall = nlocal + atom->nghost;
-  int newton_pair = force->newton_pair;
+  double evdwl;
+  int n_inner;
+  for (int ii = 0; ii < list->inum; ii++) {
+    int i = list->ilist[ii];
+    if (compute_atom(i, evdwl, n_inner, workspace))
+      tally_atom(i, evdwl, workspace.partial_forces.data(), eflag, vflag);
+  }
+
+  if (vflag_fdotr)
+    virial_fdotr_compute();
+}
+
+/* ----------------------------------------------------------------------
+   in batched mode, the descriptors of a batch of atoms are computed first,
+   and the descriptors of the atoms of each species are then stacked into a
+   matrix and multiplied by the beta matrix of the species at once, which
+   reads beta once per batch rather than once per atom
+------------------------------------------------------------------------- */
 
-  inum = list->inum;
-  ilist = list->ilist;
-  numneigh = list->numneigh;
-  firstneigh = list->firstneigh;
+void PairFLARE::compute_batched(int eflag, int vflag) {
+  ev_init(eflag, vflag);
 
-  int beta_init, beta_counter;
-  double B2_norm_squared, B2_val_1, B2_val_2;
-  Eigen::VectorXd single_bond_vals, B2_vals, B2_env_dot, beta_p, partial_forces;
-  Eigen::MatrixXd single_bond_env_dervs, B2_env_dervs;
-  double empty_thresh = 1e-8;
+  resize_batch();
 
-  for (ii = 0; ii < inum; ii++) {
-    i = list->ilist[ii];
-    itype = type[i];
-    jnum = numneigh[i];
-    xtmp = x[i][0];
-    ytmp = x[i][1];
-    ztmp = x[i][2];
-    jlist = firstneigh[i];
-
-    // Count the atoms inside the cutoff.
-    n_inner = 0;
-    for (int jj = 0; jj < jnum; jj++) {
-      j = jlist[jj];
-      int s = type[j] - 1;
-      double cutoff_val = cutoff_matrix(itype-1, s);
-
-      delx = x[j][0] - xtmp;
-      dely = x[j][1] - ytmp;
-      delz = x[j][2] - ztmp;
-      rsq = delx * delx + dely * dely + delz * delz;
-      if (rsq < (cutoff_val * cutoff_val))
-        n_inner++;
+  int inum = list->inum;
+  int *ilist = list->ilist;
+  for (int first = 0; first < inum; first += batch_size) {
+    int n_atoms = std::min(batch_size, inum - first);
+
+    for (int k = 0; k < n_atoms; k++) {
+      batch_nonempty[k] =
+          compute_descriptors(ilist[first + k], batch_n_inner[k],
+                              batch_norms[k], batch_workspaces[k]);
     }
 
-    // Compute covariant descriptors.
-    single_bond_multiple_cutoffs(x, type, jnum, n_inner, i, xtmp, ytmp, ztmp,
-                                 jlist, basis_function, cutoff_function,
-                                 n_species, n_max, l_max, radial_hyps,
-                                 cutoff_hyps, single_bond_vals,
-                                 single_bond_env_dervs, cutoff_matrix);
+    contract_batch(first, n_atoms);
 
-    // Compute invariant descriptors.
-    B2_descriptor(B2_vals, B2_env_dervs, B2_norm_squared, B2_env_dot,
-                  single_bond_vals, single_bond_env_dervs, n_species, n_max,
-                  l_max);
+    for (int k = 0; k < n_atoms; k++) {
+      if (!batch_nonempty[k])
+        continue;
+      DescriptorWorkspace &work = batch_workspaces[k];
+      compute_forces(batch_norms[k], batch_n_inner[k], batch_energies[k],
+                     work);
+      tally_atom(ilist[first + k], batch_energies[k],
+                 work.partial_forces.data(), eflag, vflag);
+    }
+  }
 
-    // Continue if the environment is empty.
-    if (B2_norm_squared < empty_thresh)
-      continue;
+  if (vflag_fdotr)
+    virial_fdotr_compute();
+}
+
+/* ---------------------------------------------------------------------- */
+
+void PairFLARE::resize_batch() {
+  // The workspaces are sized by compute_descriptors.
+  int n_batch = std::min(batch_size, list->inum);
+  if (n_batch > (int) batch_workspaces.size()) {
+    batch_workspaces.resize(n_batch);
+    batch_n_inner.resize(n_batch);
+    batch_columns.resize(n_batch);
+    batch_norms.resize(n_batch);
+    batch_energies.resize(n_batch);
+    batch_nonempty.resize(n_batch);
+  }
+
+  if (B2_batch.rows() != n_descriptors || B2_batch.cols() < n_batch) {
+    B2_batch.resize(n_descriptors, n_batch);
+    beta_batch.resize(n_descriptors, n_batch);
+  }
+}
+
+/* ---------------------------------------------------------------------- */
 
-    // Compute local energy and partial forces.
-    beta_p = beta_matrices[itype - 1] * B2_vals;
-    evdwl = B2_vals.dot(beta_p) / B2_norm_squared;
-    partial_forces =
-        2 * (-B2_env_dervs * beta_p + evdwl * B2_env_dot) / B2_norm_squared;
-
-    // Update energy, force and stress arrays.
-    n_count = 0;
-    for (int jj = 0; jj < jnum; jj++) {
-      j = jlist[jj];
-      int s = type[j] - 1;
-      double cutoff_val = cutoff_matrix(itype-1, s);
-      delx = xtmp - x[j][0];
-      dely = ytmp - x[j][1];
-      delz = ztmp - x[j][2];
-      rsq = delx * delx + dely * dely + delz * delz;
-
-      if (rsq < (cutoff_val * cutoff_val)) {
-        double fx = -partial_forces(n_count * 3);
-        double fy = -partial_forces(n_count * 3 + 1);
-        double fz = -partial_forces(n_count * 3 + 2);
-        f[i][0] += fx;
-        f[i][1] += fy;
-        f[i][2] += fz;
-        f[j][0] -= fx;
-        f[j][1] -= fy;
-        f[j][2] -= fz;
-
-        if (vflag) {
-          ev_tally_xyz(i, j, nlocal, newton_pair, 0.0, 0.0, fx, fy, fz, delx,
-                       dely, delz);
-        }
-        n_count++;
+void PairFLARE::contract_batch(int first, int n_atoms) {
+  int *ilist = list->ilist;
+  int *type = atom->type;
+
+  for (int s = 0; s < n_species; s++) {
+    int n_cols = 0;
+    for (int k = 0; k < n_atoms; k++) {
+      if (batch_nonempty[k] && type[ilist[first + k]] - 1 == s) {
+        B2_batch.col(n_cols) = batch_workspaces[k].B2_vals;
+        batch_columns[n_cols] = k;
+        n_cols++;
       }
     }
+    if (n_cols == 0)
+      continue;
 
-    // Compute local energy.
-    if (eflag)
-      ev_tally_full(i, 2.0 * evdwl, 0.0, 0.0, 0.0, 0.0, 0.0);
+    packed_symm(n_descriptors, beta + s * beta_size,
+                B2_batch.leftCols(n_cols), beta_batch.leftCols(n_cols),
+                beta_panel);
+    for (int c = 0; c < n_cols; c++)
+      batch_workspaces[batch_columns[c]].beta_p = beta_batch.col(c);
   }
+}
 
-  if (vflag_fdotr)
-    virial_fdotr_compute();
+/* ----------------------------------------------------------------------
+   compute the local energy of atom i and the partial forces on its
+   neighbors inside the cutoff, returning false if the environment is empty
+------------------------------------------------------------------------- */
+
+bool PairFLARE::compute_atom(int i, double &evdwl, int &n_inner,
+                             DescriptorWorkspace &work) {
+  double B2_norm_squared;
+  if (!compute_descriptors(i, n_inner, B2_norm_squared, work))
+    return false;
+
+  int itype = atom->type[i];
+  packed_symv(n_descriptors, beta + (itype - 1) * beta_size, work.B2_vals,
+              work.beta_p);
+  compute_forces(B2_norm_squared, n_inner, evdwl, work);
+  return true;
+}
+
+/* ---------------------------------------------------------------------- */
+
+bool PairFLARE::compute_descriptors(int i, int &n_inner, double &norm_squared,
+                                    DescriptorWorkspace &work) {
+  int j, itype, jnum;
+  double delx, dely, delz, xtmp, ytmp, ztmp, rsq;
+  int *jlist;
+
+  double **x = atom->x;
+  int *type = atom->type;
+
+  double empty_thresh = 1e-8;
+
+  itype = type[i];
+  jnum = list->numneigh[i];
+  xtmp = x[i][0];
+  ytmp = x[i][1];
+  ztmp = x[i][2];
+  jlist = list->firstneigh[i];
+
+  // Count the atoms inside the cutoff.
+  n_inner = 0;
+  for (int jj = 0; jj < jnum; jj++) {
+    j = jlist[jj];
+    int s = type[j] - 1;
+    double cutoff_val = cutoff_matrix(itype-1, s);
+
+    delx = x[j][0] - xtmp;
+    dely = x[j][1] - ytmp;
+    delz = x[j][2] - ztmp;
+    rsq = delx * delx + dely * dely + delz * delz;
+    if (rsq < (cutoff_val * cutoff_val))
+      n_inner++;
+  }
+
+  // The workspace only grows, so that it stops allocating once it fits the
+  // largest environment.
+  work.resize(n_species, n_max, l_max, n_inner);
+
+  // Compute covariant descriptors.
+  single_bond_multiple_cutoffs(x, type, jnum, n_inner, i, xtmp, ytmp, ztmp,
+                               jlist, basis_function, cutoff_function,
+                               n_species, n_max, l_max, radial_hyps,
+                               cutoff_hyps, cutoff_matrix, work);
+
+  // Compute invariant descriptors.
+  B2_descriptor(norm_squared, n_inner, n_species, n_max, l_max, work);
+
+  // Skip the atom if the environment is empty.
+  return norm_squared >= empty_thresh;
+}
+
+/* ---------------------------------------------------------------------- */
+
+void PairFLARE::compute_forces(double norm_squared, int n_inner,
+                               double &evdwl, DescriptorWorkspace &work) {
+  // Compute local energy and partial forces.
+  int n_rows = n_inner * 3;
+  evdwl = work.B2_vals.dot(work.beta_p) / norm_squared;
+
+  // The product is evaluated directly into the workspace, which a single
+  // expression would store in a temporary.
+  Eigen::Ref<Eigen::VectorXd> partial_forces =
+      work.partial_forces.head(n_rows);
+  partial_forces.noalias() = -work.B2_env_dervs.topRows(n_rows) * work.beta_p;
+  partial_forces =
+      2 * (partial_forces + evdwl * work.B2_env_dot.head(n_rows)) /
+      norm_squared;
+}
+
+/* ----------------------------------------------------------------------
+   add the forces, virial and energy of atom i
+------------------------------------------------------------------------- */
+
+void PairFLARE::tally_atom(int i, double evdwl, const double *partial_forces,
+                           int eflag, int vflag) {
+  int j, itype, jnum, n_count;
+  double delx, dely, delz, xtmp, ytmp, ztmp, rsq;
+  int *jlist;
+
+  double **x = atom->x;
+  double **f = atom->f;
+  int *type = atom->type;
+  int nlocal = atom->nlocal;
+  int newton_pair = force->newton_pair;
+
+  itype = type[i];
+  jnum = list->numneigh[i];
+  xtmp = x[i][0];
+  ytmp = x[i][1];
+  ztmp = x[i][2];
+  jlist = list->firstneigh[i];
+
+  // Update energy, force and stress arrays.
+  n_count = 0;
+  for (int jj = 0; jj < jnum; jj++) {
+    j = jlist[jj];
+    int s = type[j] - 1;
+    double cutoff_val = cutoff_matrix(itype-1, s);
+    delx = xtmp - x[j][0];
+    dely = ytmp - x[j][1];
+    delz = ztmp - x[j][2];
+    rsq = delx * delx + dely * dely + delz * delz;
+
+    if (rsq < (cutoff_val * cutoff_val)) {
+      double fx = -partial_forces[n_count * 3];
+      double fy = -partial_forces[n_count * 3 + 1];
+      double fz = -partial_forces[n_count * 3 + 2];
+      f[i][0] += fx;
+      f[i][1] += fy;
+      f[i][2] += fz;
+      f[j][0] -= fx;
+      f[j][1] -= fy;
+      f[j][2] -= fz;
+
+      if (vflag) {
+        ev_tally_xyz(i, j, nlocal, newton_pair, 0.0, 0.0, fx, fy, fz, delx,
+                     dely, delz);
+      }
+      n_count++;
+    }
+  }
+
+  // Compute local energy.
+  if (eflag)
+    ev_tally_full(i, 2.0 * evdwl, 0.0, 0.0, 0.0, 0.0, 0.0);
 }
 
 /* ----------------------------------------------------------------------
@@ -186,10 +329,24 @@ void PairFLARE::allocate() {
    global settings
 ------------------------------------------------------------------------- */
 
-void PairFLARE::settings(int narg, char ** /*arg*/) {
-  // "flare" should be the only word after "pair_style" in the input file.
-  if (narg > 0)
+void PairFLARE::settings(int narg, char **arg) {
+  // "flare" may be followed by "batch N", to evaluate the energies of N
+  // atoms at a time. Each atom of a batch keeps its descriptor derivatives,
+  // 3 * n_inner * n_descriptors doubles, and the matrix products gain
+  // little beyond a few hundred atoms, so N is at most MAXBATCH.
+  batch_size = 0;
+  if (narg == 0)
+    return;
+  if (narg != 2 || strcmp(arg[0], "batch") != 0)
     error->all(FLERR, "Illegal pair_style command");
+  batch_size = utils::inumeric(FLERR, arg[1], false, lmp);
+  if (batch_size < 0)
+    error->all(FLERR, "Illegal pair_style command");
+  if (batch_size > MAXBATCH) {
+    char str[128];
+    snprintf(str, 128, "Pair flare batch size must be at most %d", MAXBATCH);
+    error->all(FLERR, str);
+  }
 }
 
 /* ----------------------------------------------------------------------
@@ -237,6 +394,28 @@ double PairFLARE::init_one(int i, int j) {
   return cutoff;
 }
 
+/* ----------------------------------------------------------------------
+   memory usage of beta and the descriptor buffers
+------------------------------------------------------------------------- */
+
+double PairFLARE::memory_usage() {
+  double bytes = Pair::memory_usage();
+  if (beta != NULL)
+    bytes += (double)beta_size * n_species * sizeof(double);
+  bytes += workspace.memory_usage();
+
+  // Batch buffers.
+  for (std::size_t k = 0; k < batch_workspaces.size(); k++)
+    bytes += batch_workspaces[k].memory_usage();
+  bytes += (batch_n_inner.capacity() + batch_columns.capacity()) * sizeof(int);
+  bytes += (batch_norms.capacity() + batch_energies.capacity()) *
+           sizeof(double);
+  bytes += batch_nonempty.capacity() * sizeof(char);
+  bytes += (B2_batch.size() + beta_batch.size() + beta_panel.size()) *
+           sizeof(double);
+  return bytes;
+}
+
 /* ----------------------------------------------------------------------
    read potential values from a DYNAMO single element funcfl file
 ------------------------------------------------------------------------- */
@@ -327,26 +506,19 @@ void PairFLARE::read_file(char *filename) {
     grab(fptr, beta_size * n_species, beta);
   MPI_Bcast(beta, beta_size * n_species, MPI_DOUBLE, 0, world);
 
-  // Fill in the beta matrix.
+  // Beta is kept as the packed upper triangle of a symmetric matrix for each
+  // species, which is the order of the file, with the off-diagonal entries
+  // halved.
   // TODO: Remove factor of 2 from beta.
-  Eigen::MatrixXd beta_matrix;
   int beta_count = 0;
-  double beta_val;
   for (int k = 0; k < n_species; k++) {
-    beta_matrix = Eigen::MatrixXd::Zero(n_descriptors, n_descriptors);
     for (int i = 0; i < n_descriptors; i++) {
       for (int j = i; j < n_descriptors; j++) {
-        if (i == j)
-          beta_matrix(i, j) = beta[beta_count];
-        else if (i != j) {
-          beta_val = beta[beta_count] / 2;
-          beta_matrix(i, j) = beta_val;
-          beta_matrix(j, i) = beta_val;
-        }
+        if (i != j)
+          beta[beta_count] /= 2;
         beta_count++;
       }
     }
-    beta_matrices.push_back(beta_matrix);
   }
 }
 
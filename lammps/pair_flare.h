@@ -10,6 +10,7 @@ PairStyle(flare, PairFLARE)
 #ifndef LMP_PAIR_FLARE_H
 #define LMP_PAIR_FLARE_H
 
+#include "lammps_descriptor.h"
 #include "pair.h"
 #include <Eigen/Dense>
 #include <cstdio>
@@ -26,23 +27,78 @@ public:
   virtual void coeff(int, char **);
   void init_style();
   double init_one(int, int);
+  virtual double memory_usage();
 
 protected:
   int n_species, n_max, l_max, n_descriptors, beta_size;
 
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       basis_function;
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_function;
 
   std::vector<double> radial_hyps, cutoff_hyps;
 
   double cutoff;
-  double *beta, *cutoffs;
-  Eigen::MatrixXd beta_matrix, cutoff_matrix;
-  std::vector<Eigen::MatrixXd> beta_matrices;
+  // Packed upper triangles of the symmetric beta matrices of the species,
+  // beta_size entries each.
+  double *beta;
+  double *cutoffs;
+  Eigen::MatrixXd cutoff_matrix;
+
+  // Descriptor buffers of the serial style, sized for the largest number
+  // of neighbors inside the cutoff seen so far.
+  DescriptorWorkspace workspace;
+
+  // Number of atoms whose energies are evaluated together in batched mode,
+  // or 0 to evaluate them one at a time. At most MAXBATCH (see settings).
+  int batch_size;
+
+  // Descriptors of the atoms of a batch, with the number of neighbors
+  // inside the cutoff, descriptor norms and local energies of each, and
+  // the stacked descriptors and beta products of the atoms of one species,
+  // and the buffer of the panels of beta unpacked by packed_symm.
+  std::vector<DescriptorWorkspace> batch_workspaces;
+  std::vector<int> batch_n_inner, batch_columns;
+  std::vector<double> batch_norms, batch_energies;
+  std::vector<char> batch_nonempty;
+  Eigen::MatrixXd B2_batch, beta_batch;
+  PackedPanel beta_panel;
+
+  // Compute the local energy of atom i and the partial forces on its
+  // n_inner neighbors inside the cutoff, which are stored in
+  // work.partial_forces. Returns false if the environment is empty. Only
+  // reads shared data, so it can be called from several threads with
+  // different workspaces.
+  bool compute_atom(int i, double &evdwl, int &n_inner,
+                    DescriptorWorkspace &work);
+
+  // The two halves of compute_atom. compute_descriptors grows work to fit
+  // the neighbors inside the cutoff and returns false if the environment is
+  // empty, and compute_forces expects the product of beta and the
+  // descriptor in work.beta_p.
+  bool compute_descriptors(int i, int &n_inner, double &norm_squared,
+                           DescriptorWorkspace &work);
+  void compute_forces(double norm_squared, int n_inner, double &evdwl,
+                      DescriptorWorkspace &work);
+
+  // Size the batch arrays for the current neighbor list. The workspaces of
+  // the batch are sized for each atom by compute_descriptors.
+  void resize_batch();
+
+  // Multiply the descriptors of the n_atoms atoms of a batch, starting at
+  // ilist[first], by the beta matrices, with one matrix product for each
+  // species, and store the products in the batch workspaces.
+  void contract_batch(int first, int n_atoms);
+
+  // Evaluate the atoms in batches of batch_size atoms.
+  virtual void compute_batched(int eflag, int vflag);
+
+  // Add the forces, virial and energy of atom i.
+  void tally_atom(int i, double evdwl, const double *partial_forces,
+                  int eflag, int vflag);
 
   virtual void allocate();
   virtual void read_file(char *);
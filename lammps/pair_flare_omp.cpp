@@ -0,0 +1,140 @@
+#include "pair_flare_omp.h"
+#include "atom.h"
+#include "comm.h"
+#include "neigh_list.h"
+#include "suffix.h"
+#include <algorithm>
+
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+
+using namespace LAMMPS_NS;
+
+/* ---------------------------------------------------------------------- */
+
+PairFLAREOMP::PairFLAREOMP(LAMMPS *lmp) : PairFLARE(lmp) {
+  suffix_flag |= Suffix::OMP;
+  respa_enable = 0;
+}
+
+/* ----------------------------------------------------------------------
+   the descriptors, local energies and partial forces of the atoms are
+   computed in parallel, and are then tallied on one thread in the order of
+   the serial style, so that energies, forces and virials are bitwise
+   identical to pair_style flare and need no reduction over threads
+------------------------------------------------------------------------- */
+
+void PairFLAREOMP::compute(int eflag, int vflag) {
+  if (batch_size > 0) {
+    compute_batched(eflag, vflag);
+    return;
+  }
+
+  ev_init(eflag, vflag);
+
+  int inum = list->inum;
+  int *ilist = list->ilist;
+  int *numneigh = list->numneigh;
+  if (inum > (int) local_energies.size()) {
+    local_energies.resize(inum);
+    force_offsets.resize(inum + 1);
+    nonempty.resize(inum);
+  }
+
+  // Each atom gets room for the partial forces on all of its neighbors.
+  force_offsets[0] = 0;
+  for (int ii = 0; ii < inum; ii++)
+    force_offsets[ii + 1] = force_offsets[ii] + 3 * numneigh[ilist[ii]];
+  if (force_offsets[inum] > (long) partial_forces.size())
+    partial_forces.resize(force_offsets[inum]);
+
+  // The workspaces are sized by compute_descriptors.
+  if (comm->nthreads > (int) workspaces.size())
+    workspaces.resize(comm->nthreads);
+
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic) num_threads(comm->nthreads)
+#endif
+  for (int ii = 0; ii < inum; ii++) {
+#if defined(_OPENMP)
+    DescriptorWorkspace &work = workspaces[omp_get_thread_num()];
+#else
+    DescriptorWorkspace &work = workspaces[0];
+#endif
+    int n_inner;
+    nonempty[ii] = compute_atom(ilist[ii], local_energies[ii], n_inner, work);
+    if (nonempty[ii])
+      std::copy(work.partial_forces.data(),
+                work.partial_forces.data() + 3 * n_inner,
+                partial_forces.data() + force_offsets[ii]);
+  }
+
+  for (int ii = 0; ii < inum; ii++) {
+    if (nonempty[ii])
+      tally_atom(ilist[ii], local_energies[ii],
+                 partial_forces.data() + force_offsets[ii], eflag, vflag);
+  }
+
+  if (vflag_fdotr)
+    virial_fdotr_compute();
+}
+
+/* ----------------------------------------------------------------------
+   as in pair_style flare, with the descriptors and partial forces of the
+   atoms of a batch computed in parallel
+------------------------------------------------------------------------- */
+
+void PairFLAREOMP::compute_batched(int eflag, int vflag) {
+  ev_init(eflag, vflag);
+
+  resize_batch();
+
+  int inum = list->inum;
+  int *ilist = list->ilist;
+  for (int first = 0; first < inum; first += batch_size) {
+    int n_atoms = std::min(batch_size, inum - first);
+
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic) num_threads(comm->nthreads)
+#endif
+    for (int k = 0; k < n_atoms; k++) {
+      batch_nonempty[k] =
+          compute_descriptors(ilist[first + k], batch_n_inner[k],
+                              batch_norms[k], batch_workspaces[k]);
+    }
+
+    contract_batch(first, n_atoms);
+
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic) num_threads(comm->nthreads)
+#endif
+    for (int k = 0; k < n_atoms; k++) {
+      if (batch_nonempty[k])
+        compute_forces(batch_norms[k], batch_n_inner[k], batch_energies[k],
+                       batch_workspaces[k]);
+    }
+
+    for (int k = 0; k < n_atoms; k++) {
+      if (batch_nonempty[k])
+        tally_atom(ilist[first + k], batch_energies[k],
+                   batch_workspaces[k].partial_forces.data(), eflag, vflag);
+    }
+  }
+
+  if (vflag_fdotr)
+    virial_fdotr_compute();
+}
+
+/* ---------------------------------------------------------------------- */
+
+double PairFLAREOMP::memory_usage() {
+  double bytes = PairFLARE::memory_usage();
+  bytes += local_energies.capacity() * sizeof(double);
+  bytes += partial_forces.capacity() * sizeof(double);
+  bytes += force_offsets.capacity() * sizeof(long);
+  bytes += nonempty.capacity() * sizeof(char);
+  for (std::size_t t = 0; t < workspaces.size(); t++)
+    bytes += workspaces[t].memory_usage();
+  return bytes;
+}
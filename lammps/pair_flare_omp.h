@@ -0,0 +1,39 @@
+// OpenMP version of pair_flare.h
+
+#ifdef PAIR_CLASS
+
+PairStyle(flare/omp, PairFLAREOMP)
+
+#else
+
+#ifndef LMP_PAIR_FLARE_OMP_H
+#define LMP_PAIR_FLARE_OMP_H
+
+#include "pair_flare.h"
+#include <vector>
+
+namespace LAMMPS_NS {
+
+class PairFLAREOMP : public PairFLARE {
+public:
+  PairFLAREOMP(class LAMMPS *);
+  virtual void compute(int, int);
+  virtual double memory_usage();
+
+protected:
+  virtual void compute_batched(int, int);
+
+  // Descriptor buffers of each thread, and the local energies and partial
+  // forces of the atoms in the neighbor list. The partial forces of atom
+  // ilist[ii] start at force_offsets[ii]. All are kept between steps and
+  // only grow, so that steps after the first don't allocate.
+  std::vector<DescriptorWorkspace> workspaces;
+  std::vector<double> local_energies, partial_forces;
+  std::vector<long> force_offsets;
+  std::vector<char> nonempty;
+};
+
+} // namespace LAMMPS_NS
+
+#endif
+#endif
@@ -1,5 +1,6 @@
 #include "kernel.h"
 #include "structure.h"
+#include "neighbor_list.h"
 #include "y_grad.h"
 #include "sparse_gp.h"
 #include "b2.h"
@@ -31,6 +32,9 @@ PYBIND11_MODULE(_C_flare, m) {
       .def(py::init<const Eigen::MatrixXd &, const std::vector<int> &,
                     const Eigen::MatrixXd &, double,
                     std::vector<Descriptor *>>())
+      .def(py::init<const Eigen::MatrixXd &, const std::vector<int> &,
+                    const Eigen::MatrixXd &, NeighborList &,
+                    std::vector<Descriptor *>>())
       .def_readwrite("noa", &Structure::noa)
       .def_readwrite("cell", &Structure::cell)
       .def_readwrite("species", &Structure::species)
@@ -48,9 +52,20 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readonly("descriptor_calculators",
                     &Structure::descriptor_calculators)
       .def("compute_descriptors", &Structure::compute_descriptors)
+      .def("release_descriptors", &Structure::release_descriptors)
       .def("wrap_positions", &Structure::wrap_positions)
       .def_static("to_json", &Structure::to_json)
-      .def_static("from_json", &Structure::from_json);
+      .def_static("from_json", &Structure::from_json)
+      .def_static("to_binary", &Structure::to_binary)
+      .def_static("from_binary", &Structure::from_binary)
+      .def_static("json_to_binary", &Structure::json_to_binary);
+
+  // Persistent neighbor list
+  py::class_<NeighborList>(m, "NeighborList")
+      .def(py::init<double, double>())
+      .def_readonly("cutoff", &NeighborList::cutoff)
+      .def_readonly("skin", &NeighborList::skin)
+      .def_readonly("n_builds", &NeighborList::n_builds);
 
   // Descriptor values
   py::class_<DescriptorValues>(m, "DescriptorValues")
@@ -77,7 +92,9 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readwrite("n_clusters_by_type",
                      &DescriptorValues::n_clusters_by_type)
       .def_readwrite("n_neighbors_by_type",
-                     &DescriptorValues::n_neighbors_by_type);
+                     &DescriptorValues::n_neighbors_by_type)
+      .def_readonly("compact", &DescriptorValues::compact)
+      .def("compress_force_dervs", &DescriptorValues::compress_force_dervs);
 
   py::class_<ClusterDescriptor>(m, "ClusterDescriptor")
       .def_readonly("descriptors", &ClusterDescriptor::descriptors);
@@ -133,7 +150,8 @@ PYBIND11_MODULE(_C_flare, m) {
                     const std::vector<int> &>());
 
   // Kernel functions
-  py::class_<Kernel>(m, "Kernel");
+  py::class_<Kernel>(m, "Kernel")
+      .def_readwrite("single_precision", &Kernel::single_precision);
 
   py::class_<NormalizedDotProduct, Kernel>(m, "NormalizedDotProduct")
       .def(py::init<double, double>())
@@ -156,11 +174,35 @@ PYBIND11_MODULE(_C_flare, m) {
       .def(py::init<>())
       .def(py::init<std::vector<Kernel *>, double, double, double>())
       .def("set_hyperparameters", &SparseGP::set_hyperparameters)
-      .def("predict_mean", &SparseGP::predict_mean)
-      .def("predict_SOR", &SparseGP::predict_SOR)
-      .def("predict_DTC", &SparseGP::predict_DTC)
+      .def("predict_mean",
+           static_cast<void (SparseGP::*)(Structure &)>(
+               &SparseGP::predict_mean))
+      .def("predict_SOR",
+           static_cast<void (SparseGP::*)(Structure &)>(
+               &SparseGP::predict_SOR))
+      .def("predict_DTC",
+           static_cast<void (SparseGP::*)(Structure &)>(
+               &SparseGP::predict_DTC))
+      .def("predict_local_uncertainties",
+           static_cast<void (SparseGP::*)(Structure &)>(
+               &SparseGP::predict_local_uncertainties))
+      // Batched predictions release the GIL for the whole batch.
+      .def("predict_mean",
+           static_cast<void (SparseGP::*)(const std::vector<Structure *> &)>(
+               &SparseGP::predict_mean),
+           py::call_guard<py::gil_scoped_release>())
+      .def("predict_SOR",
+           static_cast<void (SparseGP::*)(const std::vector<Structure *> &)>(
+               &SparseGP::predict_SOR),
+           py::call_guard<py::gil_scoped_release>())
+      .def("predict_DTC",
+           static_cast<void (SparseGP::*)(const std::vector<Structure *> &)>(
+               &SparseGP::predict_DTC),
+           py::call_guard<py::gil_scoped_release>())
       .def("predict_local_uncertainties",
-           &SparseGP::predict_local_uncertainties)
+           static_cast<void (SparseGP::*)(const std::vector<Structure *> &)>(
+               &SparseGP::predict_local_uncertainties),
+           py::call_guard<py::gil_scoped_release>())
       .def("add_all_environments", &SparseGP::add_all_environments)
       .def("add_specific_environments", &SparseGP::add_specific_environments)
       .def("add_random_environments", &SparseGP::add_random_environments)
@@ -172,11 +214,28 @@ PYBIND11_MODULE(_C_flare, m) {
       .def("compute_likelihood_stable", &SparseGP::compute_likelihood_stable)
       .def("compute_likelihood_gradient",
            &SparseGP::compute_likelihood_gradient)
+      .def("compute_batch_likelihood_gradient",
+           &SparseGP::compute_batch_likelihood_gradient,
+           py::arg("hyperparameters"), py::arg("structures"),
+           py::arg("n_probes") = 0, py::arg("seed") = 0,
+           py::call_guard<py::gil_scoped_release>())
+      // The optimizer runs in C++, so the GIL is released for all steps.
+      .def("optimize_hyperparameters_adam",
+           &SparseGP::optimize_hyperparameters_adam, py::arg("n_steps"),
+           py::arg("batch_size"), py::arg("learning_rate") = 0.01,
+           py::arg("n_probes") = 0, py::arg("seed") = 0,
+           py::call_guard<py::gil_scoped_release>())
+      .def("clear_kernel_caches", &SparseGP::clear_kernel_caches)
       .def("write_mapping_coefficients", &SparseGP::write_mapping_coefficients)
       .def_readonly("varmap_coeffs", &SparseGP::varmap_coeffs) // for debugging and unit test
       .def("compute_cluster_uncertainties", &SparseGP::compute_cluster_uncertainties) // for debugging and unit test
       .def("write_varmap_coefficients", &SparseGP::write_varmap_coefficients)
       .def_readwrite("Kuu_jitter", &SparseGP::Kuu_jitter)
+      .def_readwrite("compact_force_dervs", &SparseGP::compact_force_dervs)
+      .def_readwrite("frozen_hyperparameters",
+                     &SparseGP::frozen_hyperparameters)
+      .def("release_training_descriptors",
+           &SparseGP::release_training_descriptors)
       .def_readonly("complexity_penalty", &SparseGP::complexity_penalty)
       .def_readonly("data_fit", &SparseGP::data_fit)
       .def_readonly("constant_term", &SparseGP::constant_term)
@@ -195,16 +254,26 @@ PYBIND11_MODULE(_C_flare, m) {
       .def_readonly("energy_noise", &SparseGP::energy_noise)
       .def_readonly("stress_noise", &SparseGP::stress_noise)
       .def_readonly("noise_vector", &SparseGP::noise_vector)
-      .def_readonly("Kuu", &SparseGP::Kuu)
+      .def_property_readonly("Kuu", &SparseGP::stacked_Kuu)
       .def_readonly("Kuu_kernels", &SparseGP::Kuu_kernels)
-      .def_readonly("Kuf", &SparseGP::Kuf)
-      .def_readonly("Kuf_kernels", &SparseGP::Kuf_kernels)
+      .def_property_readonly("Kuf", &SparseGP::stacked_Kuf)
+      .def_property_readonly("Kuf_kernels",
+                             [](const SparseGP &gp) {
+                               std::vector<Eigen::MatrixXd> kernels;
+                               for (int i = 0; i < gp.n_kernels; i++) {
+                                 kernels.push_back(gp.Kuf_kernels[i].dense());
+                               }
+                               return kernels;
+                             })
       .def_readonly("alpha", &SparseGP::alpha)
-      .def_readonly("Kuu_inverse", &SparseGP::Kuu_inverse)
-      .def_readonly("Sigma", &SparseGP::Sigma)
+      .def_property_readonly("Kuu_inverse", &SparseGP::compute_Kuu_inverse)
+      .def_property_readonly("Sigma", &SparseGP::compute_Sigma)
       .def_readonly("n_sparse", &SparseGP::n_sparse)
       .def_readonly("n_labels", &SparseGP::n_labels)
       .def_readonly("y", &SparseGP::y)
       .def_static("to_json", &SparseGP::to_json)
-      .def_static("from_json", &SparseGP::from_json);
+      .def_static("from_json", &SparseGP::from_json)
+      .def_static("to_binary", &SparseGP::to_binary)
+      .def_static("from_binary", &SparseGP::from_binary)
+      .def_static("json_to_binary", &SparseGP::json_to_binary);
 }
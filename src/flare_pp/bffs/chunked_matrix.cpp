@@ -0,0 +1,126 @@
+#include "chunked_matrix.h"
+#include <algorithm>
+
+const int ChunkedMatrix ::chunk_capacity;
+
+ChunkedMatrix ::ChunkedMatrix() {}
+
+ChunkedMatrix ::ChunkedMatrix(int n_rows) { this->n_rows = n_rows; }
+
+ChunkedMatrix ::ChunkedMatrix(const Eigen::MatrixXd &matrix)
+    : ChunkedMatrix(Eigen::MatrixXd(matrix)) {}
+
+ChunkedMatrix ::ChunkedMatrix(Eigen::MatrixXd &&matrix) {
+  n_rows = matrix.rows();
+  if (matrix.cols() == 0)
+    return;
+  n_cols = matrix.cols();
+  chunks.push_back(std::move(matrix));
+  chunk_starts.push_back(0);
+  chunk_cols.push_back(n_cols);
+}
+
+int ChunkedMatrix ::rows() const { return n_rows; }
+
+int ChunkedMatrix ::cols() const { return n_cols; }
+
+int ChunkedMatrix ::n_chunks() const { return chunks.size(); }
+
+Eigen::Block<const Eigen::MatrixXd> ChunkedMatrix ::chunk(int c) const {
+  return chunks[c].block(0, 0, n_rows, chunk_cols[c]);
+}
+
+void ChunkedMatrix ::append_cols(const Eigen::MatrixXd &block) {
+  int n_block = block.cols();
+  if (n_block == 0)
+    return;
+  if (n_cols == 0)
+    n_rows = block.rows();
+
+  // Start a new chunk if the block does not fit in the last one. Chunks
+  // have a fixed capacity, so that the spare columns are bounded.
+  int n_last = chunks.size() - 1;
+  if (chunks.size() == 0 ||
+      chunks[n_last].cols() - chunk_cols[n_last] < n_block) {
+    int capacity = std::max(n_block, chunk_capacity);
+    chunks.push_back(Eigen::MatrixXd(n_rows, capacity));
+    chunk_starts.push_back(n_cols);
+    chunk_cols.push_back(0);
+    n_last++;
+  }
+
+  chunks[n_last].middleCols(chunk_cols[n_last], n_block) = block;
+  chunk_cols[n_last] += n_block;
+  n_cols += n_block;
+}
+
+int ChunkedMatrix ::find_chunk(int col) const {
+  return std::upper_bound(chunk_starts.begin(), chunk_starts.end(), col) -
+         chunk_starts.begin() - 1;
+}
+
+Eigen::Block<Eigen::MatrixXd> ChunkedMatrix ::block(int row, int col,
+                                                    int n_block_rows,
+                                                    int n_block_cols) {
+  int c = find_chunk(col);
+  return chunks[c].block(row, col - chunk_starts[c], n_block_rows,
+                         n_block_cols);
+}
+
+Eigen::MatrixXd ChunkedMatrix ::middle_cols(int start, int n) const {
+  Eigen::MatrixXd matrix(n_rows, n);
+  int end = start + n;
+  for (int c = std::max(find_chunk(start), 0);
+       c < chunks.size() && chunk_starts[c] < end; c++) {
+    int first = std::max(start, chunk_starts[c]);
+    int last = std::min(end, chunk_starts[c] + chunk_cols[c]);
+    matrix.middleCols(first - start, last - first) =
+        chunks[c].middleCols(first - chunk_starts[c], last - first);
+  }
+  return matrix;
+}
+
+void ChunkedMatrix ::expand_rows(int n_new_rows,
+                                 const std::vector<int> &new_rows) {
+  for (int c = 0; c < chunks.size(); c++) {
+    Eigen::MatrixXd expanded =
+        Eigen::MatrixXd::Zero(n_new_rows, chunks[c].cols());
+    for (int r = 0; r < new_rows.size(); r++) {
+      expanded.row(new_rows[r]).head(chunk_cols[c]) =
+          chunks[c].row(r).head(chunk_cols[c]);
+    }
+    chunks[c].swap(expanded);
+  }
+  n_rows = n_new_rows;
+}
+
+void ChunkedMatrix ::assign(const Eigen::MatrixXd &matrix) {
+  for (int c = 0; c < chunks.size(); c++) {
+    chunks[c].leftCols(chunk_cols[c]) =
+        matrix.middleCols(chunk_starts[c], chunk_cols[c]);
+  }
+}
+
+Eigen::MatrixXd ChunkedMatrix ::dense() const {
+  Eigen::MatrixXd matrix(n_rows, n_cols);
+  for (int c = 0; c < chunks.size(); c++) {
+    matrix.middleCols(chunk_starts[c], chunk_cols[c]) = chunk(c);
+  }
+  return matrix;
+}
+
+Eigen::VectorXd
+ChunkedMatrix ::transpose_product(const Eigen::VectorXd &x) const {
+  Eigen::VectorXd product(n_cols);
+  for (int c = 0; c < chunks.size(); c++) {
+    product.segment(chunk_starts[c], chunk_cols[c]).noalias() =
+        chunk(c).transpose() * x;
+  }
+  return product;
+}
+
+void to_json(nlohmann::json &j, const ChunkedMatrix &p) { j = p.dense(); }
+
+void from_json(const nlohmann::json &j, ChunkedMatrix &p) {
+  p = ChunkedMatrix(j.get<Eigen::MatrixXd>());
+}
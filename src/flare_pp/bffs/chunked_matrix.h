@@ -0,0 +1,89 @@
+#ifndef CHUNKED_MATRIX_H
+#define CHUNKED_MATRIX_H
+
+#include <Eigen/Dense>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "json.h"
+
+/**
+ * Matrix stored as a list of column chunks, for kernel matrices that grow by
+ * blocks of columns, such as Kuf, which gains the labels of one training
+ * structure at a time. Chunks are allocated with spare columns: an appended
+ * block is copied into the last chunk if it fits, and otherwise into a new
+ * chunk with room for chunk_capacity columns, or for the block if it is
+ * larger. Existing columns are never copied when the matrix grows, the spare
+ * columns of the last chunk are fewer than chunk_capacity, and every
+ * appended block lies in a single chunk.
+ */
+class ChunkedMatrix {
+public:
+  ChunkedMatrix();
+
+  /** Matrix with n_rows rows and no columns. */
+  explicit ChunkedMatrix(int n_rows);
+
+  /**
+   * Matrix with the entries of matrix, stored in a single chunk without
+   * spare columns.
+   */
+  ChunkedMatrix(const Eigen::MatrixXd &matrix);
+
+  /** As above, taking over the memory of matrix instead of copying it. */
+  ChunkedMatrix(Eigen::MatrixXd &&matrix);
+
+  /** Number of columns allocated for a new chunk. */
+  static const int chunk_capacity = 1024;
+
+  int n_rows = 0, n_cols = 0;
+  std::vector<Eigen::MatrixXd> chunks;
+
+  // First column and number of used columns of each chunk.
+  std::vector<int> chunk_starts, chunk_cols;
+
+  int rows() const;
+  int cols() const;
+  int n_chunks() const;
+
+  /** Used columns of chunk c, which start at column chunk_starts[c]. */
+  Eigen::Block<const Eigen::MatrixXd> chunk(int c) const;
+
+  /** Append a block of columns with the same number of rows. */
+  void append_cols(const Eigen::MatrixXd &block);
+
+  /**
+   * Writable view of a block of the matrix. The columns of the block must
+   * lie within a single appended block.
+   */
+  Eigen::Block<Eigen::MatrixXd> block(int row, int col, int n_block_rows,
+                                      int n_block_cols);
+
+  /** Copy of n columns starting at column start. */
+  Eigen::MatrixXd middle_cols(int start, int n) const;
+
+  /**
+   * Resize the matrix to n_new_rows rows, moving row r to row new_rows[r].
+   * The remaining rows are set to zero. The chunks are resized one at a
+   * time, so that at most one chunk is copied at once.
+   */
+  void expand_rows(int n_new_rows, const std::vector<int> &new_rows);
+
+  /** Copy a matrix of the same size into the existing chunks. */
+  void assign(const Eigen::MatrixXd &matrix);
+
+  /** Assemble the matrix in contiguous memory. */
+  Eigen::MatrixXd dense() const;
+
+  /** Return the product M^T x. */
+  Eigen::VectorXd transpose_product(const Eigen::VectorXd &x) const;
+
+private:
+  int find_chunk(int col) const;
+};
+
+// The matrix is serialized as a dense matrix, so that files do not depend on
+// the chunks.
+void to_json(nlohmann::json &j, const ChunkedMatrix &p);
+void from_json(const nlohmann::json &j, ChunkedMatrix &p);
+
+#endif
@@ -1,10 +1,13 @@
 #include "sparse_gp.h"
+#include "omp.h"
 #include <algorithm> // Random shuffle
 #include <chrono>
 #include <fstream> // File operations
 #include <iomanip> // setprecision
 #include <iostream>
 #include <numeric> // Iota
+#include <random>
+#include <stdexcept>
 
 SparseGP ::SparseGP() {}
 
@@ -48,7 +51,7 @@ SparseGP ::SparseGP(std::vector<Kernel *> kernels, double energy_noise,
   Eigen::MatrixXd empty_matrix;
   for (int i = 0; i < kernels.size(); i++) {
     Kuu_kernels.push_back(empty_matrix);
-    Kuf_kernels.push_back(empty_matrix);
+    Kuf_kernels.push_back(ChunkedMatrix());
   }
 }
 
@@ -104,22 +107,22 @@ SparseGP ::compute_cluster_uncertainties(const Structure &structure) {
   std::vector<Eigen::MatrixXd> sparse_kernels;
   int sparse_count = 0;
   for (int i = 0; i < n_kernels; i++) {
-    K_self.push_back(
-        (kernels[i]->envs_envs(cluster_descriptors[i], cluster_descriptors[i],
-                               kernels[i]->kernel_hyperparameters))
-            .diagonal());
+    K_self.push_back(kernels[i]->envs_envs_diagonal(
+        cluster_descriptors[i], kernels[i]->kernel_hyperparameters));
 
     sparse_kernels.push_back(
         kernels[i]->envs_envs(cluster_descriptors[i], sparse_descriptors[i],
                               kernels[i]->kernel_hyperparameters));
 
     int n_clusters = sparse_descriptors[i].n_clusters;
-    Eigen::MatrixXd L_inverse_block =
-        L_inv.block(sparse_count, sparse_count, n_clusters, n_clusters);
+    Eigen::MatrixXd kernel_mat =
+        Eigen::MatrixXd::Zero(n_sparse, cluster_descriptors[i].n_clusters);
+    kernel_mat.block(sparse_count, 0, n_clusters, kernel_mat.cols()) =
+        sparse_kernels[i].transpose();
     sparse_count += n_clusters;
 
-    Eigen::MatrixXd Q1 = L_inverse_block * sparse_kernels[i].transpose();
-    Q_self.push_back((Q1.transpose() * Q1).diagonal());
+    Eigen::MatrixXd Q1 = solve_Kuu_factor(kernel_mat);
+    Q_self.push_back(Q1.colwise().squaredNorm().transpose());
 
     variances.push_back(K_self[i] - Q_self[i]); // it is sorted by clusters, not the original atomic order 
     // TODO: If the environment is empty, the assigned uncertainty should be
@@ -167,8 +170,6 @@ void SparseGP ::add_specific_environments(const Structure &structure,
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   for (int i = 0; i < n_kernels; i++) {
@@ -208,8 +209,6 @@ void SparseGP ::add_uncertain_environments(const Structure &structure,
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   for (int i = 0; i < n_kernels; i++) {
@@ -268,8 +267,6 @@ void SparseGP ::add_random_environments(const Structure &structure,
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   for (int i = 0; i < n_kernels; i++) {
@@ -309,8 +306,6 @@ void SparseGP ::add_all_environments(const Structure &structure) {
   // Update Kuu and Kuf.
   update_Kuu(cluster_descriptors);
   update_Kuf(cluster_descriptors);
-  stack_Kuu();
-  stack_Kuf();
 
   // Store sparse environments.
   std::vector<int> added_indices;
@@ -326,7 +321,14 @@ void SparseGP ::add_all_environments(const Structure &structure) {
 void SparseGP ::update_Kuu(
     const std::vector<ClusterDescriptor> &cluster_descriptors) {
 
-  // Update Kuu matrices.
+  // The sparse set changes.
+  cache_generation = new_cache_generation();
+
+  // Update Kuu matrices. The kernels are independent, so they are assembled
+  // in parallel when there are at least as many kernels as threads.
+  // Otherwise each kernel parallelizes internally.
+  bool parallel_kernels = n_kernels >= omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) if (parallel_kernels)
   for (int i = 0; i < n_kernels; i++) {
     Eigen::MatrixXd prev_block =
         kernels[i]->envs_envs(sparse_descriptors[i], cluster_descriptors[i],
@@ -376,81 +378,179 @@ void SparseGP ::update_Kuu(
       n2 += n6;
     }
     Kuu_kernels[i] = kern_mat;
+  }
 
-    // Update sparse count.
-    this->n_sparse += n_envs;
-    }
+  // Update sparse count.
+  for (int i = 0; i < n_kernels; i++) {
+    this->n_sparse += cluster_descriptors[i].n_clusters;
   }
+}
 
 void SparseGP ::update_Kuf(
     const std::vector<ClusterDescriptor> &cluster_descriptors) {
 
-  // Compute kernels between new sparse environments and training structures.
+  // Move the kernels of the existing sparse environments to their new rows
+  // and find the rows of the new environments of each type.
+  std::vector<std::vector<int>> row_offsets(n_kernels);
   for (int i = 0; i < n_kernels; i++) {
     int n_sparse = sparse_descriptors[i].n_clusters;
     int n_envs = cluster_descriptors[i].n_clusters;
     int n_types = cluster_descriptors[i].n_types;
 
-    // Precompute indices.
-    Eigen::ArrayXi inds = Eigen::ArrayXi::Zero(n_types + 1);
-    int counter = 0;
-    for (int j = 0; j < n_types; j++) {
-      int t1 = sparse_descriptors[i].n_clusters_by_type[j];
-      int t2 = cluster_descriptors[i].n_clusters_by_type[j];
-      counter += t1 + t2;
-      inds(j + 1) = counter;
+    std::vector<int> new_rows;
+    int u_ind = 0;
+    for (int k = 0; k < n_types; k++) {
+      int n3 = sparse_descriptors[i].n_clusters_by_type[k];
+      int n4 = cluster_descriptors[i].n_clusters_by_type[k];
+      for (int j = 0; j < n3; j++) {
+        new_rows.push_back(u_ind + j);
+      }
+      row_offsets[i].push_back(u_ind + n3);
+      u_ind += n3 + n4;
     }
+    Kuf_kernels[i].expand_rows(n_sparse + n_envs, new_rows);
+  }
 
-    Eigen::MatrixXd kern_mat =
-        Eigen::MatrixXd::Zero(n_sparse + n_envs, n_labels);
+  // Compute kernels between new sparse environments and training structures.
+  std::vector<int> structures, columns;
+  for (int j = 0; j < n_strucs; j++) {
+    structures.push_back(j);
+    columns.push_back(label_count(j));
+  }
+  compute_Kuf_tiles(cluster_descriptors, structures, columns, row_offsets,
+                    Kuf_kernels);
+}
 
-#pragma omp parallel for
-    for (int j = 0; j < n_strucs; j++) {
-      int n_atoms = training_structures[j].noa;
-      Eigen::MatrixXd envs_struc_kernels = kernels[i]->envs_struc(
-          cluster_descriptors[i], training_structures[j].descriptors[i],
-          kernels[i]->kernel_hyperparameters);
+// Return the clusters of a single type. The other types are left empty.
+static ClusterDescriptor type_clusters(const ClusterDescriptor &envs,
+                                       int type) {
+  ClusterDescriptor single;
+  single.initialize_cluster(envs.n_types, envs.n_descriptors);
+  for (int s = 0; s < envs.n_types; s++) {
+    single.descriptors[s].resize(0, envs.n_descriptors);
+  }
+  single.descriptors[type] = envs.descriptors[type];
+  single.descriptor_norms[type] = envs.descriptor_norms[type];
+  single.cutoff_values[type] = envs.cutoff_values[type];
+  single.n_clusters_by_type[type] = envs.n_clusters_by_type[type];
+  single.n_clusters = envs.n_clusters_by_type[type];
+  for (int s = type + 1; s < envs.n_types; s++) {
+    single.cumulative_type_count[s] = single.n_clusters;
+  }
+  return single;
+}
 
-      int n1 = 0; // Sparse descriptor count
-      int n2 = 0; // Cluster descriptor count
-      for (int k = 0; k < n_types; k++) {
-        int current_count = 0;
-        int u_ind = inds(k);
-        int n3 = sparse_descriptors[i].n_clusters_by_type[k];
-        int n4 = cluster_descriptors[i].n_clusters_by_type[k];
-
-        if (training_structures[j].energy.size() != 0) {
-          kern_mat.block(u_ind, label_count(j), n3, 1) =
-              Kuf_kernels[i].block(n1, label_count(j), n3, 1);
-          kern_mat.block(u_ind + n3, label_count(j), n4, 1) =
-              envs_struc_kernels.block(n2, 0, n4, 1);
-
-          current_count += 1;
-        }
+// Copy the energy, force and stress kernels of a structure to the columns of
+// its labels.
+static void place_struc_kernels(ChunkedMatrix &kern_mat,
+                                const Eigen::MatrixXd &envs_struc_kernels,
+                                const Structure &structure, int row,
+                                int column) {
+  int n_rows = envs_struc_kernels.rows();
+  int n_atoms = structure.noa;
+  int current_count = column;
 
-        if (training_structures[j].forces.size() != 0) {
-          kern_mat.block(u_ind, label_count(j) + current_count, n3,
-                         n_atoms * 3) =
-              Kuf_kernels[i].block(n1, label_count(j) + current_count, n3,
-                                   n_atoms * 3);
-          kern_mat.block(u_ind + n3, label_count(j) + current_count, n4,
-                         n_atoms * 3) =
-              envs_struc_kernels.block(n2, 1, n4, n_atoms * 3);
-          current_count += n_atoms * 3;
-        }
+  if (structure.energy.size() != 0) {
+    kern_mat.block(row, current_count, n_rows, 1) =
+        envs_struc_kernels.block(0, 0, n_rows, 1);
+    current_count += 1;
+  }
 
-        if (training_structures[j].stresses.size() != 0) {
-          kern_mat.block(u_ind, label_count(j) + current_count, n3, 6) =
-              Kuf_kernels[i].block(n1, label_count(j) + current_count, n3, 6);
-          kern_mat.block(u_ind + n3, label_count(j) + current_count, n4, 6) =
-              envs_struc_kernels.block(n2, 1 + n_atoms * 3, n4, 6);
-        }
+  if (structure.forces.size() != 0) {
+    kern_mat.block(row, current_count, n_rows, n_atoms * 3) =
+        envs_struc_kernels.block(0, 1, n_rows, n_atoms * 3);
+    current_count += n_atoms * 3;
+  }
 
-        n1 += n3;
-        n2 += n4;
+  if (structure.stresses.size() != 0) {
+    kern_mat.block(row, current_count, n_rows, 6) =
+        envs_struc_kernels.block(0, 1 + n_atoms * 3, n_rows, 6);
+  }
+}
+
+void SparseGP ::compute_Kuf_tiles(
+    const std::vector<ClusterDescriptor> &envs,
+    const std::vector<int> &structures, const std::vector<int> &columns,
+    const std::vector<std::vector<int>> &row_offsets,
+    std::vector<ChunkedMatrix> &kern_mats) {
+
+  // A kernel or type of -1 stands for all kernels or types.
+  struct KufTile {
+    int kernel, structure, type;
+    double cost;
+  };
+
+  std::vector<std::vector<ClusterDescriptor>> type_envs(n_kernels);
+  for (int i = 0; i < n_kernels; i++) {
+    for (int k = 0; k < envs[i].n_types; k++) {
+      type_envs[i].push_back(type_clusters(envs[i], k));
+    }
+  }
+
+  // Estimate the cost of each tile from the number of environments times
+  // the number of atoms and neighbors it is compared with. Structures with
+  // released descriptors form a single tile, so that their descriptors are
+  // recomputed only once.
+  std::vector<KufTile> tiles;
+  for (int n = 0; n < structures.size(); n++) {
+    const Structure &struc = training_structures[structures[n]];
+    if (struc.descriptors_released()) {
+      int n_envs = 0;
+      for (int i = 0; i < n_kernels; i++) {
+        n_envs += envs[i].n_clusters;
+      }
+      KufTile tile = {-1, n, -1,
+                      double(n_envs) * (struc.noa + struc.n_neighbors)};
+      tiles.push_back(tile);
+      continue;
+    }
+
+    for (int i = 0; i < n_kernels; i++) {
+      const DescriptorValues &desc = struc.descriptors[i];
+      for (int k = 0; k < envs[i].n_types; k++) {
+        int n_envs = envs[i].n_clusters_by_type[k];
+        if (n_envs == 0)
+          continue;
+        KufTile tile = {
+            i, n, k,
+            double(n_envs) *
+                (desc.n_clusters_by_type[k] + desc.n_neighbors_by_type[k])};
+        tiles.push_back(tile);
+      }
+    }
+  }
+  std::stable_sort(tiles.begin(), tiles.end(),
+                   [](const KufTile &t1, const KufTile &t2) {
+                     return t1.cost > t2.cost;
+                   });
+
+  // With fewer tiles than threads, the tiles are processed in turn so that
+  // the kernels can parallelize internally.
+  int n_tiles = tiles.size();
+  bool parallel_tiles = n_tiles >= omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic, 1) if (parallel_tiles)
+  for (int t = 0; t < n_tiles; t++) {
+    const KufTile &tile = tiles[t];
+    Structure buffer;
+    const Structure &struc =
+        training_structures[structures[tile.structure]].materialize_descriptors(
+            buffer);
+
+    int first_kernel = (tile.kernel < 0) ? 0 : tile.kernel;
+    int last_kernel = (tile.kernel < 0) ? n_kernels : tile.kernel + 1;
+    for (int i = first_kernel; i < last_kernel; i++) {
+      int first_type = (tile.type < 0) ? 0 : tile.type;
+      int last_type = (tile.type < 0) ? envs[i].n_types : tile.type + 1;
+      for (int k = first_type; k < last_type; k++) {
+        if (envs[i].n_clusters_by_type[k] == 0)
+          continue;
+        Eigen::MatrixXd envs_struc_kernels = kernels[i]->envs_struc(
+            type_envs[i][k], struc.descriptors[i],
+            kernels[i]->kernel_hyperparameters);
+        place_struc_kernels(kern_mats[i], envs_struc_kernels, struc,
+                            row_offsets[i][k], columns[tile.structure]);
       }
     }
-    Kuf_kernels[i] = kern_mat;
   }
 }
 
@@ -462,29 +562,34 @@ void SparseGP ::add_training_structure(const Structure &structure) {
   int n_force = structure.forces.size();
   int n_stress = structure.stresses.size();
   int n_struc_labels = n_energy + n_force + n_stress;
-  int n_atoms = structure.noa;
 
-  // Update Kuf kernels.
-  Eigen::MatrixXd envs_struc_kernels;
+  // Store training structure. Kuf is computed from the stored copy, so that
+  // it is consistent with later updates when the copy is compact.
+  training_structures.push_back(structure);
+  Structure &stored = training_structures.back();
+  cache_generation = new_cache_generation();
+  if (compact_force_dervs) {
+    for (int i = 0; i < stored.descriptors.size(); i++) {
+      stored.descriptors[i].compress_force_dervs();
+    }
+  }
+
+  // Append the columns of the structure to the Kuf kernels and compute them
+  // in place.
+  std::vector<std::vector<int>> row_offsets(n_kernels);
   for (int i = 0; i < n_kernels; i++) {
     int n_sparse = sparse_descriptors[i].n_clusters;
-
-    envs_struc_kernels =
-        kernels[i]->envs_struc(sparse_descriptors[i], structure.descriptors[i],
-                               kernels[i]->kernel_hyperparameters);
-
-    Kuf_kernels[i].conservativeResize(n_sparse, n_labels + n_struc_labels);
-    Kuf_kernels[i].block(0, n_labels, n_sparse, n_energy) =
-        envs_struc_kernels.block(0, 0, n_sparse, n_energy);
-    Kuf_kernels[i].block(0, n_labels + n_energy, n_sparse, n_force) =
-        envs_struc_kernels.block(0, 1, n_sparse, n_force);
-    Kuf_kernels[i].block(0, n_labels + n_energy + n_force, n_sparse, n_stress) =
-        envs_struc_kernels.block(0, 1 + n_atoms * 3, n_sparse, n_sparse);
+    Kuf_kernels[i].append_cols(
+        Eigen::MatrixXd::Zero(n_sparse, n_struc_labels));
+    row_offsets[i] = sparse_descriptors[i].cumulative_type_count;
   }
+  std::vector<int> structures{n_strucs}, columns{n_labels};
+  compute_Kuf_tiles(sparse_descriptors, structures, columns, row_offsets,
+                    Kuf_kernels);
 
   // Update labels.
-  label_count.conservativeResize(training_structures.size() + 2);
-  label_count(training_structures.size() + 1) = n_labels + n_struc_labels;
+  label_count.conservativeResize(n_strucs + 2);
+  label_count(n_strucs + 1) = n_labels + n_struc_labels;
   y.conservativeResize(n_labels + n_struc_labels);
   y.segment(n_labels, n_energy) = structure.energy;
   y.segment(n_labels + n_energy, n_force) = structure.forces;
@@ -505,170 +610,499 @@ void SparseGP ::add_training_structure(const Structure &structure) {
   n_stress_labels += n_stress;
   n_labels += n_struc_labels;
 
-  // Store training structure.
-  training_structures.push_back(structure);
   n_strucs += 1;
 
-  // Update Kuf.
-  stack_Kuf();
+  // Release descriptors that are no longer needed.
+  if (frozen_hyperparameters)
+    stored.release_descriptors();
 }
 
-void SparseGP ::stack_Kuu() {
-  // Update Kuu.
-  Kuu = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
+void SparseGP ::release_training_descriptors() {
+  frozen_hyperparameters = true;
+  for (int i = 0; i < training_structures.size(); i++) {
+    training_structures[i].release_descriptors();
+  }
+}
+
+Eigen::MatrixXd SparseGP ::stacked_Kuu() const {
+  Eigen::MatrixXd Kuu = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
   int count = 0;
   for (int i = 0; i < Kuu_kernels.size(); i++) {
     int size = Kuu_kernels[i].rows();
     Kuu.block(count, count, size, size) = Kuu_kernels[i];
     count += size;
   }
+  return Kuu;
 }
 
-void SparseGP ::stack_Kuf() {
-  // Update Kuf kernels.
-  Kuf = Eigen::MatrixXd::Zero(n_sparse, n_labels);
+Eigen::MatrixXd SparseGP ::stacked_Kuf() const {
+  Eigen::MatrixXd Kuf = Eigen::MatrixXd::Zero(n_sparse, n_labels);
   int count = 0;
   for (int i = 0; i < Kuf_kernels.size(); i++) {
-    int size = Kuf_kernels[i].rows();
-    Kuf.block(count, 0, size, n_labels) = Kuf_kernels[i];
-    count += size;
+    const ChunkedMatrix &Kuf_kernel = Kuf_kernels[i];
+    for (int c = 0; c < Kuf_kernel.n_chunks(); c++) {
+      Kuf.block(count, Kuf_kernel.chunk_starts[c], Kuf_kernel.rows(),
+                Kuf_kernel.chunk_cols[c]) = Kuf_kernel.chunk(c);
+    }
+    count += Kuf_kernel.rows();
   }
+  return Kuf;
 }
 
 void SparseGP ::update_matrices_QR() {
+  // Check if the stored factors can be extended. Hyperparameter and jitter
+  // changes modify existing entries of Kuu and Kuf, and require a full
+  // refactorization.
+  bool incremental = factor_valid && (factor_jitter == Kuu_jitter) &&
+                     (n_factor_labels <= n_labels) &&
+                     (factor_clusters.rows() > 0) &&
+                     (factor_clusters.rows() <= n_sparse);
+
+  if (incremental) {
+    // Find the sparse environments that have not been factored yet.
+    std::vector<std::vector<int>> factored_counts(n_kernels);
+    for (int i = 0; i < n_kernels; i++) {
+      factored_counts[i] =
+          std::vector<int>(sparse_descriptors[i].n_types, 0);
+    }
+    for (int p = 0; p < factor_clusters.rows(); p++) {
+      factored_counts[factor_clusters(p, 0)][factor_clusters(p, 1)]++;
+    }
+
+    int n_old = factor_clusters.rows();
+    int n_new = n_sparse - n_old;
+    factor_clusters.conservativeResize(n_sparse, 3);
+    int counter = n_old;
+    for (int i = 0; i < n_kernels; i++) {
+      for (int t = 0; t < sparse_descriptors[i].n_types; t++) {
+        for (int k = factored_counts[i][t];
+             k < sparse_descriptors[i].n_clusters_by_type[t]; k++) {
+          factor_clusters.row(counter) << i, t, k;
+          counter++;
+        }
+      }
+    }
+
+    if (n_new > 0)
+      incremental = append_QR_columns(n_old);
+    if (incremental)
+      append_QR_rows();
+  }
+
+  if (!incremental)
+    compute_QR_factors();
+
+  factor_valid = true;
+  factor_jitter = Kuu_jitter;
+  n_factor_labels = n_labels;
+  store_QR_solution();
+}
+
+void SparseGP ::compute_QR_factors() {
+  // Factor the sparse environments in the order of Kuu.
+  factor_clusters = Eigen::MatrixXi::Zero(n_sparse, 3);
+  int counter = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    for (int t = 0; t < sparse_descriptors[i].n_types; t++) {
+      for (int k = 0; k < sparse_descriptors[i].n_clusters_by_type[t]; k++) {
+        factor_clusters.row(counter) << i, t, k;
+        counter++;
+      }
+    }
+  }
+
   // Store square root of noise vector.
   Eigen::VectorXd noise_vector_sqrt = sqrt(noise_vector.array());
 
-  // Cholesky decompose Kuu.
-  Eigen::LLT<Eigen::MatrixXd> chol(
-      Kuu + Kuu_jitter * Eigen::MatrixXd::Identity(Kuu.rows(), Kuu.cols()));
-
-  // Get the inverse of Kuu from Cholesky decomposition.
-  Eigen::MatrixXd Kuu_eye = Eigen::MatrixXd::Identity(Kuu.rows(), Kuu.cols());
-  L_inv = chol.matrixL().solve(Kuu_eye);
-  L_diag = L_inv.diagonal();
-  Kuu_inverse = L_inv.transpose() * L_inv;
+  // Cholesky decompose Kuu, which is block diagonal, one kernel at a time.
+  L_factor = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
+  int count = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    int size = Kuu_kernels[i].rows();
+    Eigen::LLT<Eigen::MatrixXd> chol(
+        Kuu_kernels[i] + Kuu_jitter * Eigen::MatrixXd::Identity(size, size));
+    L_factor.block(count, count, size, size) = chol.matrixL();
+    count += size;
+  }
 
-  // Form A matrix.
-  Eigen::MatrixXd A =
-      Eigen::MatrixXd::Zero(Kuf.cols() + Kuu.cols(), Kuu.cols());
-  A.block(0, 0, Kuf.cols(), Kuu.cols()) =
-      noise_vector_sqrt.asDiagonal() * Kuf.transpose();
-  A.block(Kuf.cols(), 0, Kuu.cols(), Kuu.cols()) = chol.matrixL().transpose();
+  // Form A matrix from the chunks of the Kuf kernels.
+  Eigen::MatrixXd A = Eigen::MatrixXd::Zero(n_labels + n_sparse, n_sparse);
+  count = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    const ChunkedMatrix &Kuf = Kuf_kernels[i];
+    for (int c = 0; c < Kuf.n_chunks(); c++) {
+      int start = Kuf.chunk_starts[c], n_cols = Kuf.chunk_cols[c];
+      A.block(start, count, n_cols, Kuf.rows()) =
+          noise_vector_sqrt.segment(start, n_cols).asDiagonal() *
+          Kuf.chunk(c).transpose();
+    }
+    count += Kuf.rows();
+  }
+  A.bottomRows(n_sparse) = L_factor.transpose();
 
   // Form b vector.
-  Eigen::VectorXd b = Eigen::VectorXd::Zero(Kuf.cols() + Kuu.cols());
-  b.segment(0, Kuf.cols()) = noise_vector_sqrt.asDiagonal() * y;
+  Eigen::VectorXd b = Eigen::VectorXd::Zero(n_labels + n_sparse);
+  b.segment(0, n_labels) = noise_vector_sqrt.asDiagonal() * y;
 
   // QR decompose A.
   Eigen::HouseholderQR<Eigen::MatrixXd> qr(A);
   Eigen::VectorXd Q_b = qr.householderQ().transpose() * b;
-  R_inv = qr.matrixQR().block(0, 0, Kuu.cols(), Kuu.cols())
-                       .triangularView<Eigen::Upper>()
-                       .solve(Kuu_eye);
-  R_inv_diag = R_inv.diagonal();
-  alpha = R_inv * Q_b;
-  Sigma = R_inv * R_inv.transpose();
+  R_factor = qr.matrixQR()
+                 .block(0, 0, n_sparse, n_sparse)
+                 .triangularView<Eigen::Upper>();
+  Q_b_factor = Q_b.head(n_sparse);
 }
 
-void SparseGP ::predict_mean(Structure &test_structure) {
+Eigen::PermutationMatrix<Eigen::Dynamic>
+SparseGP ::factor_permutation() const {
+  // Map each factored environment to its position in Kuu.
+  std::vector<int> kernel_offsets(n_kernels, 0);
+  for (int i = 1; i < n_kernels; i++) {
+    kernel_offsets[i] =
+        kernel_offsets[i - 1] + sparse_descriptors[i - 1].n_clusters;
+  }
 
-  int n_atoms = test_structure.noa;
-  int n_out = 1 + 3 * n_atoms + 6;
+  Eigen::VectorXi indices(factor_clusters.rows());
+  for (int p = 0; p < factor_clusters.rows(); p++) {
+    int i = factor_clusters(p, 0);
+    indices(p) = kernel_offsets[i] +
+                 sparse_descriptors[i].cumulative_type_count[factor_clusters(
+                     p, 1)] +
+                 factor_clusters(p, 2);
+  }
 
-  Eigen::MatrixXd kernel_mat = Eigen::MatrixXd::Zero(n_sparse, n_out);
-  int count = 0;
-  for (int i = 0; i < Kuu_kernels.size(); i++) {
-    int size = Kuu_kernels[i].rows();
-    kernel_mat.block(count, 0, size, n_out) = kernels[i]->envs_struc(
-        sparse_descriptors[i], test_structure.descriptors[i],
-        kernels[i]->kernel_hyperparameters);
-    count += size;
+  return Eigen::PermutationMatrix<Eigen::Dynamic>(indices);
+}
+
+Eigen::MatrixXd SparseGP ::factor_Kuu_columns(int first) const {
+  // Find the kernel and the row in the kernel matrices of each factored
+  // environment.
+  int n_rows = factor_clusters.rows();
+  std::vector<int> kernel(n_rows), local(n_rows);
+  for (int p = 0; p < n_rows; p++) {
+    kernel[p] = factor_clusters(p, 0);
+    local[p] = sparse_descriptors[kernel[p]]
+                   .cumulative_type_count[factor_clusters(p, 1)] +
+               factor_clusters(p, 2);
   }
 
-  test_structure.mean_efs = kernel_mat.transpose() * alpha;
+  // Environments of different kernels do not interact.
+  Eigen::MatrixXd columns = Eigen::MatrixXd::Zero(n_rows, n_rows - first);
+  for (int q = first; q < n_rows; q++) {
+    const Eigen::MatrixXd &Kuu = Kuu_kernels[kernel[q]];
+    for (int p = 0; p < n_rows; p++) {
+      if (kernel[p] == kernel[q])
+        columns(p, q - first) = Kuu(local[p], local[q]);
+    }
+  }
+  return columns;
 }
 
-void SparseGP ::predict_SOR(Structure &test_structure) {
+Eigen::MatrixXd SparseGP ::factor_Kuf_rows(int start, int n) const {
+  int n_rows = factor_clusters.rows();
+  Eigen::MatrixXd rows(n_rows, n);
+  if (n_kernels == 0 || n == 0)
+    return rows;
+
+  std::vector<int> local(n_rows);
+  for (int p = 0; p < n_rows; p++) {
+    int i = factor_clusters(p, 0);
+    local[p] = sparse_descriptors[i].cumulative_type_count[factor_clusters(
+                   p, 1)] +
+               factor_clusters(p, 2);
+  }
 
-  int n_atoms = test_structure.noa;
-  int n_out = 1 + 3 * n_atoms + 6;
+  // The kernels receive the same blocks of columns, so their chunks match.
+  const ChunkedMatrix &first_kernel = Kuf_kernels[0];
+  int end = start + n;
+  for (int c = 0; c < first_kernel.n_chunks(); c++) {
+    int chunk_start = first_kernel.chunk_starts[c];
+    int first = std::max(start, chunk_start);
+    int last = std::min(end, chunk_start + first_kernel.chunk_cols[c]);
+    if (first >= last)
+      continue;
+
+    for (int p = 0; p < n_rows; p++) {
+      const Eigen::MatrixXd &chunk =
+          Kuf_kernels[factor_clusters(p, 0)].chunks[c];
+      rows.row(p).segment(first - start, last - first) =
+          chunk.row(local[p]).segment(first - chunk_start, last - first);
+    }
+  }
+  return rows;
+}
 
-  Eigen::MatrixXd kernel_mat = Eigen::MatrixXd::Zero(n_sparse, n_out);
-  int count = 0;
-  for (int i = 0; i < Kuu_kernels.size(); i++) {
-    int size = Kuu_kernels[i].rows();
-    kernel_mat.block(count, 0, size, n_out) = kernels[i]->envs_struc(
-        sparse_descriptors[i], test_structure.descriptors[i],
-        kernels[i]->kernel_hyperparameters);
-    count += size;
+bool SparseGP ::append_QR_columns(int n_old) {
+
+  int n_new = n_sparse - n_old;
+  Eigen::MatrixXd Kuu_columns = factor_Kuu_columns(n_old);
+  Eigen::MatrixXd Kuu_new =
+      Kuu_columns.bottomRows(n_new) +
+      Kuu_jitter * Eigen::MatrixXd::Identity(n_new, n_new);
+
+  // Extend the Cholesky factor of Kuu.
+  Eigen::MatrixXd L_12 = L_factor.triangularView<Eigen::Lower>().solve(
+      Kuu_columns.topRows(n_old));
+  Eigen::LLT<Eigen::MatrixXd> L_chol(Kuu_new - L_12.transpose() * L_12);
+  if (L_chol.info() != Eigen::Success)
+    return false;
+
+  // Extend R, which satisfies R^T R = Kuu + Kuf * noise * Kuf^T, using the
+  // labels that have already been factored. The products with Kuf are
+  // accumulated over its chunks.
+  Eigen::MatrixXd Kuf_cross = Eigen::MatrixXd::Zero(n_old, n_new);
+  Eigen::MatrixXd Kuf_self = Eigen::MatrixXd::Zero(n_new, n_new);
+  Eigen::VectorXd Kuf_y = Eigen::VectorXd::Zero(n_new);
+  for (int c = 0; c < Kuf_kernels[0].n_chunks(); c++) {
+    int start = Kuf_kernels[0].chunk_starts[c];
+    int n_cols =
+        std::min(Kuf_kernels[0].chunk_cols[c], n_factor_labels - start);
+    if (n_cols <= 0)
+      break;
+
+    Eigen::MatrixXd Kuf_perm = factor_Kuf_rows(start, n_cols);
+    Eigen::MatrixXd Kuf_new_noise =
+        Kuf_perm.bottomRows(n_new) *
+        noise_vector.segment(start, n_cols).asDiagonal();
+    Kuf_cross += Kuf_perm.topRows(n_old) * Kuf_new_noise.transpose();
+    Kuf_self += Kuf_new_noise * Kuf_perm.bottomRows(n_new).transpose();
+    Kuf_y += Kuf_new_noise * y.segment(start, n_cols);
   }
 
-  test_structure.mean_efs = kernel_mat.transpose() * alpha;
-  Eigen::MatrixXd variance_sqrt = kernel_mat.transpose() * R_inv;
-  test_structure.variance_efs =
-      (variance_sqrt * variance_sqrt.transpose()).diagonal();
+  Eigen::MatrixXd R_12 =
+      R_factor.triangularView<Eigen::Upper>().transpose().solve(
+          Kuf_cross + Kuu_columns.topRows(n_old));
+  Eigen::LLT<Eigen::MatrixXd> R_chol(Kuf_self + Kuu_new -
+                                     R_12.transpose() * R_12);
+  if (R_chol.info() != Eigen::Success)
+    return false;
+
+  Eigen::MatrixXd R_22 = R_chol.matrixU();
+  Eigen::VectorXd Q_b_new = Kuf_y - R_12.transpose() * Q_b_factor;
+  R_22.triangularView<Eigen::Upper>().transpose().solveInPlace(Q_b_new);
+
+  L_factor.conservativeResize(n_sparse, n_sparse);
+  L_factor.block(0, n_old, n_old, n_new).setZero();
+  L_factor.block(n_old, 0, n_new, n_old) = L_12.transpose();
+  L_factor.block(n_old, n_old, n_new, n_new) = L_chol.matrixL();
+
+  R_factor.conservativeResize(n_sparse, n_sparse);
+  R_factor.block(0, n_old, n_old, n_new) = R_12;
+  R_factor.block(n_old, 0, n_new, n_old).setZero();
+  R_factor.block(n_old, n_old, n_new, n_new) = R_22;
+
+  Q_b_factor.conservativeResize(n_sparse);
+  Q_b_factor.tail(n_new) = Q_b_new;
+
+  return true;
 }
 
-void SparseGP ::predict_DTC(Structure &test_structure) {
+void SparseGP ::append_QR_rows() {
 
-  int n_atoms = test_structure.noa;
-  int n_out = 1 + 3 * n_atoms + 6;
+  int n_new = n_labels - n_factor_labels;
+  if (n_new == 0)
+    return;
 
-  Eigen::MatrixXd kernel_mat = Eigen::MatrixXd::Zero(n_sparse, n_out);
-  int count = 0;
-  for (int i = 0; i < Kuu_kernels.size(); i++) {
-    int size = Kuu_kernels[i].rows();
-    kernel_mat.block(count, 0, size, n_out) = kernels[i]->envs_struc(
-        sparse_descriptors[i], test_structure.descriptors[i],
-        kernels[i]->kernel_hyperparameters);
-    count += size;
+  // Rows of A and b of the new labels.
+  Eigen::VectorXd noise_sqrt = sqrt(noise_vector.tail(n_new).array());
+  Eigen::MatrixXd A_new = noise_sqrt.asDiagonal() *
+                          factor_Kuf_rows(n_factor_labels, n_new).transpose();
+  Eigen::VectorXd b_new = noise_sqrt.asDiagonal() * y.tail(n_new);
+
+  // Eliminate the new rows column by column with Householder reflections
+  // acting on the rows of R and the new rows of A.
+  for (int j = 0; j < n_sparse; j++) {
+    double x0 = R_factor(j, j);
+    double tail_norm = A_new.col(j).squaredNorm();
+    if (tail_norm == 0)
+      continue;
+
+    double beta = sqrt(x0 * x0 + tail_norm);
+    if (x0 > 0)
+      beta = -beta;
+    double tau = (beta - x0) / beta;
+    Eigen::VectorXd v = A_new.col(j) / (x0 - beta);
+
+    int n_cols = n_sparse - j - 1;
+    Eigen::RowVectorXd w = R_factor.row(j).tail(n_cols) +
+                           v.transpose() * A_new.rightCols(n_cols);
+    R_factor.row(j).tail(n_cols) -= tau * w;
+    A_new.rightCols(n_cols).noalias() -= tau * v * w;
+    R_factor(j, j) = beta;
+    A_new.col(j).setZero();
+
+    double w_b = Q_b_factor(j) + v.dot(b_new);
+    Q_b_factor(j) -= tau * w_b;
+    b_new -= tau * w_b * v;
   }
+}
 
-  test_structure.mean_efs = kernel_mat.transpose() * alpha;
+void SparseGP ::store_QR_solution() {
+  // Map the solution from factor order to the order of Kuu.
+  Eigen::PermutationMatrix<Eigen::Dynamic> perm = factor_permutation();
+  L_diag = perm * L_factor.diagonal().cwiseInverse();
+  R_inv_diag = perm * R_factor.diagonal().cwiseInverse();
+  alpha = perm * R_factor.triangularView<Eigen::Upper>().solve(Q_b_factor);
+}
 
-  // Compute variances.
-  Eigen::VectorXd V_SOR, Q_self, K_self = Eigen::VectorXd::Zero(n_out);
+Eigen::MatrixXd
+SparseGP ::solve_Kuu_factor(const Eigen::MatrixXd &kernel_mat) const {
+  Eigen::MatrixXd x = factor_permutation().transpose() * kernel_mat;
+  L_factor.triangularView<Eigen::Lower>().solveInPlace(x);
+  return x;
+}
 
-  for (int i = 0; i < n_kernels; i++) {
-    K_self += kernels[i]->self_kernel_struc(test_structure.descriptors[i],
-                                            kernels[i]->kernel_hyperparameters);
-  }
+Eigen::MatrixXd
+SparseGP ::solve_Sigma_factor(const Eigen::MatrixXd &kernel_mat) const {
+  Eigen::MatrixXd x = factor_permutation().transpose() * kernel_mat;
+  R_factor.triangularView<Eigen::Upper>().transpose().solveInPlace(x);
+  return x;
+}
+
+Eigen::MatrixXd SparseGP ::compute_Kuu_inverse() const {
+  Eigen::MatrixXd L_inv =
+      solve_Kuu_factor(Eigen::MatrixXd::Identity(n_sparse, n_sparse));
+  return L_inv.transpose() * L_inv;
+}
+
+Eigen::MatrixXd SparseGP ::compute_Sigma() const {
+  Eigen::MatrixXd R_inv_T =
+      solve_Sigma_factor(Eigen::MatrixXd::Identity(n_sparse, n_sparse));
+  return R_inv_T.transpose() * R_inv_T;
+}
 
-  Q_self = (kernel_mat.transpose() * Kuu_inverse * kernel_mat).diagonal();
-  V_SOR = (kernel_mat.transpose() * Sigma * kernel_mat).diagonal();
+void SparseGP ::predict_mean(Structure &test_structure) {
+  std::vector<Structure *> structures{&test_structure};
+  predict_mean(structures);
+}
 
-  test_structure.variance_efs = K_self - Q_self + V_SOR;
+void SparseGP ::predict_SOR(Structure &test_structure) {
+  std::vector<Structure *> structures{&test_structure};
+  predict_SOR(structures);
+}
+
+void SparseGP ::predict_DTC(Structure &test_structure) {
+  std::vector<Structure *> structures{&test_structure};
+  predict_DTC(structures);
 }
 
 void SparseGP ::predict_local_uncertainties(Structure &test_structure) {
-  int n_atoms = test_structure.noa;
-  int n_out = 1 + 3 * n_atoms + 6;
+  std::vector<Structure *> structures{&test_structure};
+  predict_local_uncertainties(structures);
+}
 
-  Eigen::MatrixXd kernel_mat = Eigen::MatrixXd::Zero(n_sparse, n_out);
-  int count = 0;
-  for (int i = 0; i < Kuu_kernels.size(); i++) {
-    int size = Kuu_kernels[i].rows();
-    kernel_mat.block(count, 0, size, n_out) = kernels[i]->envs_struc(
-        sparse_descriptors[i], test_structure.descriptors[i],
-        kernels[i]->kernel_hyperparameters);
-    count += size;
+Eigen::MatrixXd
+SparseGP ::compute_kernel_matrix(const std::vector<Structure *> &structures,
+                                 std::vector<int> &offsets) {
+
+  // Each structure contributes one energy, 3N force and 6 stress columns.
+  int n_strucs = structures.size();
+  offsets = std::vector<int>(n_strucs + 1, 0);
+  for (int s = 0; s < n_strucs; s++) {
+    offsets[s + 1] = offsets[s] + 1 + 3 * structures[s]->noa + 6;
+  }
+
+  Eigen::MatrixXd kernel_mat = Eigen::MatrixXd::Zero(n_sparse, offsets.back());
+
+  // With fewer structures than threads, the structures are processed in turn
+  // so that the kernels can parallelize internally.
+  bool parallel_strucs = n_strucs >= omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) if (parallel_strucs)
+  for (int s = 0; s < n_strucs; s++) {
+    int n_out = offsets[s + 1] - offsets[s];
+    int count = 0;
+    for (int i = 0; i < Kuu_kernels.size(); i++) {
+      int size = Kuu_kernels[i].rows();
+      kernel_mat.block(count, offsets[s], size, n_out) = kernels[i]->envs_struc(
+          sparse_descriptors[i], structures[s]->descriptors[i],
+          kernels[i]->kernel_hyperparameters);
+      count += size;
+    }
   }
 
-  test_structure.mean_efs = kernel_mat.transpose() * alpha;
+  return kernel_mat;
+}
 
-  std::vector<Eigen::VectorXd> local_uncertainties =
-    compute_cluster_uncertainties(test_structure);
-  test_structure.local_uncertainties = local_uncertainties;
+void SparseGP ::predict_mean(const std::vector<Structure *> &structures) {
+  std::vector<int> offsets;
+  Eigen::MatrixXd kernel_mat = compute_kernel_matrix(structures, offsets);
+  Eigen::VectorXd mean_efs = kernel_mat.transpose() * alpha;
 
+  for (int s = 0; s < structures.size(); s++) {
+    structures[s]->mean_efs =
+        mean_efs.segment(offsets[s], offsets[s + 1] - offsets[s]);
+  }
+}
+
+void SparseGP ::predict_SOR(const std::vector<Structure *> &structures) {
+  std::vector<int> offsets;
+  Eigen::MatrixXd kernel_mat = compute_kernel_matrix(structures, offsets);
+  Eigen::VectorXd mean_efs = kernel_mat.transpose() * alpha;
+  Eigen::VectorXd variance_efs =
+      solve_Sigma_factor(kernel_mat).colwise().squaredNorm().transpose();
+
+  for (int s = 0; s < structures.size(); s++) {
+    int n_out = offsets[s + 1] - offsets[s];
+    structures[s]->mean_efs = mean_efs.segment(offsets[s], n_out);
+    structures[s]->variance_efs = variance_efs.segment(offsets[s], n_out);
+  }
+}
+
+void SparseGP ::predict_DTC(const std::vector<Structure *> &structures) {
+  std::vector<int> offsets;
+  Eigen::MatrixXd kernel_mat = compute_kernel_matrix(structures, offsets);
+  Eigen::VectorXd mean_efs = kernel_mat.transpose() * alpha;
+
+  // Compute variances.
+  Eigen::VectorXd Q_self =
+      solve_Kuu_factor(kernel_mat).colwise().squaredNorm().transpose();
+  Eigen::VectorXd V_SOR =
+      solve_Sigma_factor(kernel_mat).colwise().squaredNorm().transpose();
+
+  // As in compute_kernel_matrix.
+  int n_strucs = structures.size();
+  bool parallel_strucs = n_strucs >= omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) if (parallel_strucs)
+  for (int s = 0; s < n_strucs; s++) {
+    int n_out = offsets[s + 1] - offsets[s];
+    Eigen::VectorXd K_self = Eigen::VectorXd::Zero(n_out);
+    for (int i = 0; i < n_kernels; i++) {
+      K_self += kernels[i]->self_kernel_struc(
+          structures[s]->descriptors[i], kernels[i]->kernel_hyperparameters);
+    }
+
+    structures[s]->mean_efs = mean_efs.segment(offsets[s], n_out);
+    structures[s]->variance_efs = K_self -
+                                  Q_self.segment(offsets[s], n_out) +
+                                  V_SOR.segment(offsets[s], n_out);
+  }
+}
+
+void SparseGP ::predict_local_uncertainties(
+    const std::vector<Structure *> &structures) {
+
+  predict_mean(structures);
+
+  // As in compute_kernel_matrix.
+  int n_strucs = structures.size();
+  bool parallel_strucs = n_strucs >= omp_get_max_threads();
+#pragma omp parallel for schedule(dynamic) if (parallel_strucs)
+  for (int s = 0; s < n_strucs; s++) {
+    structures[s]->local_uncertainties =
+        compute_cluster_uncertainties(*structures[s]);
+  }
 }
 
 void SparseGP ::compute_likelihood_stable() {
-  // Compute inverse of Qff from Sigma.
-  Eigen::MatrixXd noise_diag = noise_vector.asDiagonal();
+  Eigen::VectorXd Kfu_alpha = Eigen::VectorXd::Zero(n_labels);
+  int count = 0;
+  for (int i = 0; i < n_kernels; i++) {
+    int size = Kuf_kernels[i].rows();
+    Kfu_alpha += Kuf_kernels[i].transpose_product(alpha.segment(count, size));
+    count += size;
+  }
 
-  data_fit =
-      -(1. / 2.) * y.transpose() * noise_diag * (y - Kuf.transpose() * alpha);
+  data_fit = -(1. / 2.) * y.cwiseProduct(noise_vector).dot(y - Kfu_alpha);
   constant_term = -(1. / 2.) * n_labels * log(2 * M_PI);
 
   // Compute complexity penalty.
@@ -702,8 +1136,9 @@ void SparseGP ::compute_likelihood() {
   // Construct noise vector.
   Eigen::VectorXd noise = 1 / noise_vector.array();
 
+  Eigen::MatrixXd L_inv_Kuf = solve_Kuu_factor(stacked_Kuf());
   Eigen::MatrixXd Qff_plus_lambda =
-      Kuf.transpose() * Kuu_inverse * Kuf +
+      L_inv_Kuf.transpose() * L_inv_Kuf +
       noise.asDiagonal() * Eigen::MatrixXd::Identity(n_labels, n_labels);
 
   // Decompose the matrix. Use QR decomposition instead of LLT/LDLT becaues Qff
@@ -726,16 +1161,60 @@ void SparseGP ::compute_likelihood() {
 
 double
 SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
+  std::vector<int> structures(training_structures.size());
+  std::iota(structures.begin(), structures.end(), 0);
+  return compute_batch_likelihood_gradient(hyperparameters, structures);
+}
+
+double SparseGP ::compute_batch_likelihood_gradient(
+    const Eigen::VectorXd &hyperparameters, const std::vector<int> &structures,
+    int n_probes, int seed) {
+
+  // The likelihood and its gradient are computed with the Woodbury identity
+  // in terms of the m x m matrices Kuu and Sigma^-1 = Kuu + Kuf noise Kuf^T,
+  // so that the n_labels x n_labels matrix Qff + noise is never formed.
+
+  // Collect the structures of the batch, which are passed to the kernels by
+  // address. Repeated indices are counted once, so that the batch is a set
+  // of distinct, valid indices, and it covers the training set if and only
+  // if it has n_strucs of them.
+  std::vector<int> batch = structures;
+  std::sort(batch.begin(), batch.end());
+  batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+  if (batch.empty() || batch.front() < 0 || batch.back() >= n_strucs)
+    throw std::runtime_error("Invalid training structure indices in batch.");
+  bool full_batch = batch.size() == size_t(n_strucs);
+  std::vector<const Structure *> batch_strucs;
+  for (size_t s = 0; s < batch.size(); s++) {
+    batch_strucs.push_back(&training_structures[batch[s]]);
+  }
+
+  std::vector<int> label_starts, label_sizes;
+  int n_batch = 0;
+  for (size_t s = 0; s < batch.size(); s++) {
+    label_starts.push_back(label_count(batch[s]));
+    label_sizes.push_back(label_count(batch[s] + 1) - label_count(batch[s]));
+    n_batch += label_sizes[s];
+  }
+
+  Eigen::VectorXd y_batch(n_batch);
+  int current_count = 0;
+  for (size_t s = 0; s < batch.size(); s++) {
+    y_batch.segment(current_count, label_sizes[s]) =
+        y.segment(label_starts[s], label_sizes[s]);
+    current_count += label_sizes[s];
+  }
 
   // Compute Kuu and Kuf matrices and gradients.
   int n_hyps_total = hyperparameters.size();
 
   Eigen::MatrixXd Kuu_mat = Eigen::MatrixXd::Zero(n_sparse, n_sparse);
-  Eigen::MatrixXd Kuf_mat = Eigen::MatrixXd::Zero(n_sparse, n_labels);
+  Eigen::MatrixXd Kuf_mat = Eigen::MatrixXd::Zero(n_sparse, n_batch);
 
-  std::vector<Eigen::MatrixXd> Kuu_grad, Kuf_grad, Kuu_grads, Kuf_grads;
+  std::vector<std::vector<Eigen::MatrixXd>> Kuu_grads(n_kernels),
+      Kuf_grads(n_kernels);
 
-  int n_hyps, hyp_index = 0, grad_index = 0;
+  int n_hyps, hyp_index = 0;
   Eigen::VectorXd hyps_curr;
 
   int count = 0;
@@ -744,52 +1223,62 @@ SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
     hyps_curr = hyperparameters.segment(hyp_index, n_hyps);
     int size = Kuu_kernels[i].rows();
 
-    Kuu_grad = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu, hyps_curr);
-    Kuf_grad = kernels[i]->Kuf_grad(sparse_descriptors[i], training_structures,
-                                    i, Kuf, hyps_curr);
+    // The full training set uses the stored Kuf, and mini-batches gather
+    // their columns.
+    ChunkedMatrix Kuf_gathered;
+    if (!full_batch) {
+      Eigen::MatrixXd Kuf_batch(size, n_batch);
+      current_count = 0;
+      for (size_t s = 0; s < batch.size(); s++) {
+        Kuf_batch.middleCols(current_count, label_sizes[s]) =
+            Kuf_kernels[i].middle_cols(label_starts[s], label_sizes[s]);
+        current_count += label_sizes[s];
+      }
+      Kuf_gathered = ChunkedMatrix(std::move(Kuf_batch));
+    }
+    const ChunkedMatrix &Kuf_batch = full_batch ? Kuf_kernels[i] : Kuf_gathered;
 
-    Kuu_mat.block(count, count, size, size) = Kuu_grad[0];
-    Kuf_mat.block(count, 0, size, n_labels) = Kuf_grad[0];
+    // Kernels can rescale Kuu and Kuf from their current hyperparameters.
+    // They may be shared with other models, so they are first set to the
+    // hyperparameters of this model.
+    kernels[i]->set_hyperparameters(
+        this->hyperparameters.segment(hyp_index, n_hyps));
 
-    for (int j = 0; j < n_hyps; j++) {
-      Kuu_grads.push_back(Eigen::MatrixXd::Zero(n_sparse, n_sparse));
-      Kuf_grads.push_back(Eigen::MatrixXd::Zero(n_sparse, n_labels));
+    // Mini-batches change at every step, so their kernels aren't cached.
+    Kuu_grads[i] = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu_kernels[i],
+                                        hyps_curr, cache_generation);
+    Kuf_grads[i] = kernels[i]->Kuf_grad(
+        sparse_descriptors[i], batch_strucs, i, Kuf_batch, hyps_curr,
+        full_batch ? cache_generation : -1);
 
-      Kuu_grads[hyp_index + j].block(count, count, size, size) =
-          Kuu_grad[j + 1];
-      Kuf_grads[hyp_index + j].block(count, 0, size, n_labels) =
-          Kuf_grad[j + 1];
-    }
+    Kuu_mat.block(count, count, size, size) = Kuu_grads[i][0];
+    Kuf_mat.block(count, 0, size, n_batch) = Kuf_grads[i][0];
 
     count += size;
     hyp_index += n_hyps;
   }
 
-  Eigen::MatrixXd Kuu_inverse =
-      (Kuu_mat + Kuu_jitter * Eigen::MatrixXd::Identity(Kuu.rows(), Kuu.cols()))
-          .inverse();
-
   // Construct updated noise vector and gradients.
-  Eigen::VectorXd noise_vec = Eigen::VectorXd::Zero(n_labels);
-  Eigen::VectorXd e_noise_grad = Eigen::VectorXd::Zero(n_labels);
-  Eigen::VectorXd f_noise_grad = Eigen::VectorXd::Zero(n_labels);
-  Eigen::VectorXd s_noise_grad = Eigen::VectorXd::Zero(n_labels);
+  Eigen::VectorXd noise_vec = Eigen::VectorXd::Zero(n_batch);
+  Eigen::VectorXd e_noise_grad = Eigen::VectorXd::Zero(n_batch);
+  Eigen::VectorXd f_noise_grad = Eigen::VectorXd::Zero(n_batch);
+  Eigen::VectorXd s_noise_grad = Eigen::VectorXd::Zero(n_batch);
 
   double sigma_e = hyperparameters(hyp_index);
   double sigma_f = hyperparameters(hyp_index + 1);
   double sigma_s = hyperparameters(hyp_index + 2);
 
-  int current_count = 0;
-  for (int i = 0; i < training_structures.size(); i++) {
-    int n_atoms = training_structures[i].noa;
+  current_count = 0;
+  for (size_t i = 0; i < batch_strucs.size(); i++) {
+    int n_atoms = batch_strucs[i]->noa;
 
-    if (training_structures[i].energy.size() != 0) {
+    if (batch_strucs[i]->energy.size() != 0) {
       noise_vec(current_count) = sigma_e * sigma_e;
       e_noise_grad(current_count) = 2 * sigma_e;
       current_count += 1;
     }
 
-    if (training_structures[i].forces.size() != 0) {
+    if (batch_strucs[i]->forces.size() != 0) {
       noise_vec.segment(current_count, n_atoms * 3) =
           Eigen::VectorXd::Constant(n_atoms * 3, sigma_f * sigma_f);
       f_noise_grad.segment(current_count, n_atoms * 3) =
@@ -797,7 +1286,7 @@ SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
       current_count += n_atoms * 3;
     }
 
-    if (training_structures[i].stresses.size() != 0) {
+    if (batch_strucs[i]->stresses.size() != 0) {
       noise_vec.segment(current_count, 6) =
           Eigen::VectorXd::Constant(6, sigma_s * sigma_s);
       s_noise_grad.segment(current_count, 6) =
@@ -805,62 +1294,208 @@ SparseGP ::compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters) {
       current_count += 6;
     }
   }
+  Eigen::VectorXd noise_inv = noise_vec.cwiseInverse();
 
-  // Compute Qff and Qff grads.
-  Eigen::MatrixXd Qff_plus_lambda =
-      Kuf_mat.transpose() * Kuu_inverse * Kuf_mat +
-      noise_vec.asDiagonal() * Eigen::MatrixXd::Identity(n_labels, n_labels);
+  // Cholesky decompose Kuu and QR decompose [noise^-1/2 Kuf^T; L^T], whose
+  // triangular factor R satisfies R^T R = Sigma^-1.
+  Eigen::LLT<Eigen::MatrixXd> chol(
+      Kuu_mat + Kuu_jitter * Eigen::MatrixXd::Identity(n_sparse, n_sparse));
+  Eigen::MatrixXd L = chol.matrixL();
 
-  std::vector<Eigen::MatrixXd> Qff_grads;
-  grad_index = 0;
+  Eigen::MatrixXd A(n_batch + n_sparse, n_sparse);
+  A.topRows(n_batch) =
+      noise_inv.cwiseSqrt().asDiagonal() * Kuf_mat.transpose();
+  A.bottomRows(n_sparse) = L.transpose();
+  Eigen::HouseholderQR<Eigen::MatrixXd> qr(A);
+  A.resize(0, 0);
+  Eigen::MatrixXd R =
+      qr.matrixQR().topRows(n_sparse).triangularView<Eigen::Upper>();
+  auto R_view = R.triangularView<Eigen::Upper>();
+
+  // Compute the complexity penalty from
+  // log |Qff + noise| = log |noise| + log |Sigma^-1| - log |Kuu|.
+  double log_det = 0;
+  for (int i = 0; i < n_batch; i++) {
+    log_det += log(noise_vec(i));
+  }
+  for (int i = 0; i < n_sparse; i++) {
+    log_det += 2 * log(abs(R(i, i))) - 2 * log(L(i, i));
+  }
+  complexity_penalty = -log_det / 2;
+
+  // Compute (Qff + noise)^-1 x = noise^-1 (x - Kuf^T Sigma Kuf noise^-1 x).
+  auto solve_Q = [&](const Eigen::MatrixXd &x) {
+    Eigen::MatrixXd Sigma_b = Kuf_mat * noise_inv.asDiagonal() * x;
+    R_view.transpose().solveInPlace(Sigma_b);
+    R_view.solveInPlace(Sigma_b);
+    Eigen::MatrixXd solution = x - Kuf_mat.transpose() * Sigma_b;
+    return Eigen::MatrixXd(noise_inv.asDiagonal() * solution);
+  };
+  Eigen::VectorXd Q_inv_y = solve_Q(y_batch);
+
+  // Compute log marginal likelihood.
+  data_fit = -(1. / 2.) * y_batch.transpose() * Q_inv_y;
+  constant_term = -n_batch * log(2 * M_PI) / 2;
+  log_marginal_likelihood = complexity_penalty + data_fit + constant_term;
+  Eigen::VectorXd W_Q_inv_y = chol.solve(Kuf_mat * Q_inv_y);
+
+  // The trace terms tr(Q^-1 Qff') are either computed exactly or estimated
+  // as the mean of z^T Q^-1 Qff' z over random vectors z with entries +-1.
+  // With W = Kuu^-1 Kuf, the exact terms are elementwise products with
+  // W Q^-1 = Sigma Kuf noise^-1 and W Q^-1 W^T = Kuu^-1 - Sigma, while the
+  // estimate only needs W Q^-1 z and W z, which avoids the m x m inverses.
+  bool hutchinson = n_probes > 0;
+  Eigen::MatrixXd Sigma_Kuf_noise, Kuu_inv_minus_Sigma, Kuf_Sigma_Kuf_diag,
+      probes, Q_inv_probes, W_probes, W_Q_inv_probes;
+  if (hutchinson) {
+    std::mt19937 gen(seed);
+    std::bernoulli_distribution coin(0.5);
+    probes.resize(n_batch, n_probes);
+    for (int j = 0; j < n_probes; j++) {
+      for (int i = 0; i < n_batch; i++) {
+        probes(i, j) = coin(gen) ? 1 : -1;
+      }
+    }
+    Q_inv_probes = solve_Q(probes);
+    W_probes = chol.solve(Kuf_mat * probes);
+    W_Q_inv_probes = chol.solve(Kuf_mat * Q_inv_probes);
+  } else {
+    Eigen::MatrixXd R_inv_T_Kuf = Kuf_mat;
+    R_view.transpose().solveInPlace(R_inv_T_Kuf);
+    Kuf_Sigma_Kuf_diag = R_inv_T_Kuf.colwise().squaredNorm().transpose();
+    Sigma_Kuf_noise = R_inv_T_Kuf;
+    R_view.solveInPlace(Sigma_Kuf_noise);
+    Sigma_Kuf_noise *= noise_inv.asDiagonal();
+    R_inv_T_Kuf.resize(0, 0);
+
+    Eigen::MatrixXd R_inv =
+        R_view.solve(Eigen::MatrixXd::Identity(n_sparse, n_sparse));
+    Kuu_inv_minus_Sigma =
+        chol.solve(Eigen::MatrixXd::Identity(n_sparse, n_sparse)) -
+        R_inv * R_inv.transpose();
+  }
+
+  // Compute likelihood gradient. With Qff' the derivative of Qff, each
+  // component is (y^T Q^-1 Qff' Q^-1 y - tr(Q^-1 Qff')) / 2.
+  likelihood_gradient = Eigen::VectorXd::Zero(n_hyps_total);
+  hyp_index = 0;
+  count = 0;
   for (int i = 0; i < n_kernels; i++) {
     n_hyps = kernels[i]->kernel_hyperparameters.size();
-    for (int j = 0; j < n_hyps; j++) {
-      Qff_grads.push_back(
-          Kuf_grads[grad_index].transpose() * Kuu_inverse * Kuf_mat -
-          Kuf_mat.transpose() * Kuu_inverse * Kuu_grads[grad_index] *
-              Kuu_inverse * Kuf_mat +
-          Kuf_mat.transpose() * Kuu_inverse * Kuf_grads[grad_index]);
+    int size = Kuu_kernels[i].rows();
+    Eigen::VectorXd W_y = W_Q_inv_y.segment(count, size);
 
-      grad_index++;
+    for (int j = 0; j < n_hyps; j++) {
+      const Eigen::MatrixXd &Kuu_grad = Kuu_grads[i][j + 1];
+      const Eigen::MatrixXd &Kuf_grad = Kuf_grads[i][j + 1];
+
+      double data_term =
+          2 * W_y.dot(Kuf_grad * Q_inv_y) - W_y.dot(Kuu_grad * W_y);
+      double trace_term;
+      if (hutchinson) {
+        Eigen::MatrixXd W_z = W_probes.middleRows(count, size);
+        Eigen::MatrixXd W_Q_inv_z = W_Q_inv_probes.middleRows(count, size);
+        trace_term =
+            ((Kuf_grad * Q_inv_probes).cwiseProduct(W_z).sum() +
+             (Kuf_grad * probes).cwiseProduct(W_Q_inv_z).sum() -
+             (Kuu_grad * W_z).cwiseProduct(W_Q_inv_z).sum()) /
+            n_probes;
+      } else {
+        trace_term =
+            2 * Kuf_grad.cwiseProduct(Sigma_Kuf_noise.middleRows(count, size))
+                    .sum() -
+            Kuu_grad
+                .cwiseProduct(
+                    Kuu_inv_minus_Sigma.block(count, count, size, size))
+                .sum();
+      }
+      likelihood_gradient(hyp_index + j) = (data_term - trace_term) / 2;
     }
+
+    count += size;
+    hyp_index += n_hyps;
   }
 
-  Qff_grads.push_back(e_noise_grad.asDiagonal() *
-                      Eigen::MatrixXd::Identity(n_labels, n_labels));
-  Qff_grads.push_back(f_noise_grad.asDiagonal() *
-                      Eigen::MatrixXd::Identity(n_labels, n_labels));
-  Qff_grads.push_back(s_noise_grad.asDiagonal() *
-                      Eigen::MatrixXd::Identity(n_labels, n_labels));
+  // The noise gradients are diagonal, and only need the diagonal of
+  // (Qff + noise)^-1.
+  Eigen::VectorXd Q_inv_diag;
+  if (hutchinson) {
+    Q_inv_diag =
+        Q_inv_probes.cwiseProduct(probes).rowwise().sum() / n_probes;
+  } else {
+    Q_inv_diag =
+        noise_inv -
+        noise_inv.cwiseProduct(noise_inv).cwiseProduct(Kuf_Sigma_Kuf_diag);
+  }
+  std::vector<Eigen::VectorXd> noise_grads{e_noise_grad, f_noise_grad,
+                                           s_noise_grad};
+  for (int k = 0; k < 3; k++) {
+    double data_term = noise_grads[k].dot(Q_inv_y.cwiseProduct(Q_inv_y));
+    double trace_term = noise_grads[k].dot(Q_inv_diag);
+    likelihood_gradient(hyp_index + k) = (data_term - trace_term) / 2;
+  }
+
+  return log_marginal_likelihood;
+}
 
-  // Perform LU decomposition inplace and compute the inverse.
-  Eigen::PartialPivLU<Eigen::Ref<Eigen::MatrixXd>> lu(Qff_plus_lambda);
-  Eigen::MatrixXd Qff_inverse = lu.inverse();
+Eigen::VectorXd SparseGP ::optimize_hyperparameters_adam(int n_steps,
+                                                         int batch_size,
+                                                         double learning_rate,
+                                                         int n_probes,
+                                                         int seed) {
+  if (n_labels == 0 || frozen_hyperparameters) {
+    std::cout << "Warning: The hyperparameters can't be optimized without "
+                 "labels or after the training descriptors are released."
+              << std::endl;
+    return hyperparameters;
+  }
 
-  // Compute log determinant from the diagonal of U.
-  complexity_penalty = 0;
-  for (int i = 0; i < Qff_plus_lambda.rows(); i++) {
-    complexity_penalty += -log(abs(Qff_plus_lambda(i, i)));
+  // Adam steps are taken in log |h|, so that each hyperparameter keeps its
+  // sign and changes by a relative amount of about learning_rate per step.
+  double beta_1 = 0.9, beta_2 = 0.999, epsilon = 1e-8;
+  int n_hyps = hyperparameters.size();
+  Eigen::VectorXd hyps = hyperparameters;
+  Eigen::ArrayXd signs = hyps.array().sign();
+  Eigen::ArrayXd log_hyps = hyps.array().abs().log();
+  Eigen::ArrayXd first_moment = Eigen::ArrayXd::Zero(n_hyps);
+  Eigen::ArrayXd second_moment = Eigen::ArrayXd::Zero(n_hyps);
+
+  std::mt19937 gen(seed);
+  std::vector<int> structures(training_structures.size());
+  std::iota(structures.begin(), structures.end(), 0);
+  batch_size = std::max(1, std::min(batch_size, int(structures.size())));
+
+  for (int step = 1; step <= n_steps; step++) {
+    std::shuffle(structures.begin(), structures.end(), gen);
+    std::vector<int> batch(structures.begin(),
+                           structures.begin() + batch_size);
+    int n_batch = 0;
+    for (int s = 0; s < batch_size; s++) {
+      n_batch += label_count(batch[s] + 1) - label_count(batch[s]);
+    }
+    compute_batch_likelihood_gradient(hyps, batch, n_probes, gen());
+
+    // The batch gradient is scaled to the size of the training set.
+    Eigen::ArrayXd gradient = likelihood_gradient.array() * hyps.array() *
+                              double(n_labels) / n_batch;
+    first_moment = beta_1 * first_moment + (1 - beta_1) * gradient;
+    second_moment =
+        beta_2 * second_moment + (1 - beta_2) * gradient.square();
+    Eigen::ArrayXd first_hat = first_moment / (1 - pow(beta_1, step));
+    Eigen::ArrayXd second_hat = second_moment / (1 - pow(beta_2, step));
+    log_hyps += learning_rate * first_hat / (second_hat.sqrt() + epsilon);
+    hyps = (signs * log_hyps.exp()).matrix();
   }
-  complexity_penalty /= 2;
 
-  // Compute log marginal likelihood.
-  Eigen::VectorXd Q_inv_y = Qff_inverse * y;
-  data_fit = -(1. / 2.) * y.transpose() * Q_inv_y;
-  constant_term = -n_labels * log(2 * M_PI) / 2;
-  log_marginal_likelihood = complexity_penalty + data_fit + constant_term;
+  set_hyperparameters(hyps);
+  clear_kernel_caches();
+  return hyps;
+}
 
-  // Compute likelihood gradient.
-  likelihood_gradient = Eigen::VectorXd::Zero(n_hyps_total);
-  Eigen::MatrixXd Qff_inv_grad;
-  for (int i = 0; i < n_hyps_total; i++) {
-    Qff_inv_grad = Qff_inverse * Qff_grads[i];
-    likelihood_gradient(i) =
-        -Qff_inv_grad.trace() + y.transpose() * Qff_inv_grad * Q_inv_y;
-    likelihood_gradient(i) /= 2;
+void SparseGP ::clear_kernel_caches() {
+  for (int i = 0; i < n_kernels; i++) {
+    kernels[i]->clear_cache();
   }
-
-  return log_marginal_likelihood;
 }
 
 void SparseGP ::set_hyperparameters(Eigen::VectorXd hyps) {
@@ -868,24 +1503,33 @@ void SparseGP ::set_hyperparameters(Eigen::VectorXd hyps) {
   int n_hyps, hyp_index = 0;
   Eigen::VectorXd new_hyps;
 
+  std::vector<const Structure *> training_strucs;
+  for (int i = 0; i < n_strucs; i++) {
+    training_strucs.push_back(&training_structures[i]);
+  }
+
   std::vector<Eigen::MatrixXd> Kuu_grad, Kuf_grad;
   for (int i = 0; i < n_kernels; i++) {
     n_hyps = kernels[i]->kernel_hyperparameters.size();
     new_hyps = hyps.segment(hyp_index, n_hyps);
+    kernels[i]->set_hyperparameters(hyperparameters.segment(hyp_index, n_hyps));
 
-    Kuu_grad = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu, new_hyps);
-    Kuf_grad = kernels[i]->Kuf_grad(sparse_descriptors[i], training_structures,
-                                    i, Kuf, new_hyps);
+    // Direct calls don't cache kernels, which would otherwise stay resident
+    // until the caches are cleared.
+    Kuu_grad = kernels[i]->Kuu_grad(sparse_descriptors[i], Kuu_kernels[i],
+                                    new_hyps, -1);
+    Kuf_grad = kernels[i]->Kuf_grad(sparse_descriptors[i], training_strucs,
+                                    i, Kuf_kernels[i], new_hyps, -1);
 
     Kuu_kernels[i] = Kuu_grad[0];
-    Kuf_kernels[i] = Kuf_grad[0];
+    Kuf_kernels[i].assign(Kuf_grad[0]);
 
     kernels[i]->set_hyperparameters(new_hyps);
     hyp_index += n_hyps;
   }
 
-  stack_Kuu();
-  stack_Kuf();
+  // Kuu, Kuf and the noise change, so the QR factors are recomputed.
+  factor_valid = false;
 
   hyperparameters = hyps;
   energy_noise = hyps(hyp_index);
@@ -1048,15 +1692,126 @@ void SparseGP::write_varmap_coefficients(
   coeff_file.close();
 }
 
+void to_json(nlohmann::json &j, const SparseGP &p) {
+  j = nlohmann::json{{"hyperparameters", p.hyperparameters},
+                     {"kernels", p.kernels},
+                     {"Kuu_kernels", p.Kuu_kernels},
+                     {"Kuf_kernels", p.Kuf_kernels},
+                     {"n_kernels", p.n_kernels},
+                     {"Kuu_jitter", p.Kuu_jitter},
+                     {"alpha", p.alpha},
+                     {"R_inv_diag", p.R_inv_diag},
+                     {"L_diag", p.L_diag},
+                     {"sparse_descriptors", p.sparse_descriptors},
+                     {"training_structures", p.training_structures},
+                     {"sparse_indices", p.sparse_indices},
+                     {"noise_vector", p.noise_vector},
+                     {"y", p.y},
+                     {"label_count", p.label_count},
+                     {"n_energy_labels", p.n_energy_labels},
+                     {"n_force_labels", p.n_force_labels},
+                     {"n_stress_labels", p.n_stress_labels},
+                     {"n_sparse", p.n_sparse},
+                     {"n_labels", p.n_labels},
+                     {"n_strucs", p.n_strucs},
+                     {"energy_noise", p.energy_noise},
+                     {"force_noise", p.force_noise},
+                     {"stress_noise", p.stress_noise},
+                     {"log_marginal_likelihood", p.log_marginal_likelihood},
+                     {"data_fit", p.data_fit},
+                     {"complexity_penalty", p.complexity_penalty},
+                     {"trace_term", p.trace_term},
+                     {"constant_term", p.constant_term},
+                     {"likelihood_gradient", p.likelihood_gradient},
+                     {"compact_force_dervs", p.compact_force_dervs},
+                     {"frozen_hyperparameters", p.frozen_hyperparameters}};
+
+  // The factors are only written when they are valid, so that files without
+  // them stay readable by older versions.
+  if (p.factor_valid) {
+    j["factor_valid"] = p.factor_valid;
+    j["R_factor"] = p.R_factor;
+    j["L_factor"] = p.L_factor;
+    j["Q_b_factor"] = p.Q_b_factor;
+    j["factor_clusters"] = p.factor_clusters;
+    j["n_factor_labels"] = p.n_factor_labels;
+    j["factor_jitter"] = p.factor_jitter;
+  }
+}
+
+void from_json(const nlohmann::json &j, SparseGP &p) {
+  j.at("hyperparameters").get_to(p.hyperparameters);
+  j.at("kernels").get_to(p.kernels);
+  j.at("Kuu_kernels").get_to(p.Kuu_kernels);
+  j.at("Kuf_kernels").get_to(p.Kuf_kernels);
+  j.at("n_kernels").get_to(p.n_kernels);
+  j.at("Kuu_jitter").get_to(p.Kuu_jitter);
+  j.at("alpha").get_to(p.alpha);
+  j.at("R_inv_diag").get_to(p.R_inv_diag);
+  j.at("L_diag").get_to(p.L_diag);
+  j.at("sparse_descriptors").get_to(p.sparse_descriptors);
+  j.at("training_structures").get_to(p.training_structures);
+  j.at("sparse_indices").get_to(p.sparse_indices);
+  j.at("noise_vector").get_to(p.noise_vector);
+  j.at("y").get_to(p.y);
+  j.at("label_count").get_to(p.label_count);
+  j.at("n_energy_labels").get_to(p.n_energy_labels);
+  j.at("n_force_labels").get_to(p.n_force_labels);
+  j.at("n_stress_labels").get_to(p.n_stress_labels);
+  j.at("n_sparse").get_to(p.n_sparse);
+  j.at("n_labels").get_to(p.n_labels);
+  j.at("n_strucs").get_to(p.n_strucs);
+  j.at("energy_noise").get_to(p.energy_noise);
+  j.at("force_noise").get_to(p.force_noise);
+  j.at("stress_noise").get_to(p.stress_noise);
+  j.at("log_marginal_likelihood").get_to(p.log_marginal_likelihood);
+  j.at("data_fit").get_to(p.data_fit);
+  j.at("complexity_penalty").get_to(p.complexity_penalty);
+  j.at("trace_term").get_to(p.trace_term);
+  j.at("constant_term").get_to(p.constant_term);
+  j.at("likelihood_gradient").get_to(p.likelihood_gradient);
+  p.compact_force_dervs = j.value("compact_force_dervs", false);
+  p.frozen_hyperparameters = j.value("frozen_hyperparameters", false);
+
+  p.factor_valid = j.value("factor_valid", false);
+  if (p.factor_valid) {
+    j.at("R_factor").get_to(p.R_factor);
+    j.at("L_factor").get_to(p.L_factor);
+    j.at("Q_b_factor").get_to(p.Q_b_factor);
+    j.at("factor_clusters").get_to(p.factor_clusters);
+    j.at("n_factor_labels").get_to(p.n_factor_labels);
+    j.at("factor_jitter").get_to(p.factor_jitter);
+  }
+}
+
+// The file is streamed, so that the matrices are not held in a JSON tree.
 void SparseGP ::to_json(std::string file_name, const SparseGP & sgp){
-  std::ofstream sgp_file(file_name);
-  nlohmann::json j = sgp;
-  sgp_file << j;
+  write_json_stream(file_name, sgp);
 }
 
 SparseGP SparseGP ::from_json(std::string file_name){
-  std::ifstream sgp_file(file_name);
-  nlohmann::json j;
-  sgp_file >> j;
-  return j;
+  SparseGP sgp = read_json_stream<SparseGP>(file_name);
+
+  // Files written without the QR factors are refactored.
+  if (sgp.n_sparse > 0 && !sgp.factor_valid)
+    sgp.update_matrices_QR();
+  return sgp;
+}
+
+void SparseGP ::to_binary(std::string file_name, const SparseGP &sgp) {
+  write_binary(file_name, sgp, "SparseGP");
+}
+
+SparseGP SparseGP ::from_binary(std::string file_name) {
+  SparseGP sgp = read_binary<SparseGP>(file_name, "SparseGP");
+
+  // The QR factors are stored as blobs, as in from_json.
+  if (sgp.n_sparse > 0 && !sgp.factor_valid)
+    sgp.update_matrices_QR();
+  return sgp;
+}
+
+void SparseGP ::json_to_binary(std::string json_file,
+                               std::string binary_file) {
+  convert_json_to_binary<SparseGP>(json_file, binary_file, "SparseGP");
 }
@@ -1,6 +1,7 @@
 #ifndef SPARSE_GP_H
 #define SPARSE_GP_H
 
+#include "chunked_matrix.h"
 #include "descriptor.h"
 #include "kernel.h"
 #include "structure.h"
@@ -15,15 +16,50 @@ public:
 
   // Kernel attributes.
   std::vector<Kernel *> kernels;
-  std::vector<Eigen::MatrixXd> Kuu_kernels, Kuf_kernels;
-  Eigen::MatrixXd Kuu, Kuf;
   int n_kernels = 0;
   double Kuu_jitter;
 
-  // Solution attributes.
-  Eigen::MatrixXd Sigma, Kuu_inverse, R_inv, L_inv;
+  // Kernel matrices of each kernel. The full Kuu is block diagonal and the
+  // full Kuf stacks the kernel matrices, so neither is stored: the solver
+  // works with the kernel matrices directly.
+  std::vector<Eigen::MatrixXd> Kuu_kernels;
+
+  // Kuf is stored in column chunks holding whole training structures, so
+  // that adding a structure appends its columns without copying the others.
+  std::vector<ChunkedMatrix> Kuf_kernels;
+
+  // If true, training structures are stored with single precision force
+  // derivatives (see DescriptorValues::compress_force_dervs).
+  bool compact_force_dervs = false;
+
+  // If true, the neighbor lists and descriptors of training structures are
+  // released once their Kuf columns are computed. They are recomputed from
+  // the stored positions when sparse environments are added or the
+  // hyperparameters are changed.
+  bool frozen_hyperparameters = false;
+
+  // Solution attributes. R_inv_diag and L_diag hold the diagonals of the
+  // inverses of R_factor and L_factor.
   Eigen::VectorXd alpha, R_inv_diag, L_diag;
 
+  // Factors of the solution. R_factor is the triangular factor of the QR
+  // decomposition and L_factor the Cholesky factor of Kuu, with rows and
+  // columns in the order in which sparse environments were factored, so
+  // that new environments and labels can be appended without refactoring.
+  // Row p of factor_clusters holds the (kernel, type, index) of the sparse
+  // environment in position p.
+  Eigen::MatrixXd R_factor, L_factor;
+  Eigen::VectorXd Q_b_factor;
+  Eigen::MatrixXi factor_clusters;
+  int n_factor_labels = 0;
+  double factor_jitter = 0;
+  bool factor_valid = false;
+
+  // Generation of the sparse and training sets, used by kernels to check
+  // that quantities they cached are still valid (see KernelCacheKey). A new
+  // generation is taken whenever the sets change.
+  long long cache_generation = new_cache_generation();
+
   // Training and sparse points.
   std::vector<ClusterDescriptor> sparse_descriptors;
   std::vector<Structure> training_structures;
@@ -36,8 +72,8 @@ public:
   double energy_noise, force_noise, stress_noise;
 
   // Likelihood attributes.
-  double log_marginal_likelihood, data_fit, complexity_penalty, trace_term,
-      constant_term;
+  double log_marginal_likelihood = 0, data_fit = 0, complexity_penalty = 0,
+         trace_term = 0, constant_term = 0;
   Eigen::VectorXd likelihood_gradient;
 
   // Constructors.
@@ -60,24 +96,144 @@ public:
   sort_clusters_by_uncertainty(const Structure &structure);
 
   void add_training_structure(const Structure &structure);
+
+  /**
+   * Release the descriptors of all stored training structures and switch to
+   * frozen hyperparameters mode.
+   */
+  void release_training_descriptors();
   void update_Kuu(const std::vector<ClusterDescriptor> &cluster_descriptors);
   void update_Kuf(const std::vector<ClusterDescriptor> &cluster_descriptors);
-  void stack_Kuu();
-  void stack_Kuf();
 
+  /**
+   * Compute the kernels between the clusters in envs and the training
+   * structures listed in structures. The work of all kernels is split into
+   * (kernel, structure, type) tiles, which are processed in order of
+   * decreasing estimated cost with dynamic scheduling. The kernels of type k
+   * and structure structures[n] are written to kern_mats[i] starting at row
+   * row_offsets[i][k] and column columns[n].
+   */
+  void compute_Kuf_tiles(const std::vector<ClusterDescriptor> &envs,
+                         const std::vector<int> &structures,
+                         const std::vector<int> &columns,
+                         const std::vector<std::vector<int>> &row_offsets,
+                         std::vector<ChunkedMatrix> &kern_mats);
+
+  /**
+   * Assemble the block diagonal Kuu and the stacked Kuf of all kernels.
+   * These are not used by the solver and are only formed on request.
+   */
+  Eigen::MatrixXd stacked_Kuu() const;
+  Eigen::MatrixXd stacked_Kuf() const;
+
+  /**
+   * Update the solution of the sparse GP. If the QR factors of the previous
+   * call are still valid, the sparse environments and labels added since
+   * then are appended to them at O(k n_sparse^2) cost for k new labels;
+   * otherwise, the factors are recomputed from scratch.
+   */
   void update_matrices_QR();
+  void compute_QR_factors();
+  bool append_QR_columns(int n_old);
+  void append_QR_rows();
+  Eigen::PermutationMatrix<Eigen::Dynamic> factor_permutation() const;
+
+  /**
+   * Columns first to n_sparse - 1 of Kuu, with rows and columns in factor
+   * order. The entries are read from the blocks of Kuu_kernels.
+   */
+  Eigen::MatrixXd factor_Kuu_columns(int first) const;
+
+  /**
+   * Columns start to start + n - 1 of Kuf, with rows in factor order. The
+   * entries are read from the chunks of Kuf_kernels.
+   */
+  Eigen::MatrixXd factor_Kuf_rows(int start, int n) const;
+  void store_QR_solution();
+
+  /**
+   * Solve L x = K, where L is the Cholesky factor of Kuu and the rows of K
+   * are in the order of Kuu. The columns of x satisfy x^T x = K^T Kuu^-1 K.
+   */
+  Eigen::MatrixXd solve_Kuu_factor(const Eigen::MatrixXd &kernel_mat) const;
+
+  /**
+   * Solve R^T x = K, where R is the triangular QR factor and the rows of K
+   * are in the order of Kuu. The columns of x satisfy x^T x = K^T Sigma K.
+   */
+  Eigen::MatrixXd solve_Sigma_factor(const Eigen::MatrixXd &kernel_mat) const;
+
+  /**
+   * Form the inverse of Kuu (including the jitter) and Sigma explicitly.
+   * The solver only stores triangular factors, so these are computed on
+   * demand, e.g. for mapping coefficients.
+   */
+  Eigen::MatrixXd compute_Kuu_inverse() const;
+  Eigen::MatrixXd compute_Sigma() const;
 
   void predict_mean(Structure &structure);
   void predict_SOR(Structure &structure);
   void predict_DTC(Structure &structure);
   void predict_local_uncertainties(Structure &structure);
 
+  /**
+   * Batched versions of the predict methods. The kernel matrices of all
+   * structures are computed in parallel and concatenated, so that the
+   * products with the solution are done once for the whole batch.
+   */
+  void predict_mean(const std::vector<Structure *> &structures);
+  void predict_SOR(const std::vector<Structure *> &structures);
+  void predict_DTC(const std::vector<Structure *> &structures);
+  void predict_local_uncertainties(const std::vector<Structure *> &structures);
+
+  /**
+   * Kernel matrix between the sparse environments and a list of structures.
+   * Columns offsets[s] to offsets[s + 1] - 1 belong to structure s.
+   */
+  Eigen::MatrixXd
+  compute_kernel_matrix(const std::vector<Structure *> &structures,
+                        std::vector<int> &offsets);
+
   void compute_likelihood_stable();
   void compute_likelihood();
 
   double compute_likelihood_gradient(const Eigen::VectorXd &hyperparameters);
+
+  /**
+   * Compute the log marginal likelihood and its gradient for the labels of a
+   * subset of the training structures, given by their indices. If n_probes
+   * is positive, the trace terms of the gradient are estimated from n_probes
+   * random vectors (Hutchinson's estimator), seeded with seed, instead of
+   * being computed exactly. Repeated indices are counted once, and invalid
+   * or empty batches throw std::runtime_error.
+   */
+  double
+  compute_batch_likelihood_gradient(const Eigen::VectorXd &hyperparameters,
+                                    const std::vector<int> &structures,
+                                    int n_probes = 0, int seed = 0);
+
+  /**
+   * Maximize the log marginal likelihood with n_steps Adam updates. Each
+   * step uses the gradient of a random batch of batch_size training
+   * structures, scaled to the size of the training set, with the trace
+   * terms estimated from n_probes random vectors if n_probes is positive.
+   * The steps are taken in the logarithm of the hyperparameters, so
+   * learning_rate is a relative step size. The model is updated with the
+   * final hyperparameters, which are returned. The likelihood attributes
+   * hold the values of the last batch.
+   */
+  Eigen::VectorXd optimize_hyperparameters_adam(int n_steps, int batch_size,
+                                                double learning_rate = 0.01,
+                                                int n_probes = 0,
+                                                int seed = 0);
   void set_hyperparameters(Eigen::VectorXd hyps);
 
+  /**
+   * Release the quantities cached by the kernels for the likelihood
+   * gradient, e.g. after the hyperparameters are optimized.
+   */
+  void clear_kernel_caches();
+
   void write_mapping_coefficients(std::string file_name,
                                   std::string contributor,
                                   int kernel_index);
@@ -88,17 +244,25 @@ public:
                                   int kernel_index);
 
   // TODO: Make kernels jsonable.
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(SparseGP, hyperparameters, kernels,    
-    Kuu_kernels, Kuf_kernels, Kuu, Kuf, n_kernels, Kuu_jitter, Sigma,
-    Kuu_inverse, R_inv, L_inv, alpha, R_inv_diag, L_diag, sparse_descriptors,
-    training_structures, sparse_indices, noise_vector, y, label_count,
-    n_energy_labels, n_force_labels, n_stress_labels, n_sparse, n_labels,
-    n_strucs, energy_noise, force_noise, stress_noise, log_marginal_likelihood,
-    data_fit, complexity_penalty, trace_term, constant_term,
-    likelihood_gradient)
+  friend void to_json(nlohmann::json &j, const SparseGP &p);
+  friend void from_json(const nlohmann::json &j, SparseGP &p);
 
+  /**
+   * Write and read the model as JSON. The QR factors are stored, so that a
+   * loaded model is not refactored and can be extended incrementally.
+   */
   static void to_json(std::string file_name, const SparseGP & sgp);
   static SparseGP from_json(std::string file_name);
+
+  /**
+   * Write and read the model in the binary format of binary_file.h, which
+   * stores matrices as raw blobs and is memory mapped when read.
+   */
+  static void to_binary(std::string file_name, const SparseGP &sgp);
+  static SparseGP from_binary(std::string file_name);
+
+  /** Convert a file written by to_json to the binary format. */
+  static void json_to_binary(std::string json_file, std::string binary_file);
 };
 
 #endif
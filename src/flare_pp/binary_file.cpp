@@ -0,0 +1,123 @@
+#include "binary_file.h"
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+thread_local BinaryWriter *BinaryWriter::active = nullptr;
+thread_local BinaryReader *BinaryReader::active = nullptr;
+
+BinaryWriter ::BinaryWriter(const std::string &file_name)
+    : file(file_name, std::ios::binary) {
+  if (!file)
+    throw std::runtime_error("Could not open " + file_name);
+
+  // The header is written by finish, once the document offset is known.
+  std::vector<char> header(binary_alignment, 0);
+  file.write(header.data(), header.size());
+  offset = binary_alignment;
+
+  previous = active;
+  active = this;
+}
+
+BinaryWriter ::~BinaryWriter() { active = previous; }
+
+void BinaryWriter ::pad() {
+  int n_pad = (binary_alignment - offset % binary_alignment) %
+              binary_alignment;
+  std::vector<char> zeros(n_pad, 0);
+  file.write(zeros.data(), n_pad);
+  offset += n_pad;
+}
+
+nlohmann::json BinaryWriter ::write_blob(const void *data, int64_t rows,
+                                         int64_t cols,
+                                         const std::string &type,
+                                         int element_size) {
+  pad();
+  uint64_t n_bytes = rows * cols * element_size;
+  file.write(static_cast<const char *>(data), n_bytes);
+  nlohmann::json ref = {
+      {"blob", offset}, {"rows", rows}, {"cols", cols}, {"type", type}};
+  offset += n_bytes;
+  return ref;
+}
+
+void BinaryWriter ::finish(const nlohmann::json &object,
+                           const std::string &kind) {
+  nlohmann::json document = {{"kind", kind}, {"object", object}};
+  std::string text = document.dump();
+
+  pad();
+  BinaryHeader header;
+  std::memcpy(header.magic, binary_magic, sizeof(header.magic));
+  header.version = binary_version;
+  header.byte_order = 1;
+  header.document_offset = offset;
+  header.document_size = text.size();
+
+  file.write(text.data(), text.size());
+  file.seekp(0);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.close();
+  if (!file)
+    throw std::runtime_error("Could not write the binary file.");
+}
+
+BinaryReader ::BinaryReader(const std::string &file_name,
+                            const std::string &kind) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Could not open " + file_name);
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  size = file_stat.st_size;
+  void *address = nullptr;
+  if (size >= sizeof(BinaryHeader))
+    address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == nullptr || address == MAP_FAILED)
+    throw std::runtime_error("Could not map " + file_name);
+  data = static_cast<const char *>(address);
+
+  BinaryHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, binary_magic, sizeof(header.magic)) != 0 ||
+      header.byte_order != 1 || header.version > binary_version ||
+      header.document_offset + header.document_size > size) {
+    munmap(const_cast<char *>(data), size);
+    throw std::runtime_error(file_name + " is not a valid binary file.");
+  }
+
+  const char *text = data + header.document_offset;
+  nlohmann::json document =
+      nlohmann::json::parse(text, text + header.document_size);
+  if (document.at("kind").get<std::string>() != kind) {
+    munmap(const_cast<char *>(data), size);
+    throw std::runtime_error(file_name + " does not hold a " + kind + ".");
+  }
+  object = std::move(document.at("object"));
+
+  previous = active;
+  active = this;
+}
+
+BinaryReader ::~BinaryReader() {
+  active = previous;
+  munmap(const_cast<char *>(data), size);
+}
+
+const char *BinaryReader ::blob(const nlohmann::json &ref,
+                                const std::string &type,
+                                int element_size) const {
+  uint64_t offset = ref.at("blob").get<uint64_t>();
+  int64_t rows = ref.at("rows").get<int64_t>();
+  int64_t cols = ref.at("cols").get<int64_t>();
+  if (ref.at("type").get<std::string>() != type || rows < 0 || cols < 0 ||
+      offset + rows * cols * element_size > size)
+    throw std::runtime_error("Invalid blob in binary file.");
+  return data + offset;
+}
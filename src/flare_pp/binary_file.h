@@ -0,0 +1,154 @@
+#ifndef BINARY_FILE_H
+#define BINARY_FILE_H
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <nlohmann/json.hpp>
+#include "json_stream.h"
+
+/**
+ * Binary model files. The JSON serializers of the library are reused for
+ * the structure of the model, but while a BinaryWriter is active, each
+ * Eigen matrix and vector is written to the file as a raw column-major blob
+ * and replaced in the JSON document by a reference to it. A file holds a
+ * fixed header, the blobs, aligned to binary_alignment bytes, and the
+ * document, which is small compared with the blobs.
+ *
+ * BinaryReader maps the file into memory with mmap, parses the document,
+ * and makes the blobs available to the JSON deserializers, which copy each
+ * matrix directly from the mapped file. Loading is limited by the speed of
+ * the disk, and no text is parsed for the matrix entries.
+ */
+
+const char binary_magic[8] = {'F', 'L', 'A', 'R', 'E', 'P', 'P', 'B'};
+const uint32_t binary_version = 1;
+const int binary_alignment = 64;
+
+struct BinaryHeader {
+  char magic[8];
+  uint32_t version;
+
+  // Written as 1, to detect files with a different byte order.
+  uint32_t byte_order;
+  uint64_t document_offset, document_size;
+};
+
+class BinaryWriter {
+public:
+  /** Create the file and make this the active writer. */
+  explicit BinaryWriter(const std::string &file_name);
+  ~BinaryWriter();
+
+  /** Write a blob and return the reference stored in the document. */
+  nlohmann::json write_blob(const void *data, int64_t rows, int64_t cols,
+                            const std::string &type, int element_size);
+
+  /** Write the document of an object of the given kind and the header. */
+  void finish(const nlohmann::json &object, const std::string &kind);
+
+  // Writer used by the JSON serializers of the current thread, if any.
+  static thread_local BinaryWriter *active;
+
+private:
+  std::ofstream file;
+  uint64_t offset;
+  BinaryWriter *previous;
+
+  void pad();
+};
+
+class BinaryReader {
+public:
+  /**
+   * Map the file and parse its document, which must describe an object of
+   * the given kind, and make this the active reader.
+   */
+  BinaryReader(const std::string &file_name, const std::string &kind);
+  ~BinaryReader();
+
+  // Serialized object, with references to the blobs.
+  nlohmann::json object;
+
+  /** Return the address of a blob, checking its type and bounds. */
+  const char *blob(const nlohmann::json &ref, const std::string &type,
+                   int element_size) const;
+
+  // Reader used by the JSON serializers of the current thread, if any.
+  static thread_local BinaryReader *active;
+
+private:
+  const char *data;
+  uint64_t size;
+  BinaryReader *previous;
+};
+
+inline std::string blob_type(double) { return "f8"; }
+inline std::string blob_type(float) { return "f4"; }
+inline std::string blob_type(int) { return "i4"; }
+
+/**
+ * Called by the JSON serializers of Eigen types. If a writer is active, the
+ * matrix is written as a blob and true is returned.
+ */
+template <typename Matrix>
+bool write_matrix_blob(nlohmann::json &j, const Matrix &matrix) {
+  if (BinaryWriter::active == nullptr)
+    return false;
+  typedef typename Matrix::Scalar Scalar;
+  j = BinaryWriter::active->write_blob(matrix.data(), matrix.rows(),
+                                       matrix.cols(), blob_type(Scalar()),
+                                       sizeof(Scalar));
+  return true;
+}
+
+/**
+ * Called by the JSON deserializers of Eigen types. If j is a reference to a
+ * blob, the matrix is copied from the active reader and true is returned.
+ */
+template <typename Matrix>
+bool read_matrix_blob(const nlohmann::json &j, Matrix &matrix) {
+  if (!j.is_object() || j.find("blob") == j.end())
+    return false;
+  if (BinaryReader::active == nullptr)
+    throw std::runtime_error("Blob reference outside of a binary file.");
+
+  typedef typename Matrix::Scalar Scalar;
+  const char *blob = BinaryReader::active->blob(j, blob_type(Scalar()),
+                                                sizeof(Scalar));
+  matrix.resize(j.at("rows").get<int64_t>(), j.at("cols").get<int64_t>());
+  std::memcpy(matrix.data(), blob, matrix.size() * sizeof(Scalar));
+  return true;
+}
+
+/** Write an object to a binary file. */
+template <typename T>
+void write_binary(const std::string &file_name, const T &object,
+                  const std::string &kind) {
+  BinaryWriter writer(file_name);
+  nlohmann::json j = object;
+  writer.finish(j, kind);
+}
+
+/** Read an object from a binary file. */
+template <typename T>
+T read_binary(const std::string &file_name, const std::string &kind) {
+  BinaryReader reader(file_name, kind);
+  return reader.object.get<T>();
+}
+
+/**
+ * Convert a JSON file written by to_json into a binary file. The object is
+ * read into memory once, without any other processing.
+ */
+template <typename T>
+void convert_json_to_binary(const std::string &json_file,
+                            const std::string &binary_file,
+                            const std::string &kind) {
+  T object = read_json_stream<T>(json_file);
+  write_binary(binary_file, object, kind);
+}
+
+#endif
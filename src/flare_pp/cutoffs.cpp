@@ -5,7 +5,7 @@
 
 // This polynomial cutoff was introduced in Klicpera et al. arXiv:2003.03123.
 void polynomial_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                       std::vector<double> cutoff_hyps) {
+                       const std::vector<double> &cutoff_hyps) {
 
   if (r > rcut) {
     rcut_vals[0] = 0;
@@ -27,7 +27,7 @@ void polynomial_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
 }
 
 void power_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                  std::vector<double> cutoff_hyps) {
+                  const std::vector<double> &cutoff_hyps) {
 
   if (r > rcut) {
     rcut_vals[0] = 0;
@@ -42,7 +42,7 @@ void power_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
 }
 
 void quadratic_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                      std::vector<double> cutoff_hyps) {
+                      const std::vector<double> &cutoff_hyps) {
 
   if (r > rcut) {
     rcut_vals[0] = 0;
@@ -56,7 +56,7 @@ void quadratic_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
 }
 
 void cos_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                std::vector<double> cutoff_hyps) {
+                const std::vector<double> &cutoff_hyps) {
 
   // Calculate the cosine cutoff function and its gradient.
   if (r > rcut) {
@@ -73,7 +73,7 @@ void cos_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
 }
 
 void hard_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
-                 std::vector<double> cutoff_hyps) {
+                 const std::vector<double> &cutoff_hyps) {
   if (r > rcut) {
     rcut_vals[0] = 0;
     rcut_vals[1] = 0;
@@ -86,7 +86,8 @@ void hard_cutoff(std::vector<double> &rcut_vals, double r, double rcut,
 
 void set_cutoff(const std::string &cutoff_function,
                 std::function<void(std::vector<double> &, double, double,
-                                   std::vector<double>)> &cutoff_pointer){
+                                   const std::vector<double> &)>
+                    &cutoff_pointer){
 
   // Set the cutoff function.
   if (cutoff_function == "quadratic") {
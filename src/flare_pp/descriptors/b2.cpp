@@ -1,4 +1,5 @@
 #include "b2.h"
+#include "b2_simd.h"
 #include "cutoffs.h"
 #include "descriptor.h"
 #include "radial.h"
@@ -73,47 +74,34 @@ void B2 ::write_to_file(std::ofstream &coeff_file, int coeff_size) {
   coeff_file << "\n";
 }
 
-DescriptorValues B2 ::compute_struc(Structure &structure) {
+// Allocate the descriptor arrays of a structure and record which atoms and
+// neighbors belong to each species. On return, type_rows(i) is the row of
+// atom i in the arrays of its species, and type_neighbor_rows(i) is the
+// position of its first neighbor.
+static DescriptorValues
+initialize_b2_values(const Structure &structure,
+                     const Eigen::VectorXi &unique_neighbor_count, int nos,
+                     int n_d, Eigen::VectorXi &type_rows,
+                     Eigen::VectorXi &type_neighbor_rows) {
 
-  // Initialize descriptor values.
   DescriptorValues desc = DescriptorValues();
 
-  // Compute single bond values.
-  Eigen::MatrixXd single_bond_vals, force_dervs, neighbor_coords;
-  Eigen::VectorXi unique_neighbor_count, cumulative_neighbor_count,
-      descriptor_indices;
-
-  int nos = descriptor_settings[0];
-  int N = descriptor_settings[1];
-  int lmax = descriptor_settings[2];
-
-  single_bond_multiple_cutoffs(
-    single_bond_vals, force_dervs, neighbor_coords, unique_neighbor_count,
-    cumulative_neighbor_count, descriptor_indices, radial_pointer,
-    cutoff_pointer, nos, N, lmax, radial_hyps, cutoff_hyps, structure,
-    cutoffs);
-
-  // Compute descriptor values.
-  Eigen::MatrixXd B2_vals, B2_force_dervs;
-  Eigen::VectorXd B2_norms, B2_force_dots;
-
-  compute_b2(B2_vals, B2_force_dervs, B2_norms, B2_force_dots, single_bond_vals,
-             force_dervs, unique_neighbor_count, cumulative_neighbor_count,
-             descriptor_indices, nos, N, lmax);
-
   // Gather species information.
   int noa = structure.noa;
   Eigen::VectorXi species_count = Eigen::VectorXi::Zero(nos);
   Eigen::VectorXi neighbor_count = Eigen::VectorXi::Zero(nos);
+  type_rows = Eigen::VectorXi::Zero(noa);
+  type_neighbor_rows = Eigen::VectorXi::Zero(noa);
   for (int i = 0; i < noa; i++) {
     int s = structure.species[i];
     int n_neigh = unique_neighbor_count(i);
+    type_rows(i) = species_count(s);
+    type_neighbor_rows(i) = neighbor_count(s);
     species_count(s)++;
     neighbor_count(s) += n_neigh;
   }
 
   // Initialize arrays.
-  int n_d = B2_vals.cols();
   desc.n_descriptors = n_d;
   desc.n_types = nos;
   desc.n_atoms = noa;
@@ -145,14 +133,225 @@ DescriptorValues B2 ::compute_struc(Structure &structure) {
     desc.neighbor_indices.push_back(Eigen::VectorXi::Zero(n_neigh));
   }
 
+  // Record the atoms of each species.
+  for (int i = 0; i < noa; i++) {
+    int s = structure.species[i];
+    desc.neighbor_counts[s](type_rows(i)) = unique_neighbor_count(i);
+    desc.cumulative_neighbor_counts[s](type_rows(i)) = type_neighbor_rows(i);
+    desc.atom_indices[s](type_rows(i)) = i;
+  }
+
+  return desc;
+}
+
+B2Scratch ::B2Scratch(int nos, int N, int lmax, int max_neighbors,
+                      const std::vector<double> &radial_hyps) {
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  int n_bond = nos * N * n_harmonics;
+
+  g = gx = gy = gz = std::vector<double>(N, 0);
+  h = hx = hy = hz = std::vector<double>(n_harmonics, 0);
+  rcut_vals = std::vector<double>(2, 0);
+  basis_vals = basis_derivs = std::vector<double>(N, 0);
+  this->radial_hyps = radial_hyps;
+
+  single_bond_vals = Eigen::VectorXd::Zero(n_bond);
+  single_bond_force_dervs = Eigen::MatrixXd::Zero(max_neighbors * 3, n_bond);
+}
+
+DescriptorValues B2 ::compute_struc(Structure &structure) {
+
+  int nos = descriptor_settings[0];
+  int N = descriptor_settings[1];
+  int lmax = descriptor_settings[2];
+
+  int noa = structure.noa;
+  int n_radial = nos * N;
+  int n_harmonics = (lmax + 1) * (lmax + 1);
+  int no_bond_vals = N * n_harmonics;
+  int n_d = (n_radial * (n_radial + 1) / 2) * (lmax + 1);
+
+  // Count atoms inside the descriptor cutoff.
+  Eigen::VectorXi unique_neighbor_count = Eigen::VectorXi::Zero(noa);
+  for (int i = 0; i < noa; i++) {
+    int central_species = structure.species[i];
+    int rel_index = structure.cumulative_neighbor_count(i);
+    for (int j = 0; j < structure.neighbor_count(i); j++) {
+      int neigh_index = rel_index + j;
+      int neighbor_species = structure.neighbor_species(neigh_index);
+      double rcut = cutoffs(central_species, neighbor_species);
+      if (structure.relative_positions(neigh_index, 0) <= rcut)
+        unique_neighbor_count(i)++;
+    }
+  }
+  int max_neighbors = (noa > 0) ? unique_neighbor_count.maxCoeff() : 0;
+
+  Eigen::VectorXi type_rows, type_neighbor_rows;
+  DescriptorValues desc =
+      initialize_b2_values(structure, unique_neighbor_count, nos, n_d,
+                           type_rows, type_neighbor_rows);
+
+#pragma omp parallel
+  {
+    B2Scratch scratch(nos, N, lmax, max_neighbors, radial_hyps);
+    Eigen::VectorXd &single_bond_vals = scratch.single_bond_vals;
+    Eigen::MatrixXd &single_bond_force_dervs = scratch.single_bond_force_dervs;
+
+#pragma omp for
+    for (int i = 0; i < noa; i++) {
+      int s = structure.species[i];
+      int row = type_rows(i);
+      int neighbor_row = type_neighbor_rows(i);
+      int n_neighbors = unique_neighbor_count(i);
+      int i_neighbors = structure.neighbor_count(i);
+      int rel_index = structure.cumulative_neighbor_count(i);
+
+      // Compute single bond values of the atom.
+      single_bond_vals.setZero();
+      single_bond_force_dervs.topRows(n_neighbors * 3).setZero();
+      int neighbor_index = 0;
+      for (int j = 0; j < i_neighbors; j++) {
+        int neigh_index = rel_index + j;
+        int neighbor_species = structure.neighbor_species(neigh_index);
+        double rcut = cutoffs(s, neighbor_species);
+        double r = structure.relative_positions(neigh_index, 0);
+        if (r > rcut)
+          continue; // Skip if outside cutoff.
+        double x = structure.relative_positions(neigh_index, 1);
+        double y = structure.relative_positions(neigh_index, 2);
+        double z = structure.relative_positions(neigh_index, 3);
+
+        // Store neighbor coordinates and indices.
+        int neighbor_slot = neighbor_row + neighbor_index;
+        desc.neighbor_coordinates[s](neighbor_slot, 0) = x;
+        desc.neighbor_coordinates[s](neighbor_slot, 1) = y;
+        desc.neighbor_coordinates[s](neighbor_slot, 2) = z;
+        desc.neighbor_indices[s](neighbor_slot) =
+            structure.structure_indices(neigh_index);
+
+        // Compute radial basis values and spherical harmonics, with the
+        // endpoint of the radial basis set to the pair cutoff.
+        scratch.radial_hyps[1] = rcut;
+        calculate_radial(scratch.g, scratch.gx, scratch.gy, scratch.gz,
+                         radial_pointer, cutoff_pointer, x, y, z, r, rcut, N,
+                         scratch.radial_hyps, cutoff_hyps, scratch.rcut_vals,
+                         scratch.basis_vals, scratch.basis_derivs);
+        get_Y(scratch.h, scratch.hx, scratch.hy, scratch.hz, x, y, z, lmax);
+
+        // Store the products and their derivatives.
+        int descriptor_counter = neighbor_species * no_bond_vals;
+        for (int radial_counter = 0; radial_counter < N; radial_counter++) {
+          double g_val = scratch.g[radial_counter];
+          double gx_val = scratch.gx[radial_counter];
+          double gy_val = scratch.gy[radial_counter];
+          double gz_val = scratch.gz[radial_counter];
+
+          for (int angular_counter = 0; angular_counter < n_harmonics;
+               angular_counter++) {
+            double h_val = scratch.h[angular_counter];
+            double bond = g_val * h_val;
+            double bond_x =
+                gx_val * h_val + g_val * scratch.hx[angular_counter];
+            double bond_y =
+                gy_val * h_val + g_val * scratch.hy[angular_counter];
+            double bond_z =
+                gz_val * h_val + g_val * scratch.hz[angular_counter];
+
+            single_bond_vals(descriptor_counter) += bond;
+            single_bond_force_dervs(neighbor_index * 3, descriptor_counter) +=
+                bond_x;
+            single_bond_force_dervs(neighbor_index * 3 + 1,
+                                    descriptor_counter) += bond_y;
+            single_bond_force_dervs(neighbor_index * 3 + 2,
+                                    descriptor_counter) += bond_z;
+
+            descriptor_counter++;
+          }
+        }
+        neighbor_index++;
+      }
+
+      // Contract the single bond values into the power spectrum.
+      Eigen::MatrixXd &B2_vals = desc.descriptors[s];
+      Eigen::MatrixXd &B2_force_dervs = desc.descriptor_force_dervs[s];
+      Eigen::VectorXd &B2_force_dots = desc.descriptor_force_dots[s];
+      int force_start = neighbor_row * 3;
+      int n_rows = n_neighbors * 3;
+      int ld = single_bond_force_dervs.outerStride();
+      int counter = 0;
+      for (int n1 = 0; n1 < n_radial; n1++) {
+        for (int n2 = n1; n2 < n_radial; n2++) {
+          for (int l = 0; l < (lmax + 1); l++) {
+            int n1_l = n1 * n_harmonics + l * l;
+            int n2_l = n2 * n_harmonics + l * l;
+            for (int m = 0; m < (2 * l + 1); m++) {
+              B2_vals(row, counter) +=
+                  single_bond_vals(n1_l + m) * single_bond_vals(n2_l + m);
+            }
+
+            // Store force derivatives and force dot products.
+            if (n_rows > 0) {
+              contract_b2_column(
+                  n_rows, 2 * l + 1, &single_bond_vals(n1_l),
+                  &single_bond_vals(n2_l), 1,
+                  &single_bond_force_dervs(0, n1_l),
+                  &single_bond_force_dervs(0, n2_l), ld, B2_vals(row, counter),
+                  &B2_force_dervs(force_start, counter),
+                  &B2_force_dots(force_start));
+            }
+            counter++;
+          }
+        }
+      }
+
+      // Compute descriptor norm.
+      desc.descriptor_norms[s](row) =
+          sqrt(B2_vals.row(row).dot(B2_vals.row(row)));
+    }
+  }
+
+  return desc;
+}
+
+DescriptorValues B2 ::compute_struc_two_pass(Structure &structure) {
+
+  // Compute single bond values.
+  Eigen::MatrixXd single_bond_vals, force_dervs, neighbor_coords;
+  Eigen::VectorXi unique_neighbor_count, cumulative_neighbor_count,
+      descriptor_indices;
+
+  int nos = descriptor_settings[0];
+  int N = descriptor_settings[1];
+  int lmax = descriptor_settings[2];
+
+  single_bond_multiple_cutoffs(
+    single_bond_vals, force_dervs, neighbor_coords, unique_neighbor_count,
+    cumulative_neighbor_count, descriptor_indices, radial_pointer,
+    cutoff_pointer, nos, N, lmax, radial_hyps, cutoff_hyps, structure,
+    cutoffs);
+
+  // Compute descriptor values.
+  Eigen::MatrixXd B2_vals, B2_force_dervs;
+  Eigen::VectorXd B2_norms, B2_force_dots;
+
+  compute_b2(B2_vals, B2_force_dervs, B2_norms, B2_force_dots, single_bond_vals,
+             force_dervs, unique_neighbor_count, cumulative_neighbor_count,
+             descriptor_indices, nos, N, lmax);
+
+  // Initialize arrays.
+  int noa = structure.noa;
+  int n_d = B2_vals.cols();
+  Eigen::VectorXi type_rows, type_neighbor_rows;
+  DescriptorValues desc =
+      initialize_b2_values(structure, unique_neighbor_count, nos, n_d,
+                           type_rows, type_neighbor_rows);
+
   // Assign to structure.
-  Eigen::VectorXi species_counter = Eigen::VectorXi::Zero(nos);
-  Eigen::VectorXi neighbor_counter = Eigen::VectorXi::Zero(nos);
   for (int i = 0; i < noa; i++) {
     int s = structure.species[i];
-    int s_count = species_counter(s);
+    int s_count = type_rows(i);
     int n_neigh = unique_neighbor_count(i);
-    int n_count = neighbor_counter(s);
+    int n_count = type_neighbor_rows(i);
     int cum_neigh = cumulative_neighbor_count(i);
 
     desc.descriptors[s].row(s_count) = B2_vals.row(i);
@@ -165,14 +364,8 @@ DescriptorValues B2 ::compute_struc(Structure &structure) {
     desc.descriptor_force_dots[s].segment(n_count * 3, n_neigh * 3) =
         B2_force_dots.segment(cum_neigh * 3, n_neigh * 3);
 
-    desc.neighbor_counts[s](s_count) = n_neigh;
-    desc.cumulative_neighbor_counts[s](s_count) = n_count;
-    desc.atom_indices[s](s_count) = i;
     desc.neighbor_indices[s].segment(n_count, n_neigh) =
         descriptor_indices.segment(cum_neigh, n_neigh);
-
-    species_counter(s)++;
-    neighbor_counter(s) += n_neigh;
   }
 
   return desc;
@@ -205,37 +398,36 @@ void compute_b2(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
     int n_atom_neighbors = unique_neighbor_count(atom);
     int force_start = cumulative_neighbor_count(atom) * 3;
     int n1, n2, l, m, n1_l, n2_l;
+    int n_rows = n_atom_neighbors * 3;
+    int vals_stride = single_bond_vals.outerStride();
+    int ld = single_bond_force_dervs.outerStride();
     int counter = 0;
     for (int n1 = 0; n1 < n_radial; n1++) {
       for (int n2 = n1; n2 < n_radial; n2++) {
         for (int l = 0; l < (lmax + 1); l++) {
+          n1_l = n1 * n_harmonics + l * l;
+          n2_l = n2 * n_harmonics + l * l;
           for (int m = 0; m < (2 * l + 1); m++) {
-            n1_l = n1 * n_harmonics + (l * l + m);
-            n2_l = n2 * n_harmonics + (l * l + m);
-            B2_vals(atom, counter) +=
-                single_bond_vals(atom, n1_l) * single_bond_vals(atom, n2_l);
-
-            // Store force derivatives.
-            for (int n = 0; n < n_atom_neighbors; n++) {
-              for (int comp = 0; comp < 3; comp++) {
-                int ind = force_start + n * 3 + comp;
-                B2_force_dervs(ind, counter) +=
-                    single_bond_vals(atom, n1_l) *
-                        single_bond_force_dervs(ind, n2_l) +
-                    single_bond_force_dervs(ind, n1_l) *
-                        single_bond_vals(atom, n2_l);
-              }
-            }
+            B2_vals(atom, counter) += single_bond_vals(atom, n1_l + m) *
+                                      single_bond_vals(atom, n2_l + m);
+          }
+
+          // Store force derivatives and force dot products.
+          if (n_rows > 0) {
+            contract_b2_column(
+                n_rows, 2 * l + 1, &single_bond_vals(atom, n1_l),
+                &single_bond_vals(atom, n2_l), vals_stride,
+                &single_bond_force_dervs(force_start, n1_l),
+                &single_bond_force_dervs(force_start, n2_l), ld,
+                B2_vals(atom, counter), &B2_force_dervs(force_start, counter),
+                &B2_force_dots(force_start));
           }
           counter++;
         }
       }
     }
-    // Compute descriptor norm and force dot products.
+    // Compute descriptor norm.
     B2_norms(atom) = sqrt(B2_vals.row(atom).dot(B2_vals.row(atom)));
-    B2_force_dots.segment(force_start, n_atom_neighbors * 3) =
-        B2_force_dervs.block(force_start, 0, n_atom_neighbors * 3, n_d) *
-        B2_vals.row(atom).transpose();
   }
 }
 
@@ -245,10 +437,10 @@ void single_bond_multiple_cutoffs(
     Eigen::VectorXi &cumulative_neighbor_count,
     Eigen::VectorXi &neighbor_indices,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         radial_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int nos, int N, int lmax, const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, const Structure &structure,
@@ -402,10 +594,10 @@ void compute_single_bond(
     Eigen::VectorXi &cumulative_neighbor_count,
     Eigen::VectorXi &neighbor_indices,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         radial_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int nos, int N, int lmax, const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, const Structure &structure) {
@@ -12,10 +12,10 @@ class Structure;
 class B2 : public Descriptor {
 public:
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       radial_pointer;
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_pointer;
   std::string radial_basis, cutoff_function;
   std::vector<double> radial_hyps, cutoff_hyps;
@@ -45,13 +45,42 @@ public:
      const std::vector<int> &descriptor_settings,
      const Eigen::MatrixXd &cutoffs);
 
+  /**
+   * Compute B2 descriptors in a single sweep per atom. The single bond
+   * values of each atom are accumulated in per-thread scratch buffers and
+   * contracted into the power spectrum immediately, without storing the
+   * single bond arrays of the whole structure.
+   */
   DescriptorValues compute_struc(Structure &structure);
 
+  /**
+   * Reference implementation that first computes the single bond arrays of
+   * the whole structure and then contracts them in a second pass. Gives the
+   * same output as compute_struc.
+   */
+  DescriptorValues compute_struc_two_pass(Structure &structure);
+
   void write_to_file(std::ofstream &coeff_file, int coeff_size);
 
   nlohmann::json return_json();
 };
 
+/**
+ * Scratch buffers used by B2::compute_struc. Each thread owns one, sized for
+ * the largest neighbor count in the structure, so that no memory is
+ * allocated inside the loop over atoms.
+ */
+class B2Scratch {
+public:
+  std::vector<double> g, gx, gy, gz, h, hx, hy, hz;
+  std::vector<double> rcut_vals, basis_vals, basis_derivs, radial_hyps;
+  Eigen::VectorXd single_bond_vals;
+  Eigen::MatrixXd single_bond_force_dervs;
+
+  B2Scratch(int nos, int N, int lmax, int max_neighbors,
+            const std::vector<double> &radial_hyps);
+};
+
 void compute_b2(Eigen::MatrixXd &B2_vals, Eigen::MatrixXd &B2_force_dervs,
                 Eigen::VectorXd &B2_norms, Eigen::VectorXd &B2_force_dots,
                 const Eigen::MatrixXd &single_bond_vals,
@@ -71,10 +100,10 @@ void single_bond_multiple_cutoffs(
     Eigen::VectorXi &cumulative_neighbor_count,
     Eigen::VectorXi &neighbor_indices,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         radial_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int nos, int N, int lmax, const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, const Structure &structure,
@@ -90,10 +119,10 @@ void compute_single_bond(
     Eigen::VectorXi &cumulative_neighbor_count,
     Eigen::VectorXi &neighbor_indices,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         radial_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int nos, int N, int lmax, const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, const Structure &structure);
@@ -0,0 +1,130 @@
+#include "b2_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLARE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+typedef void (*ContractionFunction)(int, int, const double *, const double *,
+                                    int, const double *, const double *, int,
+                                    double, double *, double *);
+
+void contract_b2_column_scalar(int n_rows, int n_m, const double *vals_1,
+                               const double *vals_2, int vals_stride,
+                               const double *dervs_1, const double *dervs_2,
+                               int ld, double B2_val, double *B2_dervs,
+                               double *B2_dots) {
+  for (int i = 0; i < n_rows; i++) {
+    double acc = B2_dervs[i];
+    for (int m = 0; m < n_m; m++) {
+      acc += vals_1[m * vals_stride] * dervs_2[i + m * ld] +
+             dervs_1[i + m * ld] * vals_2[m * vals_stride];
+    }
+    B2_dervs[i] = acc;
+    B2_dots[i] += acc * B2_val;
+  }
+}
+
+#ifdef FLARE_X86_DISPATCH
+
+// The vector loops below process 8 (AVX-512) or 4 (AVX2) rows at a time.
+// Leftover rows use scalar fused multiply-adds, so that every row is
+// computed with the same rounding.
+
+__attribute__((target("avx512f"))) static void
+contract_b2_column_avx512(int n_rows, int n_m, const double *vals_1,
+                          const double *vals_2, int vals_stride,
+                          const double *dervs_1, const double *dervs_2,
+                          int ld, double B2_val, double *B2_dervs,
+                          double *B2_dots) {
+  __m512d val = _mm512_set1_pd(B2_val);
+  int i = 0;
+  for (; i + 8 <= n_rows; i += 8) {
+    __m512d acc = _mm512_loadu_pd(B2_dervs + i);
+    for (int m = 0; m < n_m; m++) {
+      __m512d v1 = _mm512_set1_pd(vals_1[m * vals_stride]);
+      __m512d v2 = _mm512_set1_pd(vals_2[m * vals_stride]);
+      __m512d d1 = _mm512_loadu_pd(dervs_1 + m * ld + i);
+      __m512d d2 = _mm512_loadu_pd(dervs_2 + m * ld + i);
+      acc = _mm512_fmadd_pd(v1, d2, _mm512_fmadd_pd(d1, v2, acc));
+    }
+    _mm512_storeu_pd(B2_dervs + i, acc);
+    __m512d dots = _mm512_loadu_pd(B2_dots + i);
+    _mm512_storeu_pd(B2_dots + i, _mm512_fmadd_pd(acc, val, dots));
+  }
+  for (; i < n_rows; i++) {
+    double acc = B2_dervs[i];
+    for (int m = 0; m < n_m; m++) {
+      acc = __builtin_fma(vals_1[m * vals_stride], dervs_2[i + m * ld],
+                          __builtin_fma(dervs_1[i + m * ld],
+                                        vals_2[m * vals_stride], acc));
+    }
+    B2_dervs[i] = acc;
+    B2_dots[i] = __builtin_fma(acc, B2_val, B2_dots[i]);
+  }
+}
+
+__attribute__((target("avx2,fma"))) static void
+contract_b2_column_avx2(int n_rows, int n_m, const double *vals_1,
+                        const double *vals_2, int vals_stride,
+                        const double *dervs_1, const double *dervs_2, int ld,
+                        double B2_val, double *B2_dervs, double *B2_dots) {
+  __m256d val = _mm256_set1_pd(B2_val);
+  int i = 0;
+  for (; i + 4 <= n_rows; i += 4) {
+    __m256d acc = _mm256_loadu_pd(B2_dervs + i);
+    for (int m = 0; m < n_m; m++) {
+      __m256d v1 = _mm256_set1_pd(vals_1[m * vals_stride]);
+      __m256d v2 = _mm256_set1_pd(vals_2[m * vals_stride]);
+      __m256d d1 = _mm256_loadu_pd(dervs_1 + m * ld + i);
+      __m256d d2 = _mm256_loadu_pd(dervs_2 + m * ld + i);
+      acc = _mm256_fmadd_pd(v1, d2, _mm256_fmadd_pd(d1, v2, acc));
+    }
+    _mm256_storeu_pd(B2_dervs + i, acc);
+    __m256d dots = _mm256_loadu_pd(B2_dots + i);
+    _mm256_storeu_pd(B2_dots + i, _mm256_fmadd_pd(acc, val, dots));
+  }
+  for (; i < n_rows; i++) {
+    double acc = B2_dervs[i];
+    for (int m = 0; m < n_m; m++) {
+      acc = __builtin_fma(vals_1[m * vals_stride], dervs_2[i + m * ld],
+                          __builtin_fma(dervs_1[i + m * ld],
+                                        vals_2[m * vals_stride], acc));
+    }
+    B2_dervs[i] = acc;
+    B2_dots[i] = __builtin_fma(acc, B2_val, B2_dots[i]);
+  }
+}
+
+#endif
+
+static ContractionFunction select_contraction(const char **isa) {
+#ifdef FLARE_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    *isa = "avx512";
+    return contract_b2_column_avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    *isa = "avx2";
+    return contract_b2_column_avx2;
+  }
+#endif
+  *isa = "scalar";
+  return contract_b2_column_scalar;
+}
+
+// Selected once, when the library is loaded.
+static const char *contraction_isa = "scalar";
+static const ContractionFunction contraction =
+    select_contraction(&contraction_isa);
+
+void contract_b2_column(int n_rows, int n_m, const double *vals_1,
+                        const double *vals_2, int vals_stride,
+                        const double *dervs_1, const double *dervs_2, int ld,
+                        double B2_val, double *B2_dervs, double *B2_dots) {
+  contraction(n_rows, n_m, vals_1, vals_2, vals_stride, dervs_1, dervs_2, ld,
+              B2_val, B2_dervs, B2_dots);
+}
+
+const char *b2_simd_isa() { return contraction_isa; }
@@ -0,0 +1,38 @@
+#ifndef B2_SIMD_H
+#define B2_SIMD_H
+
+/**
+ * Compute one column of the B2 force derivatives, given the single bond
+ * values and derivatives of a pair of radial channels at a fixed l:
+ *
+ *   B2_dervs[i] += sum_m vals_1[m] * dervs_2[i + m * ld] +
+ *                        dervs_1[i + m * ld] * vals_2[m],
+ *   B2_dots[i] += B2_dervs[i] * B2_val,
+ *
+ * for i = 0, ..., n_rows - 1 and m = 0, ..., n_m - 1. The derivative columns
+ * of consecutive m are ld apart, so each inner loop runs over contiguous
+ * memory. The implementation is chosen at runtime from AVX-512, AVX2 + FMA
+ * and portable scalar versions.
+ */
+void contract_b2_column(int n_rows, int n_m, const double *vals_1,
+                        const double *vals_2, int vals_stride,
+                        const double *dervs_1, const double *dervs_2, int ld,
+                        double B2_val, double *B2_dervs, double *B2_dots);
+
+/**
+ * Portable version of contract_b2_column, accumulating with separate
+ * multiplies and adds.
+ */
+void contract_b2_column_scalar(int n_rows, int n_m, const double *vals_1,
+                               const double *vals_2, int vals_stride,
+                               const double *dervs_1, const double *dervs_2,
+                               int ld, double B2_val, double *B2_dervs,
+                               double *B2_dots);
+
+/**
+ * Name of the instruction set used by contract_b2_column ("avx512",
+ * "avx2" or "scalar").
+ */
+const char *b2_simd_isa();
+
+#endif
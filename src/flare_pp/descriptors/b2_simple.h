@@ -10,10 +10,10 @@ class Structure;
 class B2_Simple : public Descriptor {
 public:
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       radial_pointer;
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_pointer;
   std::string radial_basis, cutoff_function;
   std::vector<double> radial_hyps, cutoff_hyps;
@@ -10,10 +10,10 @@ class Structure;
 class B3 : public Descriptor {
 public:
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       radial_pointer;
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_pointer;
   std::string radial_basis, cutoff_function;
   std::vector<double> radial_hyps, cutoff_hyps;
@@ -49,10 +49,10 @@ void complex_single_bond(
     Eigen::VectorXi &cumulative_neighbor_count,
     Eigen::VectorXi &neighbor_indices,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         radial_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     int nos, int N, int lmax, const std::vector<double> &radial_hyps,
     const std::vector<double> &cutoff_hyps, const Structure &structure);
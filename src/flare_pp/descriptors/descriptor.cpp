@@ -3,6 +3,7 @@
 #include "radial.h"
 #include "structure.h"
 #include "b2.h"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
@@ -40,6 +41,128 @@ void from_json(const nlohmann::json& j, std::vector<Descriptor*> & p){
 
 DescriptorValues::DescriptorValues() {}
 
+// Number of force derivative rows converted to another precision at a time
+// when multiplying force derivatives.
+static const int compact_block_rows = 1024;
+
+void DescriptorValues ::compress_force_dervs() {
+  if (compact)
+    return;
+
+  compact_force_dervs.resize(descriptor_force_dervs.size());
+  for (int s = 0; s < descriptor_force_dervs.size(); s++) {
+    compact_force_dervs[s] = descriptor_force_dervs[s].cast<float>();
+    descriptor_force_dervs[s].resize(0, 0);
+  }
+  compact = true;
+}
+
+Eigen::MatrixXd
+DescriptorValues ::force_dot_product(int s,
+                                     const Eigen::MatrixXd &envs) const {
+  if (!compact)
+    return envs * descriptor_force_dervs[s].transpose();
+
+  const Eigen::MatrixXf &dervs = compact_force_dervs[s];
+  int n_rows = dervs.rows();
+  Eigen::MatrixXd product(envs.rows(), n_rows);
+  Eigen::MatrixXd block;
+  for (int start = 0; start < n_rows; start += compact_block_rows) {
+    int n_block = std::min(compact_block_rows, n_rows - start);
+    block = dervs.middleRows(start, n_block).cast<double>();
+    product.middleCols(start, n_block).noalias() = envs * block.transpose();
+  }
+  return product;
+}
+
+Eigen::MatrixXd
+DescriptorValues ::force_dot_product(int s,
+                                     const Eigen::MatrixXf &envs) const {
+  if (compact) {
+    Eigen::MatrixXf product = envs * compact_force_dervs[s].transpose();
+    return product.cast<double>();
+  }
+
+  const Eigen::MatrixXd &dervs = descriptor_force_dervs[s];
+  int n_rows = dervs.rows();
+  Eigen::MatrixXd product(envs.rows(), n_rows);
+  Eigen::MatrixXf block;
+  for (int start = 0; start < n_rows; start += compact_block_rows) {
+    int n_block = std::min(compact_block_rows, n_rows - start);
+    block = dervs.middleRows(start, n_block).cast<float>();
+    product.middleCols(start, n_block) =
+        (envs * block.transpose()).cast<double>();
+  }
+  return product;
+}
+
+const Eigen::MatrixXd &
+DescriptorValues ::force_dervs(int s, Eigen::MatrixXd &buffer) const {
+  if (!compact)
+    return descriptor_force_dervs[s];
+
+  buffer = compact_force_dervs[s].cast<double>();
+  return buffer;
+}
+
+void to_json(nlohmann::json &j, const DescriptorValues &p) {
+  j = nlohmann::json{{"n_descriptors", p.n_descriptors},
+                     {"n_types", p.n_types},
+                     {"n_atoms", p.n_atoms},
+                     {"volume", p.volume},
+                     {"descriptors", p.descriptors},
+                     {"descriptor_force_dervs", p.descriptor_force_dervs},
+                     {"neighbor_coordinates", p.neighbor_coordinates},
+                     {"descriptor_norms", p.descriptor_norms},
+                     {"descriptor_force_dots", p.descriptor_force_dots},
+                     {"cutoff_values", p.cutoff_values},
+                     {"cutoff_dervs", p.cutoff_dervs},
+                     {"neighbor_counts", p.neighbor_counts},
+                     {"cumulative_neighbor_counts",
+                      p.cumulative_neighbor_counts},
+                     {"atom_indices", p.atom_indices},
+                     {"neighbor_indices", p.neighbor_indices},
+                     {"n_clusters", p.n_clusters},
+                     {"n_clusters_by_type", p.n_clusters_by_type},
+                     {"cumulative_type_count", p.cumulative_type_count},
+                     {"n_neighbors_by_type", p.n_neighbors_by_type}};
+
+  // Compact fields are only written when used, so that files without them
+  // stay readable by older versions.
+  if (p.compact) {
+    j["compact"] = p.compact;
+    j["compact_force_dervs"] = p.compact_force_dervs;
+  }
+}
+
+void from_json(const nlohmann::json &j, DescriptorValues &p) {
+  j.at("n_descriptors").get_to(p.n_descriptors);
+  j.at("n_types").get_to(p.n_types);
+  j.at("n_atoms").get_to(p.n_atoms);
+  j.at("volume").get_to(p.volume);
+  j.at("descriptors").get_to(p.descriptors);
+  j.at("descriptor_force_dervs").get_to(p.descriptor_force_dervs);
+  j.at("neighbor_coordinates").get_to(p.neighbor_coordinates);
+  j.at("descriptor_norms").get_to(p.descriptor_norms);
+  j.at("descriptor_force_dots").get_to(p.descriptor_force_dots);
+  j.at("cutoff_values").get_to(p.cutoff_values);
+  j.at("cutoff_dervs").get_to(p.cutoff_dervs);
+  j.at("neighbor_counts").get_to(p.neighbor_counts);
+  j.at("cumulative_neighbor_counts").get_to(p.cumulative_neighbor_counts);
+  j.at("atom_indices").get_to(p.atom_indices);
+  j.at("neighbor_indices").get_to(p.neighbor_indices);
+  j.at("n_clusters").get_to(p.n_clusters);
+  j.at("n_clusters_by_type").get_to(p.n_clusters_by_type);
+  j.at("cumulative_type_count").get_to(p.cumulative_type_count);
+  j.at("n_neighbors_by_type").get_to(p.n_neighbors_by_type);
+
+  p.compact = j.value("compact", false);
+  if (p.compact)
+    j.at("compact_force_dervs").get_to(p.compact_force_dervs);
+  else
+    p.compact_force_dervs.clear();
+}
+
 ClusterDescriptor::ClusterDescriptor() {}
 
 ClusterDescriptor::ClusterDescriptor(const DescriptorValues &structure) {
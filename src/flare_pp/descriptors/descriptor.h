@@ -47,15 +47,40 @@ public:
   std::vector<int> n_clusters_by_type, cumulative_type_count,
       n_neighbors_by_type;
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(DescriptorValues,
-    n_descriptors, n_types, n_atoms, volume, descriptors,
-    descriptor_force_dervs, neighbor_coordinates, descriptor_norms,
-    descriptor_force_dots, cutoff_values, cutoff_dervs, neighbor_counts,
-    cumulative_neighbor_counts, atom_indices, neighbor_indices,
-    n_clusters, n_clusters_by_type, cumulative_type_count,
-    n_neighbors_by_type)
+  // Single precision force derivatives, which replace descriptor_force_dervs
+  // after compress_force_dervs is called.
+  bool compact = false;
+  std::vector<Eigen::MatrixXf> compact_force_dervs;
+
+  /**
+   * Store the force derivatives in single precision and release the double
+   * precision matrices, halving the memory footprint of the structure.
+   */
+  void compress_force_dervs();
+
+  /**
+   * Return the product envs * descriptor_force_dervs[s]^T. If the force
+   * derivatives are compact, they are converted back to double precision a
+   * block of rows at a time, so the full matrix is never expanded.
+   */
+  Eigen::MatrixXd force_dot_product(int s, const Eigen::MatrixXd &envs) const;
+
+  /**
+   * As above, computed in single precision. Compact derivatives are used
+   * directly, and others are converted a block of rows at a time.
+   */
+  Eigen::MatrixXd force_dot_product(int s, const Eigen::MatrixXf &envs) const;
+
+  /**
+   * Return the double precision force derivatives of type s. Compact
+   * derivatives are expanded into buffer, which is returned in that case.
+   */
+  const Eigen::MatrixXd &force_dervs(int s, Eigen::MatrixXd &buffer) const;
 };
 
+void to_json(nlohmann::json &j, const DescriptorValues &p);
+void from_json(const nlohmann::json &j, DescriptorValues &p);
+
 // ClusterDescriptor holds the descriptor values for a collection of clusters
 // (excluding partial force derivatives).
 class ClusterDescriptor {
@@ -12,7 +12,7 @@ public:
   int n_species;
 
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_function;
   std::string cutoff_name;
   std::vector<double> cutoff_hyps;
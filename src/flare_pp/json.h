@@ -2,22 +2,35 @@
 #define JSON_H
 
 #include <nlohmann/json.hpp>
+#include "binary_file.h"
+#include "json_stream.h"
 
 // Cf. the Simox library on Gitlab.
 // TODO: Use templating to reduce redundancy.
+// Matrices are written as blobs while a BinaryWriter is active, and blob
+// references are read from the active BinaryReader (see binary_file.h).
+// Streamed files use the text and packed arrays of json_stream.h.
 namespace nlohmann {
   template <> struct adl_serializer<Eigen::VectorXi> {
     static void to_json(json &j, const Eigen::VectorXi &vector) {
+      if (write_matrix_blob(j, vector))
+        return;
+      if (write_matrix_text(j, vector))
+        return;
       for (int row = 0; row < vector.size(); row++) {
         j.push_back(vector(row));
       }
     }
 
     static void from_json(const json &j, Eigen::VectorXi &vector) {
+      if (read_matrix_blob(j, vector))
+        return;
+      if (read_packed_array(j, vector))
+        return;
       int n_rows = j.size();
       vector = Eigen::VectorXi::Zero(n_rows);
 
-      for (int row = 0; row < j.size(); row++) {
+      for (int row = 0; row < n_rows; row++) {
         const auto &value = j.at(row);
         vector(row) = value.get<int>();
       }
@@ -26,16 +39,24 @@ namespace nlohmann {
 
   template <> struct adl_serializer<Eigen::VectorXd> {
     static void to_json(json &j, const Eigen::VectorXd &vector) {
+      if (write_matrix_blob(j, vector))
+        return;
+      if (write_matrix_text(j, vector))
+        return;
       for (int row = 0; row < vector.size(); row++) {
         j.push_back(vector(row));
       }
     }
 
     static void from_json(const json &j, Eigen::VectorXd &vector) {
+      if (read_matrix_blob(j, vector))
+        return;
+      if (read_packed_array(j, vector))
+        return;
       int n_rows = j.size();
       vector = Eigen::VectorXd::Zero(n_rows);
 
-      for (int row = 0; row < j.size(); row++) {
+      for (int row = 0; row < n_rows; row++) {
         const auto &value = j.at(row);
         vector(row) = value.get<double>();
       }
@@ -44,6 +65,10 @@ namespace nlohmann {
 
   template <> struct adl_serializer<Eigen::MatrixXd> {
     static void to_json(json &j, const Eigen::MatrixXd &matrix) {
+      if (write_matrix_blob(j, matrix))
+        return;
+      if (write_matrix_text(j, matrix))
+        return;
       for (int row = 0; row < matrix.rows(); row++) {
         nlohmann::json column = nlohmann::json::array();
 
@@ -56,23 +81,107 @@ namespace nlohmann {
     }
 
     static void from_json(const json &j, Eigen::MatrixXd &matrix) {
+      if (read_matrix_blob(j, matrix))
+        return;
       int n_rows = j.size();
       int n_cols;
       if (n_rows > 0)
-        n_cols = j.at(0).size();
+        n_cols = json_array_size(j.at(0));
       else
         n_cols = 0;
       matrix = Eigen::MatrixXd::Zero(n_rows, n_cols);
 
-      for (int row = 0; row < j.size(); row++) {
+      for (int row = 0; row < n_rows; row++) {
         const auto &jrow = j.at(row);
-        for (int col = 0; col < jrow.size(); col++) {
+        if (read_packed_row(jrow, matrix, row))
+          continue;
+        for (std::size_t col = 0; col < jrow.size(); col++) {
           const auto &value = jrow.at(col);
           matrix(row, col) = value.get<double>();
         }
       }
     }
   };
+
+  template <> struct adl_serializer<Eigen::MatrixXi> {
+    static void to_json(json &j, const Eigen::MatrixXi &matrix) {
+      if (write_matrix_blob(j, matrix))
+        return;
+      if (write_matrix_text(j, matrix))
+        return;
+      for (int row = 0; row < matrix.rows(); row++) {
+        nlohmann::json column = nlohmann::json::array();
+
+        for (int col = 0; col < matrix.cols(); col++) {
+          column.push_back(matrix(row, col));
+        }
+
+        j.push_back(column);
+      }
+    }
+
+    static void from_json(const json &j, Eigen::MatrixXi &matrix) {
+      if (read_matrix_blob(j, matrix))
+        return;
+      int n_rows = j.size();
+      int n_cols;
+      if (n_rows > 0)
+        n_cols = json_array_size(j.at(0));
+      else
+        n_cols = 0;
+      matrix = Eigen::MatrixXi::Zero(n_rows, n_cols);
+
+      for (int row = 0; row < n_rows; row++) {
+        const auto &jrow = j.at(row);
+        if (read_packed_row(jrow, matrix, row))
+          continue;
+        for (std::size_t col = 0; col < jrow.size(); col++) {
+          const auto &value = jrow.at(col);
+          matrix(row, col) = value.get<int>();
+        }
+      }
+    }
+  };
+
+  template <> struct adl_serializer<Eigen::MatrixXf> {
+    static void to_json(json &j, const Eigen::MatrixXf &matrix) {
+      if (write_matrix_blob(j, matrix))
+        return;
+      if (write_matrix_text(j, matrix))
+        return;
+      for (int row = 0; row < matrix.rows(); row++) {
+        nlohmann::json column = nlohmann::json::array();
+
+        for (int col = 0; col < matrix.cols(); col++) {
+          column.push_back(matrix(row, col));
+        }
+
+        j.push_back(column);
+      }
+    }
+
+    static void from_json(const json &j, Eigen::MatrixXf &matrix) {
+      if (read_matrix_blob(j, matrix))
+        return;
+      int n_rows = j.size();
+      int n_cols;
+      if (n_rows > 0)
+        n_cols = json_array_size(j.at(0));
+      else
+        n_cols = 0;
+      matrix = Eigen::MatrixXf::Zero(n_rows, n_cols);
+
+      for (int row = 0; row < n_rows; row++) {
+        const auto &jrow = j.at(row);
+        if (read_packed_row(jrow, matrix, row))
+          continue;
+        for (std::size_t col = 0; col < jrow.size(); col++) {
+          const auto &value = jrow.at(col);
+          matrix(row, col) = value.get<float>();
+        }
+      }
+    }
+  };
 }
 
 #endif
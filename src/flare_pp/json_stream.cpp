@@ -0,0 +1,345 @@
+#include "json_stream.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+thread_local JsonStreamWriter *JsonStreamWriter::active = nullptr;
+thread_local JsonStreamReader *JsonStreamReader::active = nullptr;
+
+JsonStreamWriter ::JsonStreamWriter() {
+  spill = std::tmpfile();
+  if (spill == nullptr)
+    throw std::runtime_error("Could not open a temporary file.");
+  previous = active;
+  active = this;
+}
+
+JsonStreamWriter ::~JsonStreamWriter() {
+  active = previous;
+  std::fclose(spill);
+}
+
+void JsonStreamWriter ::append(const std::string &text) {
+  std::fwrite(text.data(), 1, text.size(), spill);
+  offset += text.size();
+}
+
+nlohmann::json JsonStreamWriter ::reference(long start) const {
+  return nlohmann::json{{"json_text", start}, {"size", offset - start}};
+}
+
+long JsonStreamWriter ::position() const { return offset; }
+
+void JsonStreamWriter ::finish(const nlohmann::json &document,
+                               std::ostream &out) {
+  std::fflush(spill);
+  write_value(document, out);
+  if (!out)
+    throw std::runtime_error("Could not write the JSON file.");
+}
+
+void JsonStreamWriter ::write_value(const nlohmann::json &j,
+                                    std::ostream &out) {
+  if (is_text_ref(j)) {
+    long start = j.at("json_text").get<long>();
+    long size = j.at("size").get<long>();
+    std::fseek(spill, start, SEEK_SET);
+    std::vector<char> buffer(std::min(size, 1L << 20));
+    while (size > 0) {
+      long n_read = std::fread(buffer.data(), 1,
+                               std::min(size, long(buffer.size())), spill);
+      if (n_read == 0)
+        throw std::runtime_error("Could not read the temporary file.");
+      out.write(buffer.data(), n_read);
+      size -= n_read;
+    }
+  } else if (j.is_object()) {
+    // Keys are written in the order of the tree, as in dump.
+    out << '{';
+    for (auto it = j.begin(); it != j.end(); ++it) {
+      if (it != j.begin())
+        out << ',';
+      out << nlohmann::json(it.key()).dump() << ':';
+      write_value(it.value(), out);
+    }
+    out << '}';
+  } else if (j.is_array()) {
+    out << '[';
+    for (std::size_t i = 0; i < j.size(); i++) {
+      if (i > 0)
+        out << ',';
+      write_value(j[i], out);
+    }
+    out << ']';
+  } else {
+    out << j.dump();
+  }
+}
+
+// Reads a stream in blocks and keeps the position in the file of the
+// current character, so that the positions of the arrays are known while
+// the file is parsed.
+class CountingReader {
+public:
+  explicit CountingReader(std::istream &in)
+      : in(in), block(1 << 16), start(in.tellg()) {
+    refill();
+  }
+
+  std::streamoff position() const { return start + index; }
+  bool at_end() const { return index == size; }
+  char current() const { return block[index]; }
+
+  void next() {
+    if (++index == size)
+      refill();
+  }
+
+private:
+  std::istream &in;
+  std::vector<char> block;
+  std::streamoff start;
+  std::size_t index = 0, size = 0;
+
+  void refill() {
+    start += size;
+    in.read(block.data(), block.size());
+    size = in.gcount();
+    index = 0;
+  }
+};
+
+// Input iterator over a CountingReader, for nlohmann's parser. Iterators
+// compare equal when both are at the end of the file.
+class CountingIterator {
+public:
+  typedef std::input_iterator_tag iterator_category;
+  typedef char value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef const char *pointer;
+  typedef char reference;
+
+  CountingIterator() {}
+  explicit CountingIterator(CountingReader &reader) : reader(&reader) {}
+
+  char operator*() const { return reader->current(); }
+  CountingIterator &operator++() {
+    reader->next();
+    return *this;
+  }
+  bool operator==(const CountingIterator &other) const {
+    return at_end() == other.at_end();
+  }
+  bool operator!=(const CountingIterator &other) const {
+    return !(*this == other);
+  }
+
+private:
+  CountingReader *reader = nullptr;
+
+  bool at_end() const { return reader == nullptr || reader->at_end(); }
+};
+
+// SAX handler that builds the document with nlohmann's DOM parser, except
+// for long arrays of numbers, which are buffered while they are read and
+// replaced by a reference to their position in the file if they contain a
+// floating point number. Integer arrays are kept in the tree, since they may
+// be read into std::vectors.
+class PackingHandler {
+public:
+  typedef nlohmann::json json;
+
+  PackingHandler(json &document, std::vector<std::streamoff> &array_starts,
+                 std::vector<std::streamoff> &array_ends,
+                 const CountingReader &reader)
+      : dom(document), array_starts(array_starts), array_ends(array_ends),
+        reader(reader) {}
+
+  bool null() { return flush() && dom.null(); }
+  bool boolean(bool val) { return flush() && dom.boolean(val); }
+
+  bool number_integer(json::number_integer_t val) {
+    if (pending && std::abs(double(val)) < max_exact) {
+      values.push_back(val);
+      kinds.push_back(integer_kind);
+      return true;
+    }
+    return flush() && dom.number_integer(val);
+  }
+
+  bool number_unsigned(json::number_unsigned_t val) {
+    if (pending && double(val) < max_exact) {
+      values.push_back(val);
+      kinds.push_back(unsigned_kind);
+      return true;
+    }
+    return flush() && dom.number_unsigned(val);
+  }
+
+  bool number_float(json::number_float_t val, const json::string_t &s) {
+    if (pending) {
+      values.push_back(val);
+      kinds.push_back(float_kind);
+      has_float = true;
+      return true;
+    }
+    return dom.number_float(val, s);
+  }
+
+  bool string(json::string_t &val) { return flush() && dom.string(val); }
+  bool binary(json::binary_t &val) { return flush() && dom.binary(val); }
+
+  bool start_object(std::size_t elements) {
+    return flush() && dom.start_object(elements);
+  }
+  bool key(json::string_t &val) { return dom.key(val); }
+  bool end_object() { return dom.end_object(); }
+
+  bool start_array(std::size_t /*elements*/) {
+    flush();
+    pending = true;
+    has_float = false;
+
+    // The opening bracket is the last character read.
+    array_start = reader.position() - 1;
+    return true;
+  }
+
+  bool end_array() {
+    if (!pending)
+      return dom.end_array();
+
+    if (has_float && values.size() >= JsonStreamReader::min_packed_size) {
+      pending = false;
+      json::string_t packed = "packed", size = "size";
+      dom.start_object(2);
+      dom.key(packed);
+      dom.number_unsigned(array_starts.size());
+      dom.key(size);
+      dom.number_unsigned(values.size());
+      dom.end_object();
+      array_starts.push_back(array_start);
+      array_ends.push_back(reader.position());
+      values.clear();
+      kinds.clear();
+      return true;
+    }
+
+    flush();
+    return dom.end_array();
+  }
+
+  bool parse_error(std::size_t position, const std::string &last_token,
+                   const nlohmann::detail::exception &ex) {
+    return dom.parse_error(position, last_token, ex);
+  }
+
+private:
+  enum { integer_kind, unsigned_kind, float_kind };
+
+  // Integers are buffered as doubles, which represent them exactly below
+  // 2^53.
+  const double max_exact = 9007199254740992.;
+
+  nlohmann::detail::json_sax_dom_parser<json> dom;
+  std::vector<std::streamoff> &array_starts, &array_ends;
+
+  // Reader of the file, and position of the innermost open array.
+  const CountingReader &reader;
+  std::streamoff array_start = 0;
+
+  // True while the innermost open array only holds numbers, which are
+  // buffered in values rather than passed to the DOM parser.
+  bool pending = false, has_float = false;
+  std::vector<double> values;
+  std::vector<char> kinds;
+
+  // Pass the buffered array on to the DOM parser.
+  bool flush() {
+    if (!pending)
+      return true;
+    pending = false;
+    dom.start_array(std::size_t(-1));
+    for (std::size_t i = 0; i < values.size(); i++) {
+      if (kinds[i] == integer_kind)
+        dom.number_integer(json::number_integer_t(values[i]));
+      else if (kinds[i] == unsigned_kind)
+        dom.number_unsigned(json::number_unsigned_t(values[i]));
+      else
+        dom.number_float(values[i], "");
+    }
+    values.clear();
+    kinds.clear();
+    return true;
+  }
+};
+
+JsonStreamReader ::JsonStreamReader(std::istream &in) : in(in) {
+  if (!in)
+    throw std::runtime_error("Could not open the JSON file.");
+  CountingReader reader(in);
+  PackingHandler handler(document, array_starts, array_ends, reader);
+  nlohmann::json::sax_parse(CountingIterator(reader), CountingIterator(),
+                            &handler);
+  taken = std::vector<bool>(array_starts.size(), false);
+
+  previous = active;
+  active = this;
+}
+
+JsonStreamReader ::~JsonStreamReader() { active = previous; }
+
+void JsonStreamReader ::start_array(const nlohmann::json &ref) {
+  std::size_t index = ref.at("packed").get<std::size_t>();
+  if (index >= array_starts.size() || taken[index])
+    throw std::runtime_error("Invalid packed array in JSON stream.");
+  taken[index] = true;
+
+  // Skip the opening and closing brackets.
+  std::streamoff start = array_starts[index] + 1;
+  remaining = array_ends[index] - start - 1;
+  in.clear();
+  in.seekg(start);
+  block.resize(1 << 16);
+  block_start = block_end = 0;
+  refill();
+}
+
+double JsonStreamReader ::next_value(bool last) {
+  // Numbers are much shorter than the margin, so a full number is in the
+  // block unless the end of the array has been reached.
+  const std::size_t margin = 64;
+  if (block_end - block_start < margin && remaining > 0)
+    refill();
+
+  // The text was checked when the file was parsed. Floating point numbers
+  // are read with strtod, as in nlohmann::json, and integers in packed
+  // arrays are below 2^53, so the values match those of a full parse.
+  const char *next = block.data() + block_start;
+  char *end;
+  double value = std::strtod(next, &end);
+  while (std::isspace(*end))
+    end++;
+  if (end == next || *end != (last ? '\0' : ','))
+    throw std::runtime_error("Invalid packed array in JSON stream.");
+  block_start = end + 1 - block.data();
+  return value;
+}
+
+void JsonStreamReader ::refill() {
+  // Move the unread text to the front of the block and read more.
+  std::size_t n_left = block_end - block_start;
+  std::memmove(block.data(), block.data() + block_start, n_left);
+  std::size_t n_read =
+      std::min<std::streamoff>(block.size() - n_left - 1, remaining);
+  in.read(block.data() + n_left, n_read);
+  if (!in)
+    throw std::runtime_error("Could not read the JSON file.");
+  remaining -= n_read;
+  block_start = 0;
+  block_end = n_left + n_read;
+  block[block_end] = '\0';
+}
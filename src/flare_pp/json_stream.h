@@ -0,0 +1,221 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <Eigen/Dense>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+/**
+ * Streaming reads and writes of JSON files, in the same format as
+ * nlohmann::json, without holding the entries of the Eigen matrices in a
+ * JSON tree.
+ *
+ * While a JsonStreamWriter is active, the Eigen serializers in json.h write
+ * the text of each matrix to a temporary file and leave a reference in the
+ * document. The document is then written out with the text of the matrices
+ * copied in place, which gives the same file as dumping the full tree.
+ *
+ * JsonStreamReader parses a file with a SAX handler that records the
+ * position in the file of each array of floating point numbers with at
+ * least min_packed_size entries, and leaves a reference in the document.
+ * The Eigen deserializers parse the numbers of the array from the file
+ * straight into the matrix, so that neither a full JSON tree nor a copy of
+ * the entries is held in memory.
+ */
+
+class JsonStreamWriter {
+public:
+  /** Open the temporary file and make this the active writer. */
+  JsonStreamWriter();
+  ~JsonStreamWriter();
+
+  /** Append text to the temporary file. */
+  void append(const std::string &text);
+
+  /** Reference to the text appended since position start. */
+  nlohmann::json reference(long start) const;
+
+  long position() const;
+
+  /** Write the document to out, replacing references by their text. */
+  void finish(const nlohmann::json &document, std::ostream &out);
+
+  // Writer used by the JSON serializers of the current thread, if any.
+  static thread_local JsonStreamWriter *active;
+
+private:
+  std::FILE *spill;
+  long offset = 0;
+  JsonStreamWriter *previous;
+
+  void write_value(const nlohmann::json &j, std::ostream &out);
+};
+
+class JsonStreamReader {
+public:
+  /**
+   * Parse a JSON file and make this the active reader. The stream must stay
+   * open while the document is read, since the packed arrays are read from
+   * it.
+   */
+  explicit JsonStreamReader(std::istream &in);
+  ~JsonStreamReader();
+
+  // Parsed document, with references to the packed arrays.
+  nlohmann::json document;
+
+  /**
+   * Parse a packed array into values, e.g. a vector or a row of a matrix,
+   * which must have the size of the array. Each array can be read once.
+   */
+  template <typename Values>
+  void read_array(const nlohmann::json &ref, Values &values);
+
+  static const int min_packed_size = 8;
+
+  // Reader used by the JSON deserializers of the current thread, if any.
+  static thread_local JsonStreamReader *active;
+
+private:
+  std::istream &in;
+
+  // Positions of the opening bracket and the end of each packed array in
+  // the file.
+  std::vector<std::streamoff> array_starts, array_ends;
+  std::vector<bool> taken;
+  JsonStreamReader *previous;
+
+  // Block of the text of the array being read, null terminated, and the
+  // number of characters of the array that are left in the file.
+  std::vector<char> block;
+  std::size_t block_start = 0, block_end = 0;
+  std::streamoff remaining = 0;
+
+  /** Move to the first number of a packed array. */
+  void start_array(const nlohmann::json &ref);
+
+  /** Parse the next number of the array being read. */
+  double next_value(bool last);
+
+  void refill();
+};
+
+template <typename Values>
+void JsonStreamReader ::read_array(const nlohmann::json &ref,
+                                   Values &values) {
+  start_array(ref);
+  typedef typename Values::Scalar Scalar;
+  for (Eigen::Index i = 0; i < values.size(); i++)
+    values(i) = Scalar(next_value(i == values.size() - 1));
+}
+
+inline bool is_text_ref(const nlohmann::json &j) {
+  return j.is_object() && j.find("json_text") != j.end();
+}
+
+inline bool is_packed_array(const nlohmann::json &j) {
+  return j.is_object() && j.find("packed") != j.end();
+}
+
+/** Size of an array that may be packed. */
+inline int json_array_size(const nlohmann::json &j) {
+  if (is_packed_array(j))
+    return j.at("size").get<int>();
+  return j.size();
+}
+
+/**
+ * Called by the JSON serializers of Eigen types. If a writer is active, the
+ * text of the matrix is written to it and true is returned. Vectors are
+ * written as arrays of numbers and matrices as arrays of rows, and empty
+ * ones as null, as in json.h.
+ */
+template <typename Matrix>
+bool write_matrix_text(nlohmann::json &j, const Matrix &matrix) {
+  if (JsonStreamWriter::active == nullptr)
+    return false;
+
+  // The text is appended a row at a time, so that only one row is held in
+  // memory.
+  JsonStreamWriter &writer = *JsonStreamWriter::active;
+  long start = writer.position();
+  bool is_vector = Matrix::ColsAtCompileTime == 1;
+  std::string text;
+  if (matrix.rows() == 0) {
+    writer.append("null");
+  } else if (is_vector) {
+    text = "[";
+    for (int i = 0; i < matrix.rows(); i++) {
+      if (i > 0)
+        text += ",";
+      text += nlohmann::json(matrix(i)).dump();
+    }
+    writer.append(text + "]");
+  } else {
+    for (int row = 0; row < matrix.rows(); row++) {
+      text = row > 0 ? ",[" : "[[";
+      for (int col = 0; col < matrix.cols(); col++) {
+        if (col > 0)
+          text += ",";
+        text += nlohmann::json(matrix(row, col)).dump();
+      }
+      writer.append(text + "]");
+    }
+    writer.append("]");
+  }
+  j = writer.reference(start);
+  return true;
+}
+
+/**
+ * Called by the JSON deserializers of Eigen vectors. If j is a packed
+ * array, its entries are read into the vector and true is returned.
+ */
+template <typename Vector>
+bool read_packed_array(const nlohmann::json &j, Vector &vector) {
+  if (!is_packed_array(j))
+    return false;
+  if (JsonStreamReader::active == nullptr)
+    throw std::runtime_error("Packed array outside of a JSON stream.");
+
+  vector.resize(json_array_size(j));
+  JsonStreamReader::active->read_array(j, vector);
+  return true;
+}
+
+/** As read_packed_array, for a row of a matrix. */
+template <typename Matrix>
+bool read_packed_row(const nlohmann::json &j, Matrix &matrix, int row) {
+  if (!is_packed_array(j))
+    return false;
+  if (JsonStreamReader::active == nullptr)
+    throw std::runtime_error("Packed array outside of a JSON stream.");
+  if (json_array_size(j) != matrix.cols())
+    throw std::runtime_error("Rows of a JSON matrix differ in size.");
+
+  typename Matrix::RowXpr matrix_row = matrix.row(row);
+  JsonStreamReader::active->read_array(j, matrix_row);
+  return true;
+}
+
+/** Write an object to a JSON file without building its full JSON tree. */
+template <typename T>
+void write_json_stream(const std::string &file_name, const T &object) {
+  std::ofstream file(file_name);
+  JsonStreamWriter writer;
+  nlohmann::json j = object;
+  writer.finish(j, file);
+}
+
+/** Read an object from a JSON file without building its full JSON tree. */
+template <typename T> T read_json_stream(const std::string &file_name) {
+  std::ifstream file(file_name);
+  JsonStreamReader reader(file);
+  return reader.document.get<T>();
+}
+
+#endif
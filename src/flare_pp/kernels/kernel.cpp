@@ -1,19 +1,95 @@
 #include "kernel.h"
 #include "cutoffs.h"
+#include <atomic>
 #include <cmath>
 #include <iostream>
 #include "normalized_dot_product.h"
 #include "norm_dot_icm.h"
 #include "squared_exponential.h"
 
+KernelCacheKey ::KernelCacheKey() {}
+
+KernelCacheKey ::KernelCacheKey(long long generation, bool single_precision)
+    : generation(generation), single_precision(single_precision) {}
+
+bool KernelCacheKey ::valid() const { return generation >= 0; }
+
+bool KernelCacheKey ::operator==(const KernelCacheKey &other) const {
+  return generation == other.generation &&
+         single_precision == other.single_precision;
+}
+
+long long new_cache_generation() {
+  static std::atomic<long long> next_generation(0);
+  return next_generation++;
+}
+
+DotOperand ::DotOperand(const Eigen::MatrixXd &values,
+                        bool single_precision) {
+  if (!single_precision) {
+    this->values = &values;
+    return;
+  }
+  single_buffer = values.cast<float>();
+  single_values = &single_buffer;
+}
+
+DotOperand ::DotOperand(const DescriptorValues &struc, int s,
+                        bool single_precision) {
+  if (!single_precision) {
+    values = &struc.force_dervs(s, buffer);
+    return;
+  }
+  if (struc.compact) {
+    single_values = &struc.compact_force_dervs[s];
+    return;
+  }
+  single_buffer = struc.descriptor_force_dervs[s].cast<float>();
+  single_values = &single_buffer;
+}
+
 Kernel ::Kernel(){};
 Kernel ::Kernel(Eigen::VectorXd kernel_hyperparameters) {
   this->kernel_hyperparameters = kernel_hyperparameters;
 };
 
-std::vector<Eigen::MatrixXd> Kernel ::Kuu_grad(const ClusterDescriptor &envs,
-                                               const Eigen::MatrixXd &Kuu,
-                                               const Eigen::VectorXd &hyps) {
+Eigen::VectorXd Kernel ::envs_envs_diagonal(const ClusterDescriptor &envs,
+                                            const Eigen::VectorXd &hyps) {
+  return envs_envs(envs, envs, hyps).diagonal();
+}
+
+Eigen::MatrixXd Kernel ::descriptor_dot(const Eigen::MatrixXd &d1,
+                                        const Eigen::MatrixXd &d2) const {
+  if (!single_precision)
+    return d1 * d2.transpose();
+
+  Eigen::MatrixXf d1_single = d1.cast<float>();
+  Eigen::MatrixXf d2_single = d2.cast<float>();
+  Eigen::MatrixXf product = d1_single * d2_single.transpose();
+  return product.cast<double>();
+}
+
+Eigen::MatrixXd Kernel ::descriptor_dot(const DotOperand &d1,
+                                        const DotOperand &d2) const {
+  if (!single_precision)
+    return *d1.values * d2.values->transpose();
+
+  Eigen::MatrixXf product = *d1.single_values * d2.single_values->transpose();
+  return product.cast<double>();
+}
+
+Eigen::MatrixXd Kernel ::force_dot_product(const DescriptorValues &struc,
+                                           int s,
+                                           const DotOperand &envs) const {
+  if (!single_precision)
+    return struc.force_dot_product(s, *envs.values);
+  return struc.force_dot_product(s, *envs.single_values);
+}
+
+std::vector<Eigen::MatrixXd>
+Kernel ::Kuu_grad(const ClusterDescriptor &envs,
+                  const Eigen::MatrixXd & /*Kuu*/, const Eigen::VectorXd &hyps,
+                  long long /*cache_generation*/) {
 
   std::vector<Eigen::MatrixXd> Kuu_grad = envs_envs_grad(envs, envs, hyps);
 
@@ -22,8 +98,10 @@ std::vector<Eigen::MatrixXd> Kernel ::Kuu_grad(const ClusterDescriptor &envs,
 
 std::vector<Eigen::MatrixXd>
 Kernel ::Kuf_grad(const ClusterDescriptor &envs,
-                  const std::vector<Structure> &strucs, int kernel_index,
-                  const Eigen::MatrixXd &Kuf, const Eigen::VectorXd &hyps) {
+                  const std::vector<const Structure *> &strucs,
+                  int kernel_index,
+                  const ChunkedMatrix & /*Kuf*/, const Eigen::VectorXd &hyps,
+                  long long /*cache_generation*/) {
 
   int n_sparse = envs.n_clusters;
   int n_hyps = hyps.size();
@@ -34,16 +112,16 @@ Kernel ::Kuf_grad(const ClusterDescriptor &envs,
   int n_labels = 0;
   for (int i = 0; i < n_strucs; i++) {
     int current_count = 0;
-    if (strucs[i].energy.size() != 0) {
+    if (strucs[i]->energy.size() != 0) {
       current_count += 1;
     }
 
-    if (strucs[i].forces.size() != 0) {
-      current_count += strucs[i].forces.size();
+    if (strucs[i]->forces.size() != 0) {
+      current_count += strucs[i]->forces.size();
     }
 
-    if (strucs[i].stresses.size() != 0) {
-      current_count += strucs[i].stresses.size();
+    if (strucs[i]->stresses.size() != 0) {
+      current_count += strucs[i]->stresses.size();
     }
 
     label_count(i + 1) = label_count(i) + current_count;
@@ -57,28 +135,30 @@ Kernel ::Kuf_grad(const ClusterDescriptor &envs,
   }
 
 #pragma omp parallel for
-  for (int i = 0; i < strucs.size(); i++) {
+  for (int i = 0; i < n_strucs; i++) {
+    Structure buffer;
+    const Structure &struc = strucs[i]->materialize_descriptors(buffer);
     std::vector<Eigen::MatrixXd> envs_struc =
-        envs_struc_grad(envs, strucs[i].descriptors[kernel_index], hyps);
-    int n_atoms = strucs[i].noa;
+        envs_struc_grad(envs, struc.descriptors[kernel_index], hyps);
+    int n_atoms = strucs[i]->noa;
 
     for (int j = 0; j < n_hyps + 1; j++) {
       int current_count = 0;
 
-      if (strucs[i].energy.size() != 0) {
+      if (strucs[i]->energy.size() != 0) {
         Kuf_grad[j].block(0, label_count(i), n_sparse, 1) =
             envs_struc[j].block(0, 0, n_sparse, 1);
         current_count += 1;
       }
 
-      if (strucs[i].forces.size() != 0) {
+      if (strucs[i]->forces.size() != 0) {
         Kuf_grad[j].block(0, label_count(i) + current_count, n_sparse,
                           n_atoms * 3) =
             envs_struc[j].block(0, 1, n_sparse, n_atoms * 3);
         current_count += n_atoms * 3;
       }
 
-      if (strucs[i].stresses.size() != 0) {
+      if (strucs[i]->stresses.size() != 0) {
         Kuf_grad[j].block(0, label_count(i) + current_count, n_sparse, 6) =
             envs_struc[j].block(0, 1 + n_atoms * 3, n_sparse, 6);
       }
@@ -88,6 +168,8 @@ Kernel ::Kuf_grad(const ClusterDescriptor &envs,
   return Kuf_grad;
 }
 
+void Kernel ::clear_cache() {}
+
 void to_json(nlohmann::json& j, const std::vector<Kernel*> & kernels){
   int n_kernels = kernels.size();
   for (int i = 0; i < n_kernels; i++){
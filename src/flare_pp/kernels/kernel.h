@@ -1,6 +1,7 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include "chunked_matrix.h"
 #include "descriptor.h"
 #include "structure.h"
 #include <Eigen/Dense>
@@ -12,11 +13,66 @@ class DescriptorValues;
 class ClusterDescriptor;
 class SparseGP;
 
+/**
+ * Identifies the sparse environments and training structures that kernel
+ * quantities are cached for. SparseGP takes a new generation from
+ * new_cache_generation whenever its sparse or training sets change, so that
+ * the keys of different models, and of different states of one model, never
+ * compare equal. Generation -1 marks sets that must not be cached.
+ */
+class KernelCacheKey {
+public:
+  long long generation = -1;
+  bool single_precision = false;
+
+  KernelCacheKey();
+  KernelCacheKey(long long generation, bool single_precision);
+
+  bool valid() const;
+  bool operator==(const KernelCacheKey &other) const;
+};
+
+/** Return a generation that has not been returned before. */
+long long new_cache_generation();
+
+/**
+ * Operand of Kernel::descriptor_dot and Kernel::force_dot_product. In single
+ * precision mode the matrix is converted once, when the operand is created,
+ * so that it can enter several products without being converted again.
+ * Compact force derivatives are used without any conversion.
+ */
+class DotOperand {
+public:
+  DotOperand(const Eigen::MatrixXd &values, bool single_precision);
+  DotOperand(Eigen::MatrixXd &&values, bool single_precision) = delete;
+
+  /** Force derivatives of type s of a structure. */
+  DotOperand(const DescriptorValues &struc, int s, bool single_precision);
+
+  DotOperand(const DotOperand &) = delete;
+  DotOperand &operator=(const DotOperand &) = delete;
+
+  // Set in double and single precision mode, respectively.
+  const Eigen::MatrixXd *values = nullptr;
+  const Eigen::MatrixXf *single_values = nullptr;
+
+  Eigen::MatrixXd buffer;
+  Eigen::MatrixXf single_buffer;
+};
+
 class Kernel {
 public:
   Eigen::VectorXd kernel_hyperparameters;
   std::string kernel_name;
 
+  /**
+   * Evaluate the descriptor dot products in single precision. The products
+   * are converted back to double precision before they are normalized, so
+   * kernel values carry a relative error of order 1e-6. This is a runtime
+   * option and is not serialized.
+   */
+  bool single_precision = false;
+
   Kernel();
 
   Kernel(Eigen::VectorXd kernel_hyperparameters);
@@ -29,6 +85,14 @@ public:
   envs_envs_grad(const ClusterDescriptor &envs1, const ClusterDescriptor &envs2,
                  const Eigen::VectorXd &hyps) = 0;
 
+  /**
+   * Diagonal of envs_envs(envs, envs, hyps). The default implementation
+   * forms the full matrix; kernels can override it with a linear-cost
+   * version.
+   */
+  virtual Eigen::VectorXd envs_envs_diagonal(const ClusterDescriptor &envs,
+                                             const Eigen::VectorXd &hyps);
+
   virtual Eigen::MatrixXd envs_struc(const ClusterDescriptor &envs,
                                      const DescriptorValues &struc,
                                      const Eigen::VectorXd &hyps) = 0;
@@ -49,18 +113,53 @@ public:
   virtual Eigen::MatrixXd compute_varmap_coefficients(const SparseGP &gp_model,
                                                        int kernel_index) = 0;
 
-  std::vector<Eigen::MatrixXd> Kuu_grad(const ClusterDescriptor &envs,
-                                        const Eigen::MatrixXd &Kuu,
-                                        const Eigen::VectorXd &hyps);
+  /**
+   * Return Kuu and Kuf evaluated at the hyperparameters hyps, followed by
+   * their gradients with respect to each hyperparameter. Kuu and Kuf are the
+   * kernel matrices at the current hyperparameters. The default
+   * implementations recompute the kernels from the descriptors; kernels in
+   * which the hyperparameters enter as simple factors override them to
+   * rescale the current or cached matrices instead. cache_generation
+   * identifies the sets for kernels that cache quantities between calls
+   * (see KernelCacheKey), and is -1 for sets that are used once, such as
+   * mini-batches. The training structures are passed by address, so that
+   * subsets of the training set are not copied, and Kuf is passed in its
+   * chunks, so that it is not assembled in contiguous memory.
+   */
+  virtual std::vector<Eigen::MatrixXd> Kuu_grad(const ClusterDescriptor &envs,
+                                                const Eigen::MatrixXd &Kuu,
+                                                const Eigen::VectorXd &hyps,
+                                                long long cache_generation);
+
+  virtual std::vector<Eigen::MatrixXd>
+  Kuf_grad(const ClusterDescriptor &envs,
+           const std::vector<const Structure *> &strucs, int kernel_index,
+           const ChunkedMatrix &Kuf, const Eigen::VectorXd &hyps,
+           long long cache_generation);
 
-  std::vector<Eigen::MatrixXd> Kuf_grad(const ClusterDescriptor &envs,
-                                        const std::vector<Structure> &strucs,
-                                        int kernel_index,
-                                        const Eigen::MatrixXd &Kuf,
-                                        const Eigen::VectorXd &hyps);
+  /** Release quantities cached by Kuu_grad and Kuf_grad. */
+  virtual void clear_cache();
 
   virtual void set_hyperparameters(Eigen::VectorXd hyps) = 0;
 
+  /**
+   * Return d1 * d2^T, computed in single precision if single_precision is
+   * set.
+   */
+  Eigen::MatrixXd descriptor_dot(const Eigen::MatrixXd &d1,
+                                 const Eigen::MatrixXd &d2) const;
+
+  /**
+   * As above, for operands that are used in several products. The operands
+   * must have been created with this kernel's single_precision setting.
+   */
+  Eigen::MatrixXd descriptor_dot(const DotOperand &d1,
+                                 const DotOperand &d2) const;
+
+  /** Return envs * (force derivatives of type s of struc)^T. */
+  Eigen::MatrixXd force_dot_product(const DescriptorValues &struc, int s,
+                                    const DotOperand &envs) const;
+
   virtual ~Kernel() = default;
 
   virtual nlohmann::json return_json() = 0;
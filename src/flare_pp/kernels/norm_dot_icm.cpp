@@ -63,7 +63,7 @@ NormalizedDotProduct_ICM ::envs_envs(const ClusterDescriptor &envs1,
 
       // Compute dot products. (Should be done in parallel with MKL.)
       Eigen::MatrixXd dot_vals =
-          envs1.descriptors[s1] * envs2.descriptors[s2].transpose();
+          descriptor_dot(envs1.descriptors[s1], envs2.descriptors[s2]);
 
       // Compute kernels.
       int n_sparse_1 = envs1.n_clusters_by_type[s1];
@@ -181,10 +181,11 @@ NormalizedDotProduct_ICM ::envs_struc_grad(const ClusterDescriptor &envs,
       double icm_val = hyps(1 + icm_index);
 
       // Compute dot products. (Should be done in parallel with MKL.)
+      DotOperand envs_descriptors(envs.descriptors[s1], single_precision);
+      DotOperand struc_descriptors(struc.descriptors[s2], single_precision);
       Eigen::MatrixXd dot_vals =
-          envs.descriptors[s1] * struc.descriptors[s2].transpose();
-      Eigen::MatrixXd force_dot =
-          envs.descriptors[s1] * struc.descriptor_force_dervs[s2].transpose();
+          descriptor_dot(envs_descriptors, struc_descriptors);
+      Eigen::MatrixXd force_dot = force_dot_product(struc, s2, envs_descriptors);
 
       Eigen::VectorXd struc_force_dot = struc.descriptor_force_dots[s2];
 
@@ -313,10 +314,11 @@ NormalizedDotProduct_ICM ::envs_struc(const ClusterDescriptor &envs,
       double icm_val = hyps(1 + icm_index);
 
       // Compute dot products. (Should be done in parallel with MKL.)
+      DotOperand envs_descriptors(envs.descriptors[s1], single_precision);
+      DotOperand struc_descriptors(struc.descriptors[s2], single_precision);
       Eigen::MatrixXd dot_vals =
-          envs.descriptors[s1] * struc.descriptors[s2].transpose();
-      Eigen::MatrixXd force_dot =
-          envs.descriptors[s1] * struc.descriptor_force_dervs[s2].transpose();
+          descriptor_dot(envs_descriptors, struc_descriptors);
+      Eigen::MatrixXd force_dot = force_dot_product(struc, s2, envs_descriptors);
 
       Eigen::VectorXd struc_force_dot = struc.descriptor_force_dots[s2];
 
@@ -422,17 +424,20 @@ NormalizedDotProduct_ICM ::struc_struc(const DescriptorValues &struc1,
     for (int s2 = 0; s2 < n_types_1; s2++) {
       int icm_index = get_icm_index(s1, s2, n_types_1);
       double icm_val = hyps(1 + icm_index);
+      // Each operand enters two products, so it is converted once.
+      DotOperand descriptors_1(struc1.descriptors[s1], single_precision);
+      DotOperand descriptors_2(struc2.descriptors[s2], single_precision);
+      DotOperand force_dervs_1(struc1, s1, single_precision);
+      DotOperand force_dervs_2(struc2, s2, single_precision);
 
       // Compute dot products.
-      Eigen::MatrixXd dot_vals =
-          struc1.descriptors[s1] * struc2.descriptors[s2].transpose();
-      Eigen::MatrixXd force_dot_1 = struc1.descriptor_force_dervs[s1] *
-                                    struc2.descriptors[s2].transpose();
-      Eigen::MatrixXd force_dot_2 = struc2.descriptor_force_dervs[s2] *
-                                    struc1.descriptors[s1].transpose();
+      Eigen::MatrixXd dot_vals = descriptor_dot(descriptors_1, descriptors_2);
+      Eigen::MatrixXd force_dot_1 =
+          descriptor_dot(force_dervs_1, descriptors_2);
+      Eigen::MatrixXd force_dot_2 =
+          descriptor_dot(force_dervs_2, descriptors_1);
       Eigen::MatrixXd force_force =
-          struc1.descriptor_force_dervs[s1] *
-          struc2.descriptor_force_dervs[s2].transpose();
+          descriptor_dot(force_dervs_1, force_dervs_2);
 
       Eigen::VectorXd struc_force_dot_1 = struc1.descriptor_force_dots[s1];
       Eigen::VectorXd struc_force_dot_2 = struc2.descriptor_force_dots[s2];
@@ -465,7 +470,10 @@ NormalizedDotProduct_ICM ::struc_struc(const DescriptorValues &struc1,
 
           // Energy/energy kernel.
           double norm_dot = dot_vals(i, j) / norm_ij;
-          double c1 = (power - 1) * power * pow(norm_dot, power - 2);
+          // The second derivative vanishes for power 1, where pow would diverge
+          // for orthogonal descriptors.
+          double c1 =
+              (power != 1) ? (power - 1) * power * pow(norm_dot, power - 2) : 0;
           double c2 = power * pow(norm_dot, power - 1);
           kernel_matrix(0, 0) += sig_sq * icm_val * pow(norm_dot, power);
 
@@ -636,6 +644,92 @@ NormalizedDotProduct_ICM ::self_kernel_struc(const DescriptorValues &struc,
   return kernel_vector;
 }
 
+// Combine the basis kernels of the ICM coefficients into the kernel and its
+// gradients at the hyperparameters hyps.
+static std::vector<Eigen::MatrixXd>
+rescale_icm_basis(const std::vector<Eigen::MatrixXd> &basis,
+                  const Eigen::VectorXd &hyps) {
+
+  double sig = hyps(0);
+  Eigen::MatrixXd unit_kernel = Eigen::MatrixXd::Zero(basis[0].rows(),
+                                                      basis[0].cols());
+  for (size_t i = 0; i < basis.size(); i++) {
+    unit_kernel += hyps(1 + i) * basis[i];
+  }
+
+  std::vector<Eigen::MatrixXd> kernel_gradients;
+  kernel_gradients.push_back(sig * sig * unit_kernel);
+  kernel_gradients.push_back(2 * sig * unit_kernel);
+  for (size_t i = 0; i < basis.size(); i++) {
+    kernel_gradients.push_back(sig * sig * basis[i]);
+  }
+  return kernel_gradients;
+}
+
+std::vector<Eigen::MatrixXd>
+NormalizedDotProduct_ICM ::Kuu_grad(const ClusterDescriptor &envs,
+                                    const Eigen::MatrixXd & /*Kuu*/,
+                                    const Eigen::VectorXd &new_hyps,
+                                    long long cache_generation) {
+
+  KernelCacheKey key(cache_generation, single_precision);
+  if (key.valid() && key == Kuu_key)
+    return rescale_icm_basis(Kuu_basis, new_hyps);
+
+  // With unit signal variance, the ICM gradients are the basis kernels.
+  Eigen::VectorXd unit_hyps = new_hyps;
+  unit_hyps(0) = 1;
+  std::vector<Eigen::MatrixXd> grads = envs_envs_grad(envs, envs, unit_hyps);
+  std::vector<Eigen::MatrixXd> basis(grads.begin() + 2, grads.end());
+  grads.clear();
+  if (key.valid()) {
+    Kuu_basis = std::move(basis);
+    Kuu_key = key;
+    return rescale_icm_basis(Kuu_basis, new_hyps);
+  }
+
+  return rescale_icm_basis(basis, new_hyps);
+}
+
+std::vector<Eigen::MatrixXd>
+NormalizedDotProduct_ICM ::Kuf_grad(
+    const ClusterDescriptor &envs, const std::vector<const Structure *> &strucs,
+    int kernel_index, const ChunkedMatrix &Kuf,
+    const Eigen::VectorXd &new_hyps, long long cache_generation) {
+
+  KernelCacheKey key(cache_generation, single_precision);
+  if (key.valid() && key == Kuf_key)
+    return rescale_icm_basis(Kuf_basis, new_hyps);
+
+  // Only one training set is cached, so a new one replaces the old one,
+  // which is released first.
+  if (key.valid()) {
+    std::vector<Eigen::MatrixXd>().swap(Kuf_basis);
+    Kuf_key = KernelCacheKey();
+  }
+
+  Eigen::VectorXd unit_hyps = new_hyps;
+  unit_hyps(0) = 1;
+  std::vector<Eigen::MatrixXd> grads = Kernel::Kuf_grad(
+      envs, strucs, kernel_index, Kuf, unit_hyps, cache_generation);
+  std::vector<Eigen::MatrixXd> basis(grads.begin() + 2, grads.end());
+  grads.clear();
+  if (key.valid()) {
+    Kuf_basis = std::move(basis);
+    Kuf_key = key;
+    return rescale_icm_basis(Kuf_basis, new_hyps);
+  }
+
+  return rescale_icm_basis(basis, new_hyps);
+}
+
+void NormalizedDotProduct_ICM ::clear_cache() {
+  std::vector<Eigen::MatrixXd>().swap(Kuu_basis);
+  std::vector<Eigen::MatrixXd>().swap(Kuf_basis);
+  Kuu_key = KernelCacheKey();
+  Kuf_key = KernelCacheKey();
+}
+
 void NormalizedDotProduct_ICM ::set_hyperparameters(Eigen::VectorXd new_hyps) {
   sigma = new_hyps(0);
   sig2 = sigma * sigma;
@@ -43,6 +43,31 @@ public:
                               const DescriptorValues &struc2,
                               const Eigen::VectorXd &hyps);
 
+  /**
+   * The kernel is sig^2 times a sum of hyperparameter-independent kernels
+   * weighted by the ICM coefficients. The basis kernels of the sets of the
+   * last call with a valid cache generation are cached, so that later calls
+   * with new hyperparameters only rescale them. Calls with generation -1
+   * compute the basis kernels without storing them.
+   */
+  std::vector<Eigen::MatrixXd> Kuu_grad(const ClusterDescriptor &envs,
+                                        const Eigen::MatrixXd &Kuu,
+                                        const Eigen::VectorXd &new_hyps,
+                                        long long cache_generation);
+
+  std::vector<Eigen::MatrixXd>
+  Kuf_grad(const ClusterDescriptor &envs,
+           const std::vector<const Structure *> &strucs, int kernel_index,
+           const ChunkedMatrix &Kuf, const Eigen::VectorXd &new_hyps,
+           long long cache_generation);
+
+  // Cached basis kernels of each ICM coefficient, and the sets they were
+  // computed for. The cache is not serialized.
+  std::vector<Eigen::MatrixXd> Kuu_basis, Kuf_basis;
+  KernelCacheKey Kuu_key, Kuf_key;
+
+  void clear_cache();
+
   void set_hyperparameters(Eigen::VectorXd new_hyps);
 
   Eigen::MatrixXd compute_mapping_coefficients(const SparseGP &gp_model,
@@ -3,6 +3,7 @@
 #include "sparse_gp.h"
 #include "structure.h"
 #undef NDEBUG
+#include <algorithm>
 #include <assert.h>
 #include <cmath>
 #include <iostream>
@@ -49,7 +50,7 @@ Eigen::MatrixXd NormalizedDotProduct ::envs_envs(const ClusterDescriptor &envs1,
       // and then multiply them to get norm_dot matrix directly??
     // Compute dot products. (Should be done in parallel with MKL.)
     Eigen::MatrixXd dot_vals =
-        envs1.descriptors[s] * envs2.descriptors[s].transpose();
+        descriptor_dot(envs1.descriptors[s], envs2.descriptors[s]);
 
     // Compute kernels.
     int n_sparse_1 = envs1.n_clusters_by_type[s];
@@ -84,6 +85,34 @@ Eigen::MatrixXd NormalizedDotProduct ::envs_envs(const ClusterDescriptor &envs1,
   return kern_mat;
 }
 
+Eigen::VectorXd
+NormalizedDotProduct ::envs_envs_diagonal(const ClusterDescriptor &envs,
+                                          const Eigen::VectorXd &hyps) {
+
+  double sig_sq = hyps(0) * hyps(0);
+  Eigen::VectorXd kern_diag = Eigen::VectorXd::Zero(envs.n_clusters);
+  double empty_thresh = 1e-8;
+
+  for (int s = 0; s < envs.n_types; s++) {
+    int n_sparse = envs.n_clusters_by_type[s];
+    int c_sparse = envs.cumulative_type_count[s];
+
+    for (int i = 0; i < n_sparse; i++) {
+      double norm_i = envs.descriptor_norms[s](i);
+
+      // Continue if sparse environment i has no neighbors.
+      if (norm_i < empty_thresh)
+        continue;
+
+      double norm_dot = envs.descriptors[s].row(i).squaredNorm() /
+                        (norm_i * norm_i);
+      kern_diag(c_sparse + i) = sig_sq * pow(norm_dot, power);
+    }
+  }
+
+  return kern_diag;
+}
+
 std::vector<Eigen::MatrixXd>
 NormalizedDotProduct ::envs_envs_grad(const ClusterDescriptor &envs1,
                                       const ClusterDescriptor &envs2,
@@ -127,26 +156,86 @@ Eigen::MatrixXd NormalizedDotProduct ::envs_struc(const ClusterDescriptor &envs,
   int n_descriptors_2 = struc.n_descriptors;
   assert(n_descriptors_1 == n_descriptors_2);
 
+  int n_atoms = struc.n_atoms;
   Eigen::MatrixXd kern_mat =
-      Eigen::MatrixXd::Zero(envs.n_clusters, 1 + struc.n_atoms * 3 + 6);
+      Eigen::MatrixXd::Zero(envs.n_clusters, 1 + n_atoms * 3 + 6);
   int n_types = envs.n_types;
   double vol_inv = 1 / struc.volume;
   double empty_thresh = 1e-8;
 
   for (int s = 0; s < n_types; s++) {
-    // Compute dot products. (Should be done in parallel with MKL.)
-    Eigen::MatrixXd dot_vals =
-        envs.descriptors[s] * struc.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot =
-        envs.descriptors[s] * struc.descriptor_force_dervs[s].transpose();
-
-    Eigen::VectorXd struc_force_dot = struc.descriptor_force_dots[s];
-
-    // Compute kernels. Can parallelize over environments.
     int n_sparse = envs.n_clusters_by_type[s];
     int n_struc = struc.n_clusters_by_type[s];
     int c_sparse = envs.cumulative_type_count[s];
+    if (n_sparse == 0 || n_struc == 0)
+      continue;
+
+    const Eigen::VectorXd &struc_norms = struc.descriptor_norms[s];
+    const Eigen::VectorXd &struc_force_dot = struc.descriptor_force_dots[s];
+    const Eigen::VectorXi &neighbor_counts = struc.neighbor_counts[s];
+    const Eigen::VectorXi &cumulative_counts =
+        struc.cumulative_neighbor_counts[s];
+
+    // For power 1 the weights factor into a sparse environment part and a
+    // structure part, so the structure side is contracted once into a
+    // projection matrix and the kernel reduces to a single product.
+    if (power == 1) {
+      Eigen::MatrixXd dervs_buffer;
+      const Eigen::MatrixXd &force_dervs = struc.force_dervs(s, dervs_buffer);
+      int n_descriptors = struc.descriptors[s].cols();
+      Eigen::MatrixXd projection =
+          Eigen::MatrixXd::Zero(1 + 3 * n_atoms + 6, n_descriptors);
+      Eigen::RowVectorXd grad(n_descriptors);
+      for (int j = 0; j < n_struc; j++) {
+        double norm_j = struc_norms(j);
+        if (norm_j < empty_thresh)
+          continue;
+        double norm_j3 = norm_j * norm_j * norm_j;
+        projection.row(0) += struc.descriptors[s].row(j) / norm_j;
 
+        int atom_index = struc.atom_indices[s](j);
+        for (int k = 0; k < neighbor_counts(j); k++) {
+          int ind = cumulative_counts(j) + k;
+          int neighbor_index = struc.neighbor_indices[s](ind);
+          int stress_counter = 0;
+          for (int comp = 0; comp < 3; comp++) {
+            int force_index = 3 * ind + comp;
+            grad.noalias() = force_dervs.row(force_index) / norm_j -
+                             struc.descriptors[s].row(j) *
+                                 (struc_force_dot(force_index) / norm_j3);
+            projection.row(1 + 3 * atom_index + comp) += grad;
+            projection.row(1 + 3 * neighbor_index + comp) -= grad;
+            for (int comp2 = comp; comp2 < 3; comp2++) {
+              double coord = struc.neighbor_coordinates[s](ind, comp2);
+              projection.row(1 + 3 * n_atoms + stress_counter) -=
+                  grad * coord * vol_inv;
+              stress_counter++;
+            }
+          }
+        }
+      }
+
+      Eigen::MatrixXd scaled_envs = envs.descriptors[s];
+      for (int i = 0; i < n_sparse; i++) {
+        double norm_i = envs.descriptor_norms[s](i);
+        if (norm_i < empty_thresh)
+          scaled_envs.row(i).setZero();
+        else
+          scaled_envs.row(i) *= sig_sq / norm_i;
+      }
+      kern_mat.middleRows(c_sparse, n_sparse).noalias() +=
+          descriptor_dot(scaled_envs, projection);
+      continue;
+    }
+
+    // Compute dot products. (Should be done in parallel with MKL.)
+    DotOperand envs_descriptors(envs.descriptors[s], single_precision);
+    DotOperand struc_descriptors(struc.descriptors[s], single_precision);
+    Eigen::MatrixXd dot_vals =
+        descriptor_dot(envs_descriptors, struc_descriptors);
+    Eigen::MatrixXd force_dot = force_dot_product(struc, s, envs_descriptors);
+
+    // Compute kernels. Can parallelize over environments.
 #pragma omp parallel for
     for (int i = 0; i < n_sparse; i++) {
       double norm_i = envs.descriptor_norms[s](i);
@@ -157,7 +246,7 @@ Eigen::MatrixXd NormalizedDotProduct ::envs_struc(const ClusterDescriptor &envs,
       int sparse_index = c_sparse + i;
 
       for (int j = 0; j < n_struc; j++) {
-        double norm_j = struc.descriptor_norms[s](j);
+        double norm_j = struc_norms(j);
         double norm_ij = norm_i * norm_j;
         double norm_ij3 = norm_ij * norm_j * norm_j;
 
@@ -171,8 +260,8 @@ Eigen::MatrixXd NormalizedDotProduct ::envs_struc(const ClusterDescriptor &envs,
         kern_mat(sparse_index, 0) += sig_sq * pow(norm_dot, power);
 
         // Force kernel.
-        int n_neigh = struc.neighbor_counts[s](j);
-        int c_neigh = struc.cumulative_neighbor_counts[s](j);
+        int n_neigh = neighbor_counts(j);
+        int c_neigh = cumulative_counts(j);
         int atom_index = struc.atom_indices[s](j);
 
         for (int k = 0; k < n_neigh; k++) {
@@ -194,7 +283,7 @@ Eigen::MatrixXd NormalizedDotProduct ::envs_struc(const ClusterDescriptor &envs,
 
             for (int comp2 = comp; comp2 < 3; comp2++) {
               double coord = struc.neighbor_coordinates[s](ind, comp2);
-              kern_mat(sparse_index, 1 + 3 * struc.n_atoms + stress_counter) -=
+              kern_mat(sparse_index, 1 + 3 * n_atoms + stress_counter) -=
                   force_kern_val * coord * vol_inv;
               stress_counter++;
             }
@@ -238,15 +327,17 @@ NormalizedDotProduct ::struc_struc(const DescriptorValues &struc1,
   std::vector<int> stress_inds{0, 3, 5};
 
   for (int s = 0; s < n_types_1; s++) {
+    // Each operand enters two products, so it is converted once.
+    DotOperand descriptors_1(struc1.descriptors[s], single_precision);
+    DotOperand descriptors_2(struc2.descriptors[s], single_precision);
+    DotOperand force_dervs_1(struc1, s, single_precision);
+    DotOperand force_dervs_2(struc2, s, single_precision);
+
     // Compute dot products.
-    Eigen::MatrixXd dot_vals =
-        struc1.descriptors[s] * struc2.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot_1 =
-        struc1.descriptor_force_dervs[s] * struc2.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot_2 =
-        struc2.descriptor_force_dervs[s] * struc1.descriptors[s].transpose();
-    Eigen::MatrixXd force_force = struc1.descriptor_force_dervs[s] *
-                                  struc2.descriptor_force_dervs[s].transpose();
+    Eigen::MatrixXd dot_vals = descriptor_dot(descriptors_1, descriptors_2);
+    Eigen::MatrixXd force_dot_1 = descriptor_dot(force_dervs_1, descriptors_2);
+    Eigen::MatrixXd force_dot_2 = descriptor_dot(force_dervs_2, descriptors_1);
+    Eigen::MatrixXd force_force = descriptor_dot(force_dervs_1, force_dervs_2);
 
     Eigen::VectorXd struc_force_dot_1 = struc1.descriptor_force_dots[s];
     Eigen::VectorXd struc_force_dot_2 = struc2.descriptor_force_dots[s];
@@ -279,7 +370,10 @@ NormalizedDotProduct ::struc_struc(const DescriptorValues &struc1,
 
         // Energy/energy kernel.
         double norm_dot = dot_vals(i, j) / norm_ij;
-        double c1 = (power - 1) * power * pow(norm_dot, power - 2);
+        // The second derivative vanishes for power 1, where pow would diverge
+        // for orthogonal descriptors.
+        double c1 =
+            (power != 1) ? (power - 1) * power * pow(norm_dot, power - 2) : 0;
         double c2 = power * pow(norm_dot, power - 1);
         kernel_matrix(0, 0) += sig_sq * pow(norm_dot, power);
 
@@ -441,9 +535,17 @@ Eigen::VectorXd
 NormalizedDotProduct ::self_kernel_struc(const DescriptorValues &struc,
                                          const Eigen::VectorXd &hyps) {
 
+  // The kernel between clusters i and j is sig_sq * (u_i . u_j)^power,
+  // where u_i is the normalized descriptor of cluster i. Its second
+  // derivative only involves the gradients of u_i and u_j, so the variances
+  // are accumulated from per-cluster gradient vectors rather than from the
+  // dense product of all force derivatives, which keeps the memory linear in
+  // the number of neighbors.
+
   double sig_sq = hyps(0) * hyps(0);
 
-  int n_elements = 1 + 3 * struc.n_atoms + 6;
+  int n_atoms = struc.n_atoms;
+  int n_elements = 1 + 3 * n_atoms + 6;
   Eigen::VectorXd kernel_vector = Eigen::VectorXd::Zero(n_elements);
 
   int n_types = struc.n_types;
@@ -451,119 +553,210 @@ NormalizedDotProduct ::self_kernel_struc(const DescriptorValues &struc,
   double vol_inv_sq = vol_inv * vol_inv;
   double empty_thresh = 1e-8;
 
+  // Number of clusters paired with all others at a time when the energy and
+  // stress kernels are not separable (power != 1).
+  int block_size = 256;
+
+  Eigen::MatrixXd dervs_buffer;
   for (int s = 0; s < n_types; s++) {
-    // Compute dot products. (Should be done in parallel with MKL.)
-    Eigen::MatrixXd dot_vals =
-        struc.descriptors[s] * struc.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot =
-        struc.descriptor_force_dervs[s] * struc.descriptors[s].transpose();
-    Eigen::MatrixXd force_force = struc.descriptor_force_dervs[s] *
-                                  struc.descriptor_force_dervs[s].transpose();
+    int n_struc = struc.n_clusters_by_type[s];
+    if (n_struc == 0)
+      continue;
+
+    const Eigen::MatrixXd &force_dervs = struc.force_dervs(s, dervs_buffer);
+    const Eigen::VectorXd &struc_force_dot = struc.descriptor_force_dots[s];
+    const Eigen::VectorXd &norms = struc.descriptor_norms[s];
+    const Eigen::VectorXi &neighbor_counts = struc.neighbor_counts[s];
+    const Eigen::VectorXi &cumulative_counts =
+        struc.cumulative_neighbor_counts[s];
+    const Eigen::VectorXi &atom_indices = struc.atom_indices[s];
+    const Eigen::VectorXi &neighbor_indices = struc.neighbor_indices[s];
+    const Eigen::MatrixXd &coordinates = struc.neighbor_coordinates[s];
+    int n_descriptors = struc.descriptors[s].cols();
+
+    // Normalized descriptors. Clusters without neighbors are left at zero.
+    Eigen::MatrixXd unit = Eigen::MatrixXd::Zero(n_struc, n_descriptors);
+    for (int i = 0; i < n_struc; i++) {
+      if (norms(i) >= empty_thresh)
+        unit.row(i) = struc.descriptors[s].row(i) / norms(i);
+    }
 
-    Eigen::VectorXd struc_force_dot = struc.descriptor_force_dots[s];
+    // Kernel coefficients of a matrix of normalized dot products. The first
+    // is the second derivative of the power, which vanishes for power 1.
+    auto coefficients = [&](const Eigen::MatrixXd &dots,
+                            const std::vector<bool> &empty_1,
+                            const std::vector<bool> &empty_2,
+                            Eigen::MatrixXd &c1, Eigen::MatrixXd &c2,
+                            double &energy) {
+      c1 = Eigen::MatrixXd::Zero(dots.rows(), dots.cols());
+      c2 = Eigen::MatrixXd::Zero(dots.rows(), dots.cols());
+      energy = 0;
+      for (int j = 0; j < dots.cols(); j++) {
+        if (empty_2[j])
+          continue;
+        for (int i = 0; i < dots.rows(); i++) {
+          if (empty_1[i])
+            continue;
+          double norm_dot = dots(i, j);
+          energy += pow(norm_dot, power);
+          c2(i, j) = power * pow(norm_dot, power - 1);
+          if (power != 1)
+            c1(i, j) = (power - 1) * power * pow(norm_dot, power - 2);
+        }
+      }
+    };
 
-    // Compute kernels.
-    int n_struc = struc.n_clusters_by_type[s];
+    std::vector<bool> empty(n_struc);
+    for (int i = 0; i < n_struc; i++) {
+      empty[i] = norms(i) < empty_thresh;
+    }
 
-    // TODO: Parallelize.
-    Eigen::MatrixXd par_mat = Eigen::MatrixXd::Zero(n_struc, n_elements);
+    // Stress gradients of each cluster, one matrix per stress component.
+    std::vector<Eigen::MatrixXd> stress_grads(
+        6, Eigen::MatrixXd::Zero(n_struc, n_descriptors));
 #pragma omp parallel for
     for (int i = 0; i < n_struc; i++) {
-      double norm_i = struc.descriptor_norms[s](i);
-
-      // Continue if atom i has no neighbors.
-      if (norm_i < empty_thresh)
+      if (empty[i])
         continue;
 
-      double norm_i2 = norm_i * norm_i;
-      double norm_i3 = norm_i2 * norm_i;
-
-      for (int j = i; j < n_struc; j++) {
-        double norm_j = struc.descriptor_norms[s](j);
+      double norm_i = norms(i);
+      Eigen::RowVectorXd grad(n_descriptors);
+      for (int k = 0; k < neighbor_counts(i); k++) {
+        int ind = cumulative_counts(i) + k;
+        int stress_counter = 0;
+        for (int m = 0; m < 3; m++) {
+          int f_ind = 3 * ind + m;
+          grad.noalias() = (force_dervs.row(f_ind) -
+                            struc_force_dot(f_ind) / norm_i * unit.row(i)) /
+                           norm_i;
+          for (int n = m; n < 3; n++) {
+            stress_grads[stress_counter].row(i) += grad * coordinates(ind, n);
+            stress_counter++;
+          }
+        }
+      }
+    }
 
-        // Continue if atom j has no neighbors.
-        if (norm_j < empty_thresh)
-          continue;
+    // Energy and stress kernels.
+    if (power == 1) {
+      kernel_vector(0) += sig_sq * unit.colwise().sum().squaredNorm();
+      for (int c = 0; c < 6; c++) {
+        kernel_vector(1 + 3 * n_atoms + c) +=
+            sig_sq * vol_inv_sq * stress_grads[c].colwise().sum().squaredNorm();
+      }
+    } else {
+      for (int start = 0; start < n_struc; start += block_size) {
+        int n_block = std::min(block_size, n_struc - start);
+        std::vector<bool> empty_block(empty.begin() + start,
+                                      empty.begin() + start + n_block);
+
+        Eigen::MatrixXd dots = unit.middleRows(start, n_block) *
+                               unit.transpose();
+        Eigen::MatrixXd c1, c2;
+        double energy;
+        coefficients(dots, empty_block, empty, c1, c2, energy);
+        kernel_vector(0) += sig_sq * energy;
+
+        for (int c = 0; c < 6; c++) {
+          const Eigen::MatrixXd &grads = stress_grads[c];
+          Eigen::MatrixXd grad_unit =
+              grads.middleRows(start, n_block) * unit.transpose();
+          Eigen::MatrixXd unit_grad =
+              unit.middleRows(start, n_block) * grads.transpose();
+          Eigen::MatrixXd grad_grad =
+              grads.middleRows(start, n_block) * grads.transpose();
+          kernel_vector(1 + 3 * n_atoms + c) +=
+              sig_sq * vol_inv_sq *
+              (c1.cwiseProduct(grad_unit).cwiseProduct(unit_grad) +
+               c2.cwiseProduct(grad_grad))
+                  .sum();
+        }
+      }
+    }
 
-        double mult_fac;
-        if (i == j)
-          mult_fac = 1;
+    // Find the clusters whose environment contains each atom, either as the
+    // central atom or as a neighbor. Only these contribute to the force
+    // kernel of the atom. The lists are stored in compressed row format.
+    std::vector<int> touch_start(n_atoms + 1, 0), touch_clusters;
+    std::vector<int> last_cluster(n_atoms);
+    for (int pass = 0; pass < 2; pass++) {
+      std::vector<int> touch_fill(touch_start.begin(), touch_start.end() - 1);
+      std::fill(last_cluster.begin(), last_cluster.end(), -1);
+      auto touch = [&](int atom, int i) {
+        if (last_cluster[atom] == i)
+          return;
+        last_cluster[atom] = i;
+        if (pass == 0)
+          touch_start[atom + 1]++;
         else
-          mult_fac = 2;
-
-        double norm_j2 = norm_j * norm_j;
-        double norm_j3 = norm_j2 * norm_j;
-        double norm_ij = norm_i * norm_j;
-
-        // Energy kernel.
-        double norm_dot = dot_vals(i, j) / norm_ij;
-        double c1 = (power - 1) * power * pow(norm_dot, power - 2);
-        double c2 = power * pow(norm_dot, power - 1);
-        par_mat(i, 0) += sig_sq * mult_fac * pow(norm_dot, power);
-
-        // Force kernel.
-        int n_neigh_1 = struc.neighbor_counts[s](i);
-        int c_neigh_1 = struc.cumulative_neighbor_counts[s](i);
-        int c_ind_1 = struc.atom_indices[s](i);
+          touch_clusters[touch_fill[atom]++] = i;
+      };
 
-        int n_neigh_2 = struc.neighbor_counts[s](j);
-        int c_neigh_2 = struc.cumulative_neighbor_counts[s](j);
-        int c_ind_2 = struc.atom_indices[s](j);
+      for (int i = 0; i < n_struc; i++) {
+        if (empty[i])
+          continue;
+        touch(atom_indices(i), i);
+        for (int k = 0; k < neighbor_counts(i); k++) {
+          touch(neighbor_indices(cumulative_counts(i) + k), i);
+        }
+      }
 
-        for (int k = 0; k < n_neigh_1; k++) {
-          int ind1 = c_neigh_1 + k;
-          int n_ind_1 = struc.neighbor_indices[s](ind1);
+      if (pass == 0) {
+        for (int a = 0; a < n_atoms; a++) {
+          touch_start[a + 1] += touch_start[a];
+        }
+        touch_clusters.resize(touch_start[n_atoms]);
+      }
+    }
 
-          for (int l = 0; l < n_neigh_2; l++) {
-            int ind2 = c_neigh_2 + l;
-            int n_ind_2 = struc.neighbor_indices[s](ind2);
+    // Force kernels.
+#pragma omp parallel for schedule(dynamic)
+    for (int a = 0; a < n_atoms; a++) {
+      int t_start = touch_start[a];
+      int n_touch = touch_start[a + 1] - t_start;
+      if (n_touch == 0)
+        continue;
 
-            int stress_counter = 0;
-            for (int m = 0; m < 3; m++) {
-              int f_ind_1 = 3 * ind1 + m;
-              int f_ind_2 = 3 * ind2 + m;
-              double v1 = force_dot(f_ind_1, j) / norm_ij -
-                          norm_dot * struc_force_dot(f_ind_1) / norm_i2;
-              double v2 = force_dot(f_ind_2, i) / norm_ij -
-                          norm_dot * struc_force_dot(f_ind_2) / norm_j2;
-              double v3 = force_force(f_ind_1, f_ind_2) / norm_ij;
-              double v4 = struc_force_dot(f_ind_1) * force_dot(f_ind_2, i) /
-                          (norm_i3 * norm_j);
-              double v5 = struc_force_dot(f_ind_2) * force_dot(f_ind_1, j) /
-                          (norm_i * norm_j3);
-              double v6 = struc_force_dot(f_ind_1) * struc_force_dot(f_ind_2) *
-                          norm_dot / (norm_i2 * norm_j2);
-
-              double kern_val =
-                  sig_sq * mult_fac * (c1 * v1 * v2 + c2 * (v3 - v4 - v5 + v6));
-
-              if (c_ind_1 == c_ind_2)
-                par_mat(i, 1 + c_ind_1 * 3 + m) += kern_val;
-              if (c_ind_1 == n_ind_2)
-                par_mat(i, 1 + c_ind_1 * 3 + m) -= kern_val;
-              if (n_ind_1 == c_ind_2)
-                par_mat(i, 1 + n_ind_1 * 3 + m) -= kern_val;
-              if (n_ind_1 == n_ind_2)
-                par_mat(i, 1 + n_ind_1 * 3 + m) += kern_val;
-
-              // Stress kernel.
-              for (int n = m; n < 3; n++) {
-                double coord1 = struc.neighbor_coordinates[s](ind1, n);
-                double coord2 = struc.neighbor_coordinates[s](ind2, n);
-                par_mat(i, 1 + 3 * struc.n_atoms + stress_counter) +=
-                    kern_val * coord1 * coord2 * vol_inv_sq;
-                stress_counter++;
-              }
-            }
+      Eigen::MatrixXd unit_touch(n_touch, n_descriptors);
+      for (int p = 0; p < n_touch; p++) {
+        unit_touch.row(p) = unit.row(touch_clusters[t_start + p]);
+      }
+      std::vector<bool> empty_touch(n_touch, false);
+      Eigen::MatrixXd dots = unit_touch * unit_touch.transpose();
+      Eigen::MatrixXd c1, c2;
+      double energy;
+      coefficients(dots, empty_touch, empty_touch, c1, c2, energy);
+
+      // Gradient of each touching cluster with respect to the position of
+      // atom a. The central atom moves against its neighbors.
+      Eigen::MatrixXd grads(n_touch, n_descriptors);
+      for (int m = 0; m < 3; m++) {
+        grads.setZero();
+        for (int p = 0; p < n_touch; p++) {
+          int i = touch_clusters[t_start + p];
+          double norm_i = norms(i);
+          int c_ind = atom_indices(i);
+          for (int k = 0; k < neighbor_counts(i); k++) {
+            int ind = cumulative_counts(i) + k;
+            int weight = (c_ind == a) - (neighbor_indices(ind) == a);
+            if (weight == 0)
+              continue;
+            int f_ind = 3 * ind + m;
+            grads.row(p) += weight *
+                            (force_dervs.row(f_ind) -
+                             struc_force_dot(f_ind) / norm_i * unit.row(i)) /
+                            norm_i;
           }
         }
-      }
-    }
 
-    // Reduce kernel values.
-    for (int i = 0; i < n_struc; i++) {
-      for (int j = 0; j < n_elements; j++) {
-        kernel_vector(j) += par_mat(i, j);
+        double kern_val = c2.cwiseProduct(grads * grads.transpose()).sum();
+        if (power != 1) {
+          Eigen::MatrixXd grad_unit = grads * unit_touch.transpose();
+          kern_val += c1.cwiseProduct(grad_unit)
+                          .cwiseProduct(grad_unit.transpose())
+                          .sum();
+        }
+        kernel_vector(1 + 3 * a + m) += sig_sq * kern_val;
       }
     }
   }
@@ -574,7 +767,8 @@ NormalizedDotProduct ::self_kernel_struc(const DescriptorValues &struc,
 std::vector<Eigen::MatrixXd>
 NormalizedDotProduct ::Kuu_grad(const ClusterDescriptor &envs,
                                 const Eigen::MatrixXd &Kuu,
-                                const Eigen::VectorXd &new_hyps) {
+                                const Eigen::VectorXd &new_hyps,
+                                long long /*cache_generation*/) {
 
   std::vector<Eigen::MatrixXd> kernel_gradients;
 
@@ -596,23 +790,22 @@ NormalizedDotProduct ::Kuu_grad(const ClusterDescriptor &envs,
 
 std::vector<Eigen::MatrixXd>
 NormalizedDotProduct ::Kuf_grad(const ClusterDescriptor &envs,
-                                const std::vector<Structure> &strucs,
-                                int kernel_index, const Eigen::MatrixXd &Kuf,
-                                const Eigen::VectorXd &new_hyps) {
-
-  std::vector<Eigen::MatrixXd> kernel_gradients;
-
-  // Compute Kuf.
-  Eigen::MatrixXd Kuf_new = Kuf;
-  Kuf_new /= sig2;
-  Kuf_new *= new_hyps(0) * new_hyps(0);
-  kernel_gradients.push_back(Kuf_new);
-
-  // Compute sigma gradient.
-  Eigen::MatrixXd sigma_gradient = Kuf;
-  sigma_gradient /= sig2;
-  sigma_gradient *= 2 * new_hyps(0);
-  kernel_gradients.push_back(sigma_gradient);
+                                const std::vector<const Structure *> &strucs,
+                                int kernel_index, const ChunkedMatrix &Kuf,
+                                const Eigen::VectorXd &new_hyps,
+                                long long /*cache_generation*/) {
+
+  // Compute Kuf and the sigma gradient, one chunk of Kuf at a time.
+  std::vector<Eigen::MatrixXd> kernel_gradients(2);
+  kernel_gradients[0].resize(Kuf.rows(), Kuf.cols());
+  kernel_gradients[1].resize(Kuf.rows(), Kuf.cols());
+  for (int c = 0; c < Kuf.n_chunks(); c++) {
+    int start = Kuf.chunk_starts[c], n_cols = Kuf.chunk_cols[c];
+    kernel_gradients[0].middleCols(start, n_cols) =
+        Kuf.chunk(c) / sig2 * (new_hyps(0) * new_hyps(0));
+    kernel_gradients[1].middleCols(start, n_cols) =
+        Kuf.chunk(c) / sig2 * (2 * new_hyps(0));
+  }
 
   return kernel_gradients;
 }
@@ -721,7 +914,7 @@ Eigen::MatrixXd NormalizedDotProduct ::compute_varmap_coefficients(
   mapping_coeffs = Eigen::MatrixXd::Zero(n_species, p_size * p_size); // can be reduced by symmetry
 
   // Get alpha index.
-  
+  Eigen::MatrixXd Kuu_inverse = gp_model.compute_Kuu_inverse();
   int alpha_ind = 0;
   for (int i = 0; i < kernel_index; i++){
       alpha_ind += gp_model.sparse_descriptors[i].n_clusters;
@@ -749,7 +942,7 @@ Eigen::MatrixXd NormalizedDotProduct ::compute_varmap_coefficients(
           double pj_norm =
             gp_model.sparse_descriptors[kernel_index].descriptor_norms[s](j);
 
-          double Kuu_inv_ij = gp_model.Kuu_inverse(K_ind + i, K_ind + j);
+          double Kuu_inv_ij = Kuu_inverse(K_ind + i, K_ind + j);
           double Kuu_inv_ij_normed = Kuu_inv_ij / pi_norm / pj_norm;
 //          double Sigma_ij = gp_model.Sigma(K_ind + i, K_ind + j);
 //          double Sigma_ij_normed = Sigma_ij / pi_norm / pj_norm;
@@ -25,6 +25,9 @@ public:
                                               const ClusterDescriptor &envs2,
                                               const Eigen::VectorXd &hyps);
 
+  Eigen::VectorXd envs_envs_diagonal(const ClusterDescriptor &envs,
+                                     const Eigen::VectorXd &hyps);
+
   Eigen::MatrixXd envs_struc(const ClusterDescriptor &envs,
                              const DescriptorValues &struc,
                              const Eigen::VectorXd &hyps);
@@ -45,13 +48,14 @@ public:
   // reconstructs the covariance matrices from scratch.
   std::vector<Eigen::MatrixXd> Kuu_grad(const ClusterDescriptor &envs,
                                         const Eigen::MatrixXd &Kuu,
-                                        const Eigen::VectorXd &new_hyps);
-
-  std::vector<Eigen::MatrixXd> Kuf_grad(const ClusterDescriptor &envs,
-                                        const std::vector<Structure> &strucs,
-                                        int kernel_index,
-                                        const Eigen::MatrixXd &Kuf,
-                                        const Eigen::VectorXd &new_hyps);
+                                        const Eigen::VectorXd &new_hyps,
+                                        long long cache_generation);
+
+  std::vector<Eigen::MatrixXd>
+  Kuf_grad(const ClusterDescriptor &envs,
+           const std::vector<const Structure *> &strucs, int kernel_index,
+           const ChunkedMatrix &Kuf, const Eigen::VectorXd &new_hyps,
+           long long cache_generation);
 
   void set_hyperparameters(Eigen::VectorXd new_hyps);
 
@@ -46,7 +46,7 @@ Eigen::MatrixXd SquaredExponential ::envs_envs(const ClusterDescriptor &envs1,
   for (int s = 0; s < n_types; s++) {
     // Compute dot products.
     Eigen::MatrixXd dot_vals =
-        envs1.descriptors[s] * envs2.descriptors[s].transpose();
+        descriptor_dot(envs1.descriptors[s], envs2.descriptors[s]);
 
     // Compute kernels.
     int n_sparse_1 = envs1.n_clusters_by_type[s];
@@ -77,6 +77,30 @@ Eigen::MatrixXd SquaredExponential ::envs_envs(const ClusterDescriptor &envs1,
   return kern_mat;
 }
 
+Eigen::VectorXd
+SquaredExponential ::envs_envs_diagonal(const ClusterDescriptor &envs,
+                                        const Eigen::VectorXd &hyps) {
+
+  double sig2 = hyps(0) * hyps(0);
+  double ls2 = hyps(1) * hyps(1);
+  Eigen::VectorXd kern_diag = Eigen::VectorXd::Zero(envs.n_clusters);
+
+  for (int s = 0; s < envs.n_types; s++) {
+    int n_sparse = envs.n_clusters_by_type[s];
+    int c_sparse = envs.cumulative_type_count[s];
+
+    for (int i = 0; i < n_sparse; i++) {
+      double norm_i = envs.descriptor_norms[s](i);
+      double cut_i = envs.cutoff_values[s](i);
+      double dot_val = envs.descriptors[s].row(i).squaredNorm();
+      double exp_arg = (2 * norm_i * norm_i - 2 * dot_val) / (2 * ls2);
+      kern_diag(c_sparse + i) = sig2 * cut_i * cut_i * exp(-exp_arg);
+    }
+  }
+
+  return kern_diag;
+}
+
 std::vector<Eigen::MatrixXd>
 SquaredExponential ::envs_envs_grad(const ClusterDescriptor &envs1,
                                     const ClusterDescriptor &envs2,
@@ -109,7 +133,7 @@ SquaredExponential ::envs_envs_grad(const ClusterDescriptor &envs1,
   for (int s = 0; s < n_types; s++) {
     // Compute dot products.
     Eigen::MatrixXd dot_vals =
-        envs1.descriptors[s] * envs2.descriptors[s].transpose();
+        descriptor_dot(envs1.descriptors[s], envs2.descriptors[s]);
 
     // Compute kernels.
     int n_sparse_1 = envs1.n_clusters_by_type[s];
@@ -174,10 +198,11 @@ Eigen::MatrixXd SquaredExponential ::envs_struc(const ClusterDescriptor &envs,
 
   for (int s = 0; s < n_types; s++) {
     // Compute dot products.
+    DotOperand envs_descriptors(envs.descriptors[s], single_precision);
+    DotOperand struc_descriptors(struc.descriptors[s], single_precision);
     Eigen::MatrixXd dot_vals =
-        envs.descriptors[s] * struc.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot =
-        envs.descriptors[s] * struc.descriptor_force_dervs[s].transpose();
+        descriptor_dot(envs_descriptors, struc_descriptors);
+    Eigen::MatrixXd force_dot = force_dot_product(struc, s, envs_descriptors);
 
     Eigen::VectorXd struc_force_dot = struc.descriptor_force_dots[s];
 
@@ -275,10 +300,11 @@ SquaredExponential ::envs_struc_grad(const ClusterDescriptor &envs,
 
   for (int s = 0; s < n_types; s++) {
     // Compute dot products.
+    DotOperand envs_descriptors(envs.descriptors[s], single_precision);
+    DotOperand struc_descriptors(struc.descriptors[s], single_precision);
     Eigen::MatrixXd dot_vals =
-        envs.descriptors[s] * struc.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot =
-        envs.descriptors[s] * struc.descriptor_force_dervs[s].transpose();
+        descriptor_dot(envs_descriptors, struc_descriptors);
+    Eigen::MatrixXd force_dot = force_dot_product(struc, s, envs_descriptors);
 
     Eigen::VectorXd struc_force_dot = struc.descriptor_force_dots[s];
 
@@ -396,15 +422,17 @@ Eigen::MatrixXd SquaredExponential ::struc_struc(const DescriptorValues &struc1,
   std::vector<int> stress_inds{0, 3, 5};
 
   for (int s = 0; s < n_types_1; s++) {
+    // Each operand enters two products, so it is converted once.
+    DotOperand descriptors_1(struc1.descriptors[s], single_precision);
+    DotOperand descriptors_2(struc2.descriptors[s], single_precision);
+    DotOperand force_dervs_1(struc1, s, single_precision);
+    DotOperand force_dervs_2(struc2, s, single_precision);
+
     // Compute dot products.
-    Eigen::MatrixXd dot_vals =
-        struc1.descriptors[s] * struc2.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot_1 =
-        struc1.descriptor_force_dervs[s] * struc2.descriptors[s].transpose();
-    Eigen::MatrixXd force_dot_2 =
-        struc2.descriptor_force_dervs[s] * struc1.descriptors[s].transpose();
-    Eigen::MatrixXd force_force = struc1.descriptor_force_dervs[s] *
-                                  struc2.descriptor_force_dervs[s].transpose();
+    Eigen::MatrixXd dot_vals = descriptor_dot(descriptors_1, descriptors_2);
+    Eigen::MatrixXd force_dot_1 = descriptor_dot(force_dervs_1, descriptors_2);
+    Eigen::MatrixXd force_dot_2 = descriptor_dot(force_dervs_2, descriptors_1);
+    Eigen::MatrixXd force_force = descriptor_dot(force_dervs_1, force_dervs_2);
 
     Eigen::VectorXd struc_force_dot_1 = struc1.descriptor_force_dots[s];
     Eigen::VectorXd struc_force_dot_2 = struc2.descriptor_force_dots[s];
@@ -25,6 +25,9 @@ public:
                                               const ClusterDescriptor &envs2,
                                               const Eigen::VectorXd &hyps);
 
+  Eigen::VectorXd envs_envs_diagonal(const ClusterDescriptor &envs,
+                                     const Eigen::VectorXd &hyps);
+
   Eigen::MatrixXd envs_struc(const ClusterDescriptor &envs,
                              const DescriptorValues &struc,
                              const Eigen::VectorXd &hyps);
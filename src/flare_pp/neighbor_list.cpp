@@ -0,0 +1,121 @@
+#include "neighbor_list.h"
+#include "structure.h"
+#include <cmath>
+
+// Lattice translation taking each unwrapped position to its wrapped position.
+static Eigen::MatrixXi get_lattice_translations(const Structure &structure) {
+  Eigen::MatrixXd relative_shifts =
+      ((structure.positions - structure.wrapped_positions) *
+       structure.cell_transpose) *
+      structure.cell_dot_inverse;
+  return relative_shifts.array().round().cast<int>();
+}
+
+NeighborList ::NeighborList() {}
+
+NeighborList ::NeighborList(double cutoff, double skin) {
+  this->cutoff = cutoff;
+  this->skin = skin;
+}
+
+bool NeighborList ::needs_rebuild(const Structure &structure) const {
+  if (n_builds == 0)
+    return true;
+  if (structure.noa != reference_positions.rows())
+    return true;
+  if (structure.cell != reference_cell)
+    return true;
+
+  double max_displacement = (structure.positions - reference_positions)
+                                .rowwise()
+                                .squaredNorm()
+                                .maxCoeff();
+  return max_displacement > skin * skin / 4;
+}
+
+void NeighborList ::build(const Structure &structure) {
+  structure.find_neighbor_images(cutoff + skin, cumulative_candidate_count,
+                                 candidate_indices, candidate_shifts);
+
+  // Store shifts relative to the unwrapped positions.
+  Eigen::MatrixXi translations = get_lattice_translations(structure);
+  for (int i = 0; i < structure.noa; i++) {
+    for (int k = cumulative_candidate_count(i);
+         k < cumulative_candidate_count(i + 1); k++) {
+      int j = candidate_indices(k);
+      candidate_shifts.row(k) += translations.row(i) - translations.row(j);
+    }
+  }
+
+  reference_cell = structure.cell;
+  reference_positions = structure.positions;
+  n_builds++;
+}
+
+void NeighborList ::compute_neighbors(Structure &structure) {
+  if (needs_rebuild(structure))
+    build(structure);
+
+  int noa = structure.noa;
+  const Eigen::MatrixXd &cell = structure.cell;
+  const Eigen::MatrixXd &wrapped_positions = structure.wrapped_positions;
+  Eigen::MatrixXi translations = get_lattice_translations(structure);
+
+  // Compute candidate distances in the same way as a fresh neighbor search,
+  // so that the resulting neighbor arrays are identical.
+  int n_candidates = cumulative_candidate_count(noa);
+  Eigen::MatrixXd candidate_positions(n_candidates, 4);
+  Eigen::VectorXi neighbor_count = Eigen::VectorXi::Zero(noa);
+#pragma omp parallel for
+  for (int i = 0; i < noa; i++) {
+    for (int k = cumulative_candidate_count(i);
+         k < cumulative_candidate_count(i + 1); k++) {
+      int j = candidate_indices(k);
+      int s1 = candidate_shifts(k, 0) + translations(j, 0) - translations(i, 0);
+      int s2 = candidate_shifts(k, 1) + translations(j, 1) - translations(i, 1);
+      int s3 = candidate_shifts(k, 2) + translations(j, 2) - translations(i, 2);
+      double im[3];
+      for (int m = 0; m < 3; m++) {
+        im[m] = (wrapped_positions(j, m) - wrapped_positions(i, m)) +
+                s1 * cell(0, m) + s2 * cell(1, m) + s3 * cell(2, m);
+      }
+      double dist = sqrt(im[0] * im[0] + im[1] * im[1] + im[2] * im[2]);
+      candidate_positions(k, 0) = dist;
+      candidate_positions(k, 1) = im[0];
+      candidate_positions(k, 2) = im[1];
+      candidate_positions(k, 3) = im[2];
+      if ((dist < cutoff) && (dist != 0))
+        neighbor_count(i)++;
+    }
+  }
+
+  structure.neighbor_count = neighbor_count;
+  structure.cumulative_neighbor_count = Eigen::VectorXi::Zero(noa + 1);
+  for (int i = 0; i < noa; i++) {
+    structure.cumulative_neighbor_count(i + 1) =
+        structure.cumulative_neighbor_count(i) + neighbor_count(i);
+  }
+
+  // Store the candidates that lie within the cutoff.
+  int n_neighbors = structure.cumulative_neighbor_count(noa);
+  structure.n_neighbors = n_neighbors;
+  structure.relative_positions = Eigen::MatrixXd::Zero(n_neighbors, 4);
+  structure.structure_indices = Eigen::VectorXi::Zero(n_neighbors);
+  structure.neighbor_species = Eigen::VectorXi::Zero(n_neighbors);
+#pragma omp parallel for
+  for (int i = 0; i < noa; i++) {
+    int rel_index = structure.cumulative_neighbor_count(i);
+    for (int k = cumulative_candidate_count(i);
+         k < cumulative_candidate_count(i + 1); k++) {
+      double dist = candidate_positions(k, 0);
+      if ((dist < cutoff) && (dist != 0)) {
+        int j = candidate_indices(k);
+        structure.relative_positions.row(rel_index) =
+            candidate_positions.row(k);
+        structure.structure_indices(rel_index) = j;
+        structure.neighbor_species(rel_index) = structure.species[j];
+        rel_index++;
+      }
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef NEIGHBOR_LIST_H
+#define NEIGHBOR_LIST_H
+
+#include <Eigen/Dense>
+#include <vector>
+
+class Structure;
+
+/**
+ Verlet neighbor list that persists across the steps of a simulation.
+ Candidate neighbors are stored out to the cutoff plus a skin distance, and
+ are only searched for again when an atom has moved more than half the skin
+ since the last build, or when the cell or number of atoms changes. In
+ between, the neighbor arrays of a structure are filled by filtering the
+ candidates.
+ */
+class NeighborList {
+public:
+  double cutoff, skin;
+
+  /** Number of times the candidates have been searched for. */
+  int n_builds = 0;
+
+  /** @name Reference configuration
+   * Cell and unwrapped positions at the last build.
+   */
+  ///@{
+  Eigen::MatrixXd reference_cell, reference_positions;
+  ///@}
+
+  /** @name Candidate neighbors
+   * Candidates within cutoff + skin of each atom, stored in CSR format. The
+   * shifts are lattice translations applied to the unwrapped positions, so
+   * they remain valid when atoms are wrapped back into the cell.
+   */
+  ///@{
+  Eigen::VectorXi cumulative_candidate_count, candidate_indices;
+  Eigen::MatrixXi candidate_shifts;
+  ///@}
+
+  NeighborList();
+
+  /**
+   @param cutoff Neighbor cutoff.
+   @param skin Extra distance beyond the cutoff within which candidates are
+        stored.
+   */
+  NeighborList(double cutoff, double skin);
+
+  bool needs_rebuild(const Structure &structure) const;
+  void build(const Structure &structure);
+
+  /**
+   Fill the neighbor arrays of a structure, rebuilding the candidate list
+   first if needed.
+   */
+  void compute_neighbors(Structure &structure);
+};
+
+#endif
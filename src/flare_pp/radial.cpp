@@ -1,11 +1,12 @@
 #include "radial.h"
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #define Pi 3.14159265358979323846
 
 void fourier(std::vector<double> &basis_vals,
              std::vector<double> &basis_derivs, double r, int N,
-             std::vector<double> radial_hyps){
+             const std::vector<double> &radial_hyps){
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -42,7 +43,7 @@ void fourier(std::vector<double> &basis_vals,
 
 void fourier_quarter(std::vector<double> &basis_vals,
                      std::vector<double> &basis_derivs, double r, int N,
-                     std::vector<double> radial_hyps){
+                     const std::vector<double> &radial_hyps){
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -78,7 +79,7 @@ void fourier_quarter(std::vector<double> &basis_vals,
 
 void fourier_half(std::vector<double> &basis_vals,
                   std::vector<double> &basis_derivs, double r, int N,
-                  std::vector<double> radial_hyps){
+                  const std::vector<double> &radial_hyps){
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -113,7 +114,7 @@ void fourier_half(std::vector<double> &basis_vals,
 }
 
 void bessel(std::vector<double> &basis_vals, std::vector<double> &basis_derivs,
-            double r, int N, std::vector<double> radial_hyps) {
+            double r, int N, const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -137,7 +138,7 @@ void bessel(std::vector<double> &basis_vals, std::vector<double> &basis_derivs,
 
 void chebyshev(std::vector<double> &basis_vals,
                std::vector<double> &basis_derivs, double r, int N,
-               std::vector<double> radial_hyps) {
+               const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -170,7 +171,7 @@ void chebyshev(std::vector<double> &basis_vals,
 
 void positive_chebyshev(std::vector<double> &basis_vals,
                         std::vector<double> &basis_derivs, double r, int N,
-                        std::vector<double> radial_hyps) {
+                        const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -213,7 +214,7 @@ void positive_chebyshev(std::vector<double> &basis_vals,
 
 void weighted_chebyshev(std::vector<double> &basis_vals,
                         std::vector<double> &basis_derivs, double r, int N,
-                        std::vector<double> radial_hyps) {
+                        const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -262,7 +263,8 @@ void weighted_chebyshev(std::vector<double> &basis_vals,
 
 void weighted_positive_chebyshev(std::vector<double> &basis_vals,
                                  std::vector<double> &basis_derivs, double r,
-                                 int N, std::vector<double> radial_hyps) {
+                                 int N,
+                                 const std::vector<double> &radial_hyps) {
 
   double r1 = radial_hyps[0];
   double r2 = radial_hyps[1];
@@ -311,7 +313,7 @@ void weighted_positive_chebyshev(std::vector<double> &basis_vals,
 
 void equispaced_gaussians(std::vector<double> &basis_vals,
                           std::vector<double> &basis_derivs, double r, int N,
-                          std::vector<double> radial_hyps) {
+                          const std::vector<double> &radial_hyps) {
 
   // Define Gaussian hyperparameters (width and locations of first and final
   // gaussians)
@@ -345,21 +347,43 @@ void calculate_radial(
     std::vector<double> &comb_vals, std::vector<double> &comb_x,
     std::vector<double> &comb_y, std::vector<double> &comb_z,
     std::function<void(std::vector<double> &, std::vector<double> &, double,
-                       int, std::vector<double>)>
+                       int, const std::vector<double> &)>
         basis_function,
     std::function<void(std::vector<double> &, double, double,
-                       std::vector<double>)>
+                       const std::vector<double> &)>
         cutoff_function,
     double x, double y, double z, double r, double rcut, int N,
-    std::vector<double> radial_hyps, std::vector<double> cutoff_hyps) {
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps) {
 
-  // Calculate cutoff values.
   std::vector<double> rcut_vals(2, 0);
+  std::vector<double> basis_vals = std::vector<double>(N, 0);
+  std::vector<double> basis_derivs = std::vector<double>(N, 0);
+  calculate_radial(comb_vals, comb_x, comb_y, comb_z, basis_function,
+                   cutoff_function, x, y, z, r, rcut, N, radial_hyps,
+                   cutoff_hyps, rcut_vals, basis_vals, basis_derivs);
+}
+
+void calculate_radial(
+    std::vector<double> &comb_vals, std::vector<double> &comb_x,
+    std::vector<double> &comb_y, std::vector<double> &comb_z,
+    const std::function<void(std::vector<double> &, std::vector<double> &,
+                             double, int, const std::vector<double> &)>
+        &basis_function,
+    const std::function<void(std::vector<double> &, double, double,
+                             const std::vector<double> &)> &cutoff_function,
+    double x, double y, double z, double r, double rcut, int N,
+    const std::vector<double> &radial_hyps,
+    const std::vector<double> &cutoff_hyps, std::vector<double> &rcut_vals,
+    std::vector<double> &basis_vals, std::vector<double> &basis_derivs) {
+
+  // Calculate cutoff values.
+  std::fill(rcut_vals.begin(), rcut_vals.end(), 0);
   cutoff_function(rcut_vals, r, rcut, cutoff_hyps);
 
   // Calculate radial basis values.
-  std::vector<double> basis_vals = std::vector<double>(N, 0);
-  std::vector<double> basis_derivs = std::vector<double>(N, 0);
+  std::fill(basis_vals.begin(), basis_vals.end(), 0);
+  std::fill(basis_derivs.begin(), basis_derivs.end(), 0);
   basis_function(basis_vals, basis_derivs, r, N, radial_hyps);
 
   // Store the product.
@@ -382,7 +406,7 @@ void set_radial_basis(const std::string &basis_name,
                       std::function <void(std::vector<double> &,
                                           std::vector<double> &,
                                           double, int,
-                                          std::vector<double>)>
+                                          const std::vector<double> &)>
                                           &radial_pointer){
 
   // Set the radial basis.
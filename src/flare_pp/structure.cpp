@@ -1,5 +1,8 @@
 #include "structure.h"
+#include "neighbor_list.h"
 #include "omp.h"
+#include <algorithm>
+#include <array>
 #include <fstream> // File operations
 #include <iostream>
 
@@ -43,6 +46,21 @@ Structure ::Structure(const Eigen::MatrixXd &cell,
   compute_descriptors();
 }
 
+Structure ::Structure(const Eigen::MatrixXd &cell,
+                      const std::vector<int> &species,
+                      const Eigen::MatrixXd &positions,
+                      NeighborList &neighbor_list,
+                      std::vector<Descriptor *> descriptor_calculators)
+    : Structure(cell, species, positions) {
+
+  this->cutoff = neighbor_list.cutoff;
+  this->descriptor_calculators = descriptor_calculators;
+  sweep = ceil(cutoff / single_sweep_cutoff);
+
+  neighbor_list.compute_neighbors(*this);
+  compute_descriptors();
+}
+
 void Structure ::compute_descriptors(){
   descriptors.clear();
   for (int i = 0; i < descriptor_calculators.size(); i++){
@@ -50,7 +68,211 @@ void Structure ::compute_descriptors(){
   }
 }
 
+void Structure ::release_descriptors() {
+  std::vector<DescriptorValues>().swap(descriptors);
+  neighbor_count.resize(0);
+  cumulative_neighbor_count.resize(0);
+  neighbor_species.resize(0);
+  structure_indices.resize(0);
+  relative_positions.resize(0, 0);
+}
+
+bool Structure ::descriptors_released() const {
+  return descriptors.size() < descriptor_calculators.size();
+}
+
+const Structure &
+Structure ::materialize_descriptors(Structure &buffer) const {
+  if (!descriptors_released())
+    return *this;
+
+  buffer = *this;
+  buffer.compute_neighbors();
+  buffer.compute_descriptors();
+  return buffer;
+}
+
 void Structure ::compute_neighbors() {
+  Eigen::MatrixXi image_shifts;
+  find_neighbor_images(cutoff, cumulative_neighbor_count, structure_indices,
+                       image_shifts);
+
+  n_neighbors = cumulative_neighbor_count(noa);
+  neighbor_count = Eigen::VectorXi::Zero(noa);
+  relative_positions = Eigen::MatrixXd::Zero(n_neighbors, 4);
+  neighbor_species = Eigen::VectorXi::Zero(n_neighbors);
+
+// Store relative positions of the neighbors.
+#pragma omp parallel for
+  for (int i = 0; i < noa; i++) {
+    int start = cumulative_neighbor_count(i);
+    int end = cumulative_neighbor_count(i + 1);
+    neighbor_count(i) = end - start;
+    for (int k = start; k < end; k++) {
+      int j = structure_indices(k);
+      int s1 = image_shifts(k, 0);
+      int s2 = image_shifts(k, 1);
+      int s3 = image_shifts(k, 2);
+      double im[3];
+      for (int m = 0; m < 3; m++) {
+        im[m] = (wrapped_positions(j, m) - wrapped_positions(i, m)) +
+                s1 * cell(0, m) + s2 * cell(1, m) + s3 * cell(2, m);
+      }
+      relative_positions(k, 0) =
+          sqrt(im[0] * im[0] + im[1] * im[1] + im[2] * im[2]);
+      relative_positions(k, 1) = im[0];
+      relative_positions(k, 2) = im[1];
+      relative_positions(k, 3) = im[2];
+      neighbor_species(k) = species[j];
+    }
+  }
+}
+
+void Structure ::find_neighbor_images(double cutoff,
+                                      Eigen::VectorXi &cumulative_count,
+                                      Eigen::VectorXi &neighbor_indices,
+                                      Eigen::MatrixXi &image_shifts) const {
+  // Distance between opposite faces of the cell along each lattice vector.
+  Eigen::Vector3d heights;
+  for (int a = 0; a < 3; a++) {
+    Eigen::Vector3d v1 = cell.row((a + 1) % 3).transpose();
+    Eigen::Vector3d v2 = cell.row((a + 2) % 3).transpose();
+    heights(a) = volume / v1.cross(v2).norm();
+  }
+
+  // Choose bins that are at least as wide as the cutoff, capping the total
+  // number of bins so that sparse or very large cells don't allocate
+  // mostly empty grids.
+  int n_bins[3];
+  for (int a = 0; a < 3; a++) {
+    n_bins[a] = std::max(1, (int)floor(heights(a) / cutoff * (1 - 1e-12)));
+  }
+  double total_bins = (double)n_bins[0] * n_bins[1] * n_bins[2];
+  double max_bins = std::max(noa, 1);
+  if (total_bins > max_bins) {
+    double scale = cbrt(max_bins / total_bins);
+    for (int a = 0; a < 3; a++) {
+      n_bins[a] = std::max(1, (int)floor(n_bins[a] * scale));
+    }
+  }
+
+  // Number of bins that must be searched on either side of the central bin.
+  int stencil[3];
+  for (int a = 0; a < 3; a++) {
+    stencil[a] = (int)ceil(cutoff * n_bins[a] / heights(a) * (1 + 1e-12));
+  }
+
+  // Assign atoms to bins using their fractional coordinates.
+  Eigen::MatrixXd fractional =
+      (wrapped_positions * cell_transpose) * cell_dot_inverse;
+  int n_cells = n_bins[0] * n_bins[1] * n_bins[2];
+  Eigen::MatrixXi atom_bins(noa, 3);
+  Eigen::VectorXi bin_start = Eigen::VectorXi::Zero(n_cells + 1);
+  Eigen::VectorXi bin_atoms(noa);
+  for (int i = 0; i < noa; i++) {
+    for (int a = 0; a < 3; a++) {
+      int b = (int)floor(fractional(i, a) * n_bins[a]);
+      atom_bins(i, a) = std::min(std::max(b, 0), n_bins[a] - 1);
+    }
+    int bin_index =
+        (atom_bins(i, 0) * n_bins[1] + atom_bins(i, 1)) * n_bins[2] +
+        atom_bins(i, 2);
+    bin_start(bin_index + 1)++;
+  }
+  for (int b = 0; b < n_cells; b++) {
+    bin_start(b + 1) += bin_start(b);
+  }
+  Eigen::VectorXi bin_fill = bin_start.head(n_cells);
+  for (int i = 0; i < noa; i++) {
+    int bin_index =
+        (atom_bins(i, 0) * n_bins[1] + atom_bins(i, 1)) * n_bins[2] +
+        atom_bins(i, 2);
+    bin_atoms(bin_fill(bin_index)) = i;
+    bin_fill(bin_index)++;
+  }
+
+  // Loop over the images in the bins surrounding atom i. Neighboring bins
+  // beyond the edge of the grid are mapped back into the grid, with the
+  // wrap-around recorded as a lattice translation.
+  auto sweep_bins = [&](int i, std::vector<std::array<int, 4>> &images) {
+    images.clear();
+    for (int d0 = -stencil[0]; d0 <= stencil[0]; d0++) {
+      int b0 = atom_bins(i, 0) + d0;
+      int s1 = (int)floor((double)b0 / n_bins[0]);
+      b0 -= s1 * n_bins[0];
+      for (int d1 = -stencil[1]; d1 <= stencil[1]; d1++) {
+        int b1 = atom_bins(i, 1) + d1;
+        int s2 = (int)floor((double)b1 / n_bins[1]);
+        b1 -= s2 * n_bins[1];
+        for (int d2 = -stencil[2]; d2 <= stencil[2]; d2++) {
+          int b2 = atom_bins(i, 2) + d2;
+          int s3 = (int)floor((double)b2 / n_bins[2]);
+          b2 -= s3 * n_bins[2];
+
+          int bin_index = (b0 * n_bins[1] + b1) * n_bins[2] + b2;
+          for (int k = bin_start(bin_index); k < bin_start(bin_index + 1);
+               k++) {
+            int j = bin_atoms(k);
+            double im[3];
+            for (int m = 0; m < 3; m++) {
+              im[m] = (wrapped_positions(j, m) - wrapped_positions(i, m)) +
+                      s1 * cell(0, m) + s2 * cell(1, m) + s3 * cell(2, m);
+            }
+            double dist = sqrt(im[0] * im[0] + im[1] * im[1] + im[2] * im[2]);
+            if ((dist < cutoff) && (dist != 0)) {
+              images.push_back({{j, s1, s2, s3}});
+            }
+          }
+        }
+      }
+    }
+
+    // Order the images by neighbor index and lattice translation.
+    std::sort(images.begin(), images.end());
+  };
+
+  // Count the images of each atom.
+  Eigen::VectorXi image_count(noa);
+#pragma omp parallel
+  {
+    std::vector<std::array<int, 4>> images;
+#pragma omp for
+    for (int i = 0; i < noa; i++) {
+      sweep_bins(i, images);
+      image_count(i) = images.size();
+    }
+  }
+
+  cumulative_count = Eigen::VectorXi::Zero(noa + 1);
+  for (int i = 0; i < noa; i++) {
+    cumulative_count(i + 1) = cumulative_count(i) + image_count(i);
+  }
+
+  // Store the images.
+  int n_images = cumulative_count(noa);
+  neighbor_indices = Eigen::VectorXi::Zero(n_images);
+  image_shifts = Eigen::MatrixXi::Zero(n_images, 3);
+#pragma omp parallel
+  {
+    std::vector<std::array<int, 4>> images;
+#pragma omp for
+    for (int i = 0; i < noa; i++) {
+      sweep_bins(i, images);
+      int start = cumulative_count(i);
+      for (int k = 0; k < images.size(); k++) {
+        neighbor_indices(start + k) = images[k][0];
+        for (int a = 0; a < 3; a++) {
+          image_shifts(start + k, a) = images[k][a + 1];
+        }
+      }
+    }
+  }
+}
+
+void Structure ::compute_neighbors_brute_force() {
+  neighbor_count = Eigen::VectorXi::Zero(noa);
+  cumulative_neighbor_count = Eigen::VectorXi::Zero(noa + 1);
+
   // Count the neighbors of each atom and compute the relative positions
   // of all candidate neighbors.
   int sweep_unit = 2 * sweep + 1;
@@ -166,15 +388,24 @@ double Structure ::get_single_sweep_cutoff() {
 }
 
 
+// The file is streamed, so that the matrices are not held in a JSON tree.
 void Structure ::to_json(std::string file_name, const Structure & struc){
-  std::ofstream struc_file(file_name);
-  nlohmann::json j = struc;
-  struc_file << j;
+  write_json_stream(file_name, struc);
 }
 
 Structure Structure ::from_json(std::string file_name){
-  std::ifstream struc_file(file_name);
-  nlohmann::json j;
-  struc_file >> j;
-  return j;
+  return read_json_stream<Structure>(file_name);
+}
+
+void Structure ::to_binary(std::string file_name, const Structure &struc) {
+  write_binary(file_name, struc, "Structure");
+}
+
+Structure Structure ::from_binary(std::string file_name) {
+  return read_binary<Structure>(file_name, "Structure");
+}
+
+void Structure ::json_to_binary(std::string json_file,
+                                std::string binary_file) {
+  convert_json_to_binary<Structure>(json_file, binary_file, "Structure");
 }
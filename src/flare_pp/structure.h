@@ -6,6 +6,8 @@
 #include <nlohmann/json.hpp>
 #include "json.h"
 
+class NeighborList;
+
 class Structure {
 public:
   /** @name Neighbor attributes
@@ -96,11 +98,67 @@ public:
             const Eigen::MatrixXd &positions, double cutoff,
             std::vector<Descriptor *> descriptor_calculators);
 
+  /**
+   Construct a structure using a persistent neighbor list, which is reused
+   if no atom has moved more than half its skin since it was last built.
+   */
+  Structure(const Eigen::MatrixXd &cell, const std::vector<int> &species,
+            const Eigen::MatrixXd &positions, NeighborList &neighbor_list,
+            std::vector<Descriptor *> descriptor_calculators);
+
   Eigen::MatrixXd wrap_positions();
   double get_single_sweep_cutoff();
+
+  /**
+   Compute the neighbor lists of the structure with a linked-cell search.
+   Atoms are binned on a grid commensurate with the cell, so the cost scales
+   linearly with the number of atoms. Neighbors of each atom are ordered by
+   neighbor index and then by periodic image, matching
+   compute_neighbors_brute_force.
+   */
   void compute_neighbors();
+
+  /**
+   Reference O(N^2) neighbor search that checks every pair of atoms in
+   every periodic image within the sweep.
+   */
+  void compute_neighbors_brute_force();
+
+  /**
+   Find the periodic images of all atoms lying within a cutoff of each atom.
+
+   @param cutoff Neighbor cutoff.
+   @param cumulative_count Vector of length N+1 with the cumulative number of
+        images found for each atom.
+   @param neighbor_indices Structure index of each image.
+   @param image_shifts Lattice translation (in units of the cell vectors)
+        applied to the wrapped position of each image.
+   */
+  void find_neighbor_images(double cutoff, Eigen::VectorXi &cumulative_count,
+                            Eigen::VectorXi &neighbor_indices,
+                            Eigen::MatrixXi &image_shifts) const;
+
   void compute_descriptors();
 
+  /**
+   Release the neighbor lists and descriptors of the structure, keeping the
+   cell, positions, labels and descriptor calculators needed to recompute
+   them.
+   */
+  void release_descriptors();
+
+  /**
+   Check if the descriptors have been released with release_descriptors.
+   */
+  bool descriptors_released() const;
+
+  /**
+   Return a structure with descriptors. If the descriptors of this structure
+   have been released, they are recomputed in a copy stored in buffer, which
+   is returned instead.
+   */
+  const Structure &materialize_descriptors(Structure &buffer) const;
+
   NLOHMANN_DEFINE_TYPE_INTRUSIVE(Structure, neighbor_count,
     cutoff, cumulative_neighbor_count, structure_indices, neighbor_species,
     cell, cell_transpose, cell_transpose_inverse, cell_dot, cell_dot_inverse,
@@ -111,6 +169,16 @@ public:
 
   static void to_json(std::string file_name, const Structure & struc);
   static Structure from_json(std::string file_name);
+
+  /**
+   * Write and read the structure in the binary format of binary_file.h, which
+   * stores matrices as raw blobs and is memory mapped when read.
+   */
+  static void to_binary(std::string file_name, const Structure &struc);
+  static Structure from_binary(std::string file_name);
+
+  /** Convert a file written by to_json to the binary format. */
+  static void json_to_binary(std::string json_file, std::string binary_file);
 };
 
 #endif
@@ -1,3 +1,4 @@
+#include "b2_simd.h"
 #include "b3.h"
 #include "descriptor.h"
 #include "test_structure.h"
@@ -254,3 +255,76 @@ TEST_F(StructureTest, RotationTest) {
 //     }
 //   }
 // }
+
+TEST_F(StructureTest, FusedB2) {
+  // Check that the fused B2 kernel reproduces the two-pass calculation
+  // exactly, using different cutoffs for each pair of species.
+  int n_dense = 100;
+  Eigen::MatrixXd dense_positions =
+      Eigen::MatrixXd::Random(n_dense, 3) * cell_size / 2;
+  std::vector<int> dense_species;
+  for (int i = 0; i < n_dense; i++) {
+    dense_species.push_back(rand() % n_species);
+  }
+  std::vector<Descriptor *> no_descriptors;
+  Structure dense_struc(cell, dense_species, dense_positions, cutoff,
+                        no_descriptors);
+
+  Eigen::MatrixXd cutoff_matrix(n_species, n_species);
+  cutoff_matrix << 5.0, 4.5, 4.0, 4.5, 3.5, 5.0, 4.0, 5.0, 4.8;
+  std::vector<int> settings{n_species, 6, 4};
+  B2 b2(radial_string, cutoff_string, radial_hyps, cutoff_hyps, settings,
+        cutoff_matrix);
+
+  DescriptorValues fused = b2.compute_struc(dense_struc);
+  DescriptorValues two_pass = b2.compute_struc_two_pass(dense_struc);
+
+  EXPECT_EQ(fused.n_descriptors, two_pass.n_descriptors);
+  EXPECT_EQ(fused.n_clusters_by_type, two_pass.n_clusters_by_type);
+  EXPECT_EQ(fused.n_neighbors_by_type, two_pass.n_neighbors_by_type);
+  EXPECT_EQ(fused.cumulative_type_count, two_pass.cumulative_type_count);
+  for (int s = 0; s < n_species; s++) {
+    EXPECT_EQ(fused.descriptors[s], two_pass.descriptors[s]);
+    EXPECT_EQ(fused.descriptor_force_dervs[s],
+              two_pass.descriptor_force_dervs[s]);
+    EXPECT_EQ(fused.neighbor_coordinates[s], two_pass.neighbor_coordinates[s]);
+    EXPECT_EQ(fused.descriptor_norms[s], two_pass.descriptor_norms[s]);
+    EXPECT_EQ(fused.descriptor_force_dots[s],
+              two_pass.descriptor_force_dots[s]);
+    EXPECT_EQ(fused.cutoff_values[s], two_pass.cutoff_values[s]);
+    EXPECT_EQ(fused.cutoff_dervs[s], two_pass.cutoff_dervs[s]);
+    EXPECT_EQ(fused.neighbor_counts[s], two_pass.neighbor_counts[s]);
+    EXPECT_EQ(fused.cumulative_neighbor_counts[s],
+              two_pass.cumulative_neighbor_counts[s]);
+    EXPECT_EQ(fused.atom_indices[s], two_pass.atom_indices[s]);
+    EXPECT_EQ(fused.neighbor_indices[s], two_pass.neighbor_indices[s]);
+  }
+}
+
+TEST(B2Simd, ContractionMatchesScalar) {
+  // Compare the dispatched contraction kernel with the scalar version on
+  // row counts that exercise both the vector body and the remainder loop.
+  int n_m = 9;
+  std::vector<int> row_counts{1, 7, 16, 301};
+  for (int n_rows : row_counts) {
+    int ld = n_rows + 3;
+    Eigen::VectorXd vals = Eigen::VectorXd::Random(2 * n_m);
+    Eigen::MatrixXd dervs = Eigen::MatrixXd::Random(ld, 2 * n_m);
+    Eigen::VectorXd start = Eigen::VectorXd::Random(n_rows);
+    double B2_val = 0.37;
+
+    Eigen::VectorXd simd_dervs = start, scalar_dervs = start;
+    Eigen::VectorXd simd_dots = start, scalar_dots = start;
+    contract_b2_column(n_rows, n_m, vals.data(), vals.data() + n_m, 1,
+                       dervs.data(), dervs.data() + n_m * ld, ld, B2_val,
+                       simd_dervs.data(), simd_dots.data());
+    contract_b2_column_scalar(n_rows, n_m, vals.data(), vals.data() + n_m, 1,
+                              dervs.data(), dervs.data() + n_m * ld, ld,
+                              B2_val, scalar_dervs.data(), scalar_dots.data());
+
+    for (int i = 0; i < n_rows; i++) {
+      EXPECT_NEAR(simd_dervs(i), scalar_dervs(i), 1e-12);
+      EXPECT_NEAR(simd_dots(i), scalar_dots(i), 1e-12);
+    }
+  }
+}
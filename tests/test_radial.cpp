@@ -305,10 +305,10 @@ TEST_F(RadialTest, CombDerv) {
 
   // Set the basis and cutoff function.
   std::function<void(std::vector<double> &, std::vector<double> &, double, int,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       basis_function = equispaced_gaussians;
   std::function<void(std::vector<double> &, double, double,
-                     std::vector<double>)>
+                     const std::vector<double> &)>
       cutoff_function = polynomial_cutoff;
 
   calculate_radial(g, gx, gy, gz, basis_function, cutoff_function, x, y, z, r,
@@ -76,13 +76,13 @@ TEST_F(StructureTest, SparseTest) {
   sparse_gp.add_all_environments(test_struc);
   sparse_gp.add_all_environments(test_struc_2);
 
-  EXPECT_EQ(sparse_gp.Sigma.rows(), 0);
-  EXPECT_EQ(sparse_gp.Kuu_inverse.rows(), 0);
+  EXPECT_EQ(sparse_gp.R_factor.rows(), 0);
+  EXPECT_EQ(sparse_gp.L_factor.rows(), 0);
 
   sparse_gp.update_matrices_QR();
-  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.Sigma.rows());
+  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.R_factor.rows());
   EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters,
-            sparse_gp.Kuu_inverse.rows());
+            sparse_gp.L_factor.rows());
 
   sparse_gp.predict_DTC(test_struc);
   std::vector<Eigen::VectorXd> cluster_variances =
@@ -142,9 +142,9 @@ TEST_F(StructureTest, TestAdd){
   sparse_gp.add_random_environments(test_struc, envs);
 
   sparse_gp.update_matrices_QR();
-  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.Sigma.rows());
+  EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters, sparse_gp.R_factor.rows());
   EXPECT_EQ(sparse_gp.sparse_descriptors[0].n_clusters,
-            sparse_gp.Kuu_inverse.rows());
+            sparse_gp.L_factor.rows());
 }
 
 TEST_F(StructureTest, LikeGrad) {
@@ -167,8 +167,8 @@ TEST_F(StructureTest, LikeGrad) {
   sparse_gp.add_training_structure(test_struc);
   sparse_gp.add_all_environments(test_struc);
 
-  EXPECT_EQ(sparse_gp.Sigma.rows(), 0);
-  EXPECT_EQ(sparse_gp.Kuu_inverse.rows(), 0);
+  EXPECT_EQ(sparse_gp.R_factor.rows(), 0);
+  EXPECT_EQ(sparse_gp.L_factor.rows(), 0);
 
   sparse_gp.update_matrices_QR();
 
@@ -290,15 +290,886 @@ TEST_F(StructureTest, AddOrder) {
   sparse_gp_2.update_matrices_QR();
 
   // Check that matrices match.
-  for (int i = 0; i < sparse_gp_1.Kuf.rows(); i++) {
-    for (int j = 0; j < sparse_gp_1.Kuf.cols(); j++) {
-      EXPECT_EQ(sparse_gp_1.Kuf(i, j), sparse_gp_2.Kuf(i, j));
+  Eigen::MatrixXd Kuf_1 = sparse_gp_1.stacked_Kuf();
+  Eigen::MatrixXd Kuf_2 = sparse_gp_2.stacked_Kuf();
+  for (int i = 0; i < Kuf_1.rows(); i++) {
+    for (int j = 0; j < Kuf_1.cols(); j++) {
+      EXPECT_EQ(Kuf_1(i, j), Kuf_2(i, j));
     }
   }
 
-  for (int i = 0; i < sparse_gp_1.Kuu.rows(); i++) {
-    for (int j = 0; j < sparse_gp_1.Kuu.cols(); j++) {
-      EXPECT_EQ(sparse_gp_1.Kuu(i, j), sparse_gp_2.Kuu(i, j));
+  Eigen::MatrixXd Kuu_1 = sparse_gp_1.stacked_Kuu();
+  Eigen::MatrixXd Kuu_2 = sparse_gp_2.stacked_Kuu();
+  for (int i = 0; i < Kuu_1.rows(); i++) {
+    for (int j = 0; j < Kuu_1.cols(); j++) {
+      EXPECT_EQ(Kuu_1(i, j), Kuu_2(i, j));
     }
   }
 }
+
+TEST_F(StructureTest, CompactForceDervs) {
+  // Check that storing the training force derivatives in single precision
+  // reproduces the double precision model to float accuracy.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels;
+  kernels.push_back(&kernel_norm);
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  SparseGP compact_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  compact_gp.compact_force_dervs = true;
+
+  test_struc.energy = Eigen::VectorXd::Random(1);
+  test_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  test_struc.stresses = Eigen::VectorXd::Random(6);
+
+  // Add sparse environments after the structure, so that Kuf is also
+  // updated from the stored compact structure.
+  std::vector<int> first_atoms{0, 1, 2}, last_atoms{3, 4};
+  for (SparseGP *gp : {&sparse_gp, &compact_gp}) {
+    gp->add_training_structure(test_struc);
+    gp->add_specific_environments(test_struc, first_atoms);
+    gp->add_specific_environments(test_struc, last_atoms);
+    gp->update_matrices_QR();
+  }
+
+  const DescriptorValues &stored =
+      compact_gp.training_structures[0].descriptors[0];
+  EXPECT_TRUE(stored.compact);
+  for (int s = 0; s < stored.n_types; s++) {
+    EXPECT_EQ(stored.descriptor_force_dervs[s].size(), 0);
+    EXPECT_EQ(stored.compact_force_dervs[s].rows(),
+              test_struc.descriptors[0].descriptor_force_dervs[s].rows());
+  }
+
+  double Kuf_max = sparse_gp.stacked_Kuf().cwiseAbs().maxCoeff();
+  double Kuf_diff = (sparse_gp.stacked_Kuf() - compact_gp.stacked_Kuf())
+                        .cwiseAbs()
+                        .maxCoeff();
+  EXPECT_LE(Kuf_diff, 1e-5 * Kuf_max);
+
+  Structure pred_1 = test_struc, pred_2 = test_struc;
+  sparse_gp.predict_mean(pred_1);
+  compact_gp.predict_mean(pred_2);
+  double mean_max = pred_1.mean_efs.cwiseAbs().maxCoeff();
+  double mean_diff = (pred_1.mean_efs - pred_2.mean_efs).cwiseAbs().maxCoeff();
+  EXPECT_LE(mean_diff, 1e-4 * mean_max);
+
+  // Compact descriptors survive a JSON round trip.
+  nlohmann::json j = stored;
+  DescriptorValues loaded = j;
+  EXPECT_TRUE(loaded.compact);
+  for (int s = 0; s < stored.n_types; s++) {
+    EXPECT_EQ(loaded.compact_force_dervs[s], stored.compact_force_dervs[s]);
+  }
+
+  // The setting survives a JSON round trip of the model. Only B2
+  // descriptors can be written to JSON files.
+  std::vector<Descriptor *> b2_calcs{&ps};
+  Structure b2_struc(cell, species, positions, cutoff, b2_calcs);
+  b2_struc.forces = test_struc.forces;
+  SparseGP saved_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  saved_gp.compact_force_dervs = true;
+  saved_gp.add_training_structure(b2_struc);
+  saved_gp.add_specific_environments(b2_struc, first_atoms);
+  saved_gp.update_matrices_QR();
+
+  std::string gp_file = temp_file("compact_gp.json");
+  SparseGP::to_json(gp_file, saved_gp);
+  SparseGP loaded_gp = SparseGP::from_json(gp_file);
+  std::remove(gp_file.c_str());
+  EXPECT_TRUE(loaded_gp.compact_force_dervs);
+}
+
+TEST_F(StructureTest, FrozenHyperparameters) {
+  // Check that releasing the descriptors of training structures and
+  // recomputing them on demand reproduces the standard model.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels;
+  kernels.push_back(&kernel_norm);
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  SparseGP frozen_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  frozen_gp.frozen_hyperparameters = true;
+
+  test_struc.energy = Eigen::VectorXd::Random(1);
+  test_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  test_struc.stresses = Eigen::VectorXd::Random(6);
+  test_struc_3.energy = Eigen::VectorXd::Random(1);
+  test_struc_3.forces = Eigen::VectorXd::Random(n_atoms * 3);
+
+  std::vector<int> first_atoms{0, 1, 2}, last_atoms{3, 4};
+  for (SparseGP *gp : {&sparse_gp, &frozen_gp}) {
+    gp->add_training_structure(test_struc);
+    gp->add_specific_environments(test_struc, first_atoms);
+    gp->add_training_structure(test_struc_3);
+    gp->add_specific_environments(test_struc, last_atoms);
+    gp->update_matrices_QR();
+  }
+
+  for (int i = 0; i < frozen_gp.n_strucs; i++) {
+    EXPECT_TRUE(frozen_gp.training_structures[i].descriptors_released());
+    EXPECT_EQ(frozen_gp.training_structures[i].relative_positions.size(), 0);
+  }
+  EXPECT_EQ(sparse_gp.stacked_Kuf(), frozen_gp.stacked_Kuf());
+
+  // Changing the hyperparameters recomputes the descriptors.
+  Eigen::VectorXd new_hyps = sparse_gp.hyperparameters;
+  new_hyps(0) *= 1.5;
+  new_hyps(new_hyps.size() - 2) *= 0.5;
+  sparse_gp.set_hyperparameters(new_hyps);
+  frozen_gp.set_hyperparameters(new_hyps);
+  EXPECT_EQ(sparse_gp.stacked_Kuf(), frozen_gp.stacked_Kuf());
+  EXPECT_EQ(sparse_gp.alpha, frozen_gp.alpha);
+
+  double like = sparse_gp.compute_likelihood_gradient(new_hyps);
+  double frozen_like = frozen_gp.compute_likelihood_gradient(new_hyps);
+  EXPECT_EQ(like, frozen_like);
+  EXPECT_EQ(sparse_gp.likelihood_gradient, frozen_gp.likelihood_gradient);
+  EXPECT_TRUE(frozen_gp.training_structures[0].descriptors_released());
+
+  // A reloaded model stays frozen and releases the descriptors of new
+  // structures. Only B2 descriptors can be written to JSON files.
+  std::vector<Descriptor *> b2_calcs{&ps};
+  Structure b2_struc(cell, species, positions, cutoff, b2_calcs);
+  b2_struc.forces = test_struc.forces;
+  SparseGP saved_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  saved_gp.frozen_hyperparameters = true;
+  saved_gp.add_training_structure(b2_struc);
+  saved_gp.add_specific_environments(b2_struc, first_atoms);
+  saved_gp.update_matrices_QR();
+
+  std::string gp_file = temp_file("frozen_gp.json");
+  SparseGP::to_json(gp_file, saved_gp);
+  SparseGP loaded_gp = SparseGP::from_json(gp_file);
+  std::remove(gp_file.c_str());
+  EXPECT_TRUE(loaded_gp.frozen_hyperparameters);
+  loaded_gp.add_training_structure(b2_struc);
+  EXPECT_TRUE(loaded_gp.training_structures[1].descriptors_released());
+}
+
+TEST_F(StructureTest, IncrementalQR) {
+  // Check that appending labels and sparse environments to the stored QR
+  // factors reproduces the solution of a full refactorization.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels;
+  kernels.push_back(&kernel_norm);
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+
+  std::vector<Structure> strucs{test_struc, test_struc_3, test_struc};
+  for (int i = 0; i < strucs.size(); i++) {
+    strucs[i].energy = Eigen::VectorXd::Random(1);
+    strucs[i].forces = Eigen::VectorXd::Random(n_atoms * 3);
+    strucs[i].stresses = Eigen::VectorXd::Random(6);
+  }
+
+  // Alternate between adding labels only, sparse environments only, and
+  // both, updating the solution after each step.
+  std::vector<int> atoms_1{0, 1, 2, 5}, atoms_2{3, 4}, atoms_3{6, 7};
+  sparse_gp.add_training_structure(strucs[0]);
+  sparse_gp.add_specific_environments(strucs[0], atoms_1);
+  sparse_gp.update_matrices_QR();
+  sparse_gp.add_training_structure(strucs[1]);
+  sparse_gp.update_matrices_QR();
+  sparse_gp.add_specific_environments(strucs[0], atoms_2);
+  sparse_gp.update_matrices_QR();
+  sparse_gp.add_training_structure(strucs[2]);
+  sparse_gp.add_specific_environments(strucs[1], atoms_3);
+  sparse_gp.update_matrices_QR();
+
+  SparseGP full_gp = sparse_gp;
+  full_gp.factor_valid = false;
+  full_gp.update_matrices_QR();
+
+  double thresh = 1e-8;
+  Eigen::MatrixXd Sigma = sparse_gp.compute_Sigma();
+  Eigen::MatrixXd full_Sigma = full_gp.compute_Sigma();
+  Eigen::MatrixXd Kuu_inverse = sparse_gp.compute_Kuu_inverse();
+  Eigen::MatrixXd full_Kuu_inverse = full_gp.compute_Kuu_inverse();
+  double alpha_max = full_gp.alpha.cwiseAbs().maxCoeff();
+  double Sigma_max = full_Sigma.cwiseAbs().maxCoeff();
+  double Kuu_inv_max = full_Kuu_inverse.cwiseAbs().maxCoeff();
+  EXPECT_LE((sparse_gp.alpha - full_gp.alpha).cwiseAbs().maxCoeff(),
+            thresh * alpha_max);
+  EXPECT_LE((Sigma - full_Sigma).cwiseAbs().maxCoeff(), thresh * Sigma_max);
+  EXPECT_LE((Kuu_inverse - full_Kuu_inverse).cwiseAbs().maxCoeff(),
+            thresh * Kuu_inv_max);
+
+  sparse_gp.compute_likelihood_stable();
+  full_gp.compute_likelihood_stable();
+  EXPECT_NEAR(sparse_gp.log_marginal_likelihood,
+              full_gp.log_marginal_likelihood,
+              thresh * abs(full_gp.log_marginal_likelihood));
+
+  // Local uncertainties are computed per kernel with the Cholesky factor.
+  std::vector<Eigen::VectorXd> variances =
+      sparse_gp.compute_cluster_uncertainties(test_struc_3);
+  std::vector<Eigen::VectorXd> full_variances =
+      full_gp.compute_cluster_uncertainties(test_struc_3);
+  for (int i = 0; i < variances[0].size(); i++) {
+    EXPECT_NEAR(variances[0](i), full_variances[0](i), 1e-8);
+  }
+}
+
+TEST_F(StructureTest, FactorSolves) {
+  // Check that the variances computed with triangular solves match the
+  // explicit inverses of Kuu and Sigma.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels;
+  kernels.push_back(&kernel_norm);
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+
+  // Use the B2 descriptor, which can be written to JSON.
+  std::vector<Descriptor *> b2_calculators{&ps};
+  Structure train_struc(cell, species, positions, cutoff, b2_calculators);
+  Structure pred_struc(cell_3, species_3, positions_3, cutoff,
+                       b2_calculators);
+  train_struc.energy = Eigen::VectorXd::Random(1);
+  train_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  train_struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(train_struc);
+  sparse_gp.add_all_environments(train_struc);
+  sparse_gp.update_matrices_QR();
+
+  sparse_gp.predict_DTC(pred_struc);
+
+  Eigen::MatrixXd kernel_mat = kernel_norm.envs_struc(
+      sparse_gp.sparse_descriptors[0], pred_struc.descriptors[0],
+      kernel_norm.kernel_hyperparameters);
+  Eigen::VectorXd K_self = kernel_norm.self_kernel_struc(
+      pred_struc.descriptors[0], kernel_norm.kernel_hyperparameters);
+  Eigen::VectorXd variance =
+      K_self -
+      (kernel_mat.transpose() * sparse_gp.compute_Kuu_inverse() * kernel_mat)
+          .diagonal() +
+      (kernel_mat.transpose() * sparse_gp.compute_Sigma() * kernel_mat)
+          .diagonal();
+
+  for (int i = 0; i < variance.size(); i++) {
+    EXPECT_NEAR(pred_struc.variance_efs(i), variance(i), 1e-8);
+  }
+
+  // The factors are stored with the model, so that the loaded model is not
+  // refactored.
+  std::string file = temp_file("sparse_gp_factors.json");
+  SparseGP::to_json(file, sparse_gp);
+  SparseGP loaded = SparseGP::from_json(file);
+  std::remove(file.c_str());
+  EXPECT_TRUE(loaded.factor_valid);
+  EXPECT_EQ(loaded.n_factor_labels, sparse_gp.n_factor_labels);
+  EXPECT_EQ(loaded.factor_jitter, sparse_gp.factor_jitter);
+  EXPECT_EQ(loaded.factor_clusters, sparse_gp.factor_clusters);
+  EXPECT_EQ(loaded.R_factor, sparse_gp.R_factor);
+  EXPECT_EQ(loaded.L_factor, sparse_gp.L_factor);
+  EXPECT_EQ(loaded.Q_b_factor, sparse_gp.Q_b_factor);
+  EXPECT_EQ(loaded.alpha, sparse_gp.alpha);
+
+  // The loaded model is extended incrementally, as the original.
+  loaded.add_training_structure(pred_struc);
+  loaded.add_all_environments(pred_struc);
+  sparse_gp.add_training_structure(pred_struc);
+  sparse_gp.add_all_environments(pred_struc);
+  loaded.update_matrices_QR();
+  sparse_gp.update_matrices_QR();
+  for (int i = 0; i < sparse_gp.alpha.size(); i++) {
+    EXPECT_NEAR(loaded.alpha(i), sparse_gp.alpha(i),
+                1e-10 * sparse_gp.alpha.cwiseAbs().maxCoeff());
+  }
+
+  // Files without the factors are refactored when they are read.
+  sparse_gp.factor_valid = false;
+  SparseGP::to_json(file, sparse_gp);
+  SparseGP refactored = SparseGP::from_json(file);
+  std::remove(file.c_str());
+  EXPECT_TRUE(refactored.factor_valid);
+  for (int i = 0; i < sparse_gp.alpha.size(); i++) {
+    EXPECT_NEAR(refactored.alpha(i), sparse_gp.alpha(i),
+                1e-10 * sparse_gp.alpha.cwiseAbs().maxCoeff());
+  }
+}
+
+TEST_F(StructureTest, BatchPredict) {
+  // Check that batched predictions match predictions made one structure at
+  // a time.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels;
+  kernels.push_back(&kernel_norm);
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+
+  test_struc.energy = Eigen::VectorXd::Random(1);
+  test_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  test_struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(test_struc);
+  sparse_gp.add_all_environments(test_struc);
+  sparse_gp.update_matrices_QR();
+
+  std::vector<Structure> singles{test_struc, test_struc_3, test_struc};
+  std::vector<Structure> batch = singles;
+  std::vector<Structure *> batch_pointers;
+  for (int i = 0; i < batch.size(); i++) {
+    batch_pointers.push_back(&batch[i]);
+  }
+
+  sparse_gp.predict_DTC(batch_pointers);
+  for (int i = 0; i < singles.size(); i++) {
+    sparse_gp.predict_DTC(singles[i]);
+    for (int j = 0; j < singles[i].mean_efs.size(); j++) {
+      EXPECT_NEAR(batch[i].mean_efs(j), singles[i].mean_efs(j), 1e-10);
+      EXPECT_NEAR(batch[i].variance_efs(j), singles[i].variance_efs(j),
+                  1e-10);
+    }
+  }
+
+  sparse_gp.predict_local_uncertainties(batch_pointers);
+  for (int i = 0; i < singles.size(); i++) {
+    sparse_gp.predict_local_uncertainties(singles[i]);
+    EXPECT_EQ(batch[i].local_uncertainties[0],
+              singles[i].local_uncertainties[0]);
+  }
+}
+
+TEST_F(StructureTest, DiagonalVariance) {
+  // Check the linear-cost kernel diagonals.
+  ClusterDescriptor envs(test_struc.descriptors[0]);
+  NormalizedDotProduct kernel_sq(sigma, 2);
+  std::vector<Kernel *> test_kernels{&kernel_norm, &kernel_sq, &kernel};
+  for (Kernel *test_kernel : test_kernels) {
+    Eigen::VectorXd diagonal = test_kernel->envs_envs_diagonal(
+        envs, test_kernel->kernel_hyperparameters);
+    Eigen::MatrixXd full =
+        test_kernel->envs_envs(envs, envs, test_kernel->kernel_hyperparameters);
+    for (int i = 0; i < diagonal.size(); i++) {
+      EXPECT_NEAR(diagonal(i), full(i, i), 1e-12);
+    }
+  }
+
+  // Compare DTC variances of a large cell with the quadratic-memory
+  // formulation that forms the full n_out x n_out products.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels;
+  kernels.push_back(&kernel_norm);
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  std::vector<Descriptor *> b2_calcs{&ps};
+  Structure train_struc(cell, species, positions, cutoff, b2_calcs);
+  train_struc.energy = Eigen::VectorXd::Random(1);
+  train_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  train_struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(train_struc);
+  sparse_gp.add_all_environments(train_struc);
+  sparse_gp.update_matrices_QR();
+
+  Structure large_struc = random_structure(300, b2_calcs);
+
+  sparse_gp.predict_DTC(large_struc);
+
+  Eigen::MatrixXd Kuu_inverse = sparse_gp.compute_Kuu_inverse();
+  Eigen::MatrixXd Sigma = sparse_gp.compute_Sigma();
+  Eigen::VectorXd K_self = kernel_norm.self_kernel_struc(
+      large_struc.descriptors[0], kernel_norm.kernel_hyperparameters);
+  Eigen::MatrixXd kernel_mat = kernel_norm.envs_struc(
+      sparse_gp.sparse_descriptors[0], large_struc.descriptors[0],
+      kernel_norm.kernel_hyperparameters);
+  Eigen::VectorXd full_variance =
+      K_self - (kernel_mat.transpose() * Kuu_inverse * kernel_mat).diagonal() +
+      (kernel_mat.transpose() * Sigma * kernel_mat).diagonal();
+
+  for (int i = 0; i < full_variance.size(); i++) {
+    EXPECT_NEAR(large_struc.variance_efs(i), full_variance(i), 1e-8);
+  }
+}
+
+TEST_F(StructureTest, TiledKuf) {
+  // Check the tiled assembly of Kuf against kernels computed directly, for
+  // two kernels, structures of different sizes and released descriptors.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  B2 ps_2 = ps;
+  std::vector<Descriptor *> b2_calcs{&ps, &ps_2};
+  std::vector<Kernel *> kernels{&kernel_norm, &kernel};
+
+  std::vector<Structure> strucs;
+  std::vector<int> sizes{10, 40, 5};
+  for (int n : sizes) {
+    Structure struc = random_structure(n, b2_calcs);
+    struc.energy = Eigen::VectorXd::Random(1);
+    struc.forces = Eigen::VectorXd::Random(n * 3);
+    struc.stresses = Eigen::VectorXd::Random(6);
+    strucs.push_back(struc);
+  }
+
+  for (int frozen = 0; frozen < 2; frozen++) {
+    SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+    sparse_gp.frozen_hyperparameters = frozen;
+    sparse_gp.add_training_structure(strucs[0]);
+    sparse_gp.add_specific_environments(strucs[0], {0, 1, 2});
+    sparse_gp.add_training_structure(strucs[1]);
+    sparse_gp.add_training_structure(strucs[2]);
+    sparse_gp.add_all_environments(strucs[1]);
+
+    for (int i = 0; i < kernels.size(); i++) {
+      for (int j = 0; j < strucs.size(); j++) {
+        Eigen::MatrixXd envs_struc = kernels[i]->envs_struc(
+            sparse_gp.sparse_descriptors[i], strucs[j].descriptors[i],
+            kernels[i]->kernel_hyperparameters);
+        Eigen::MatrixXd tiled = sparse_gp.Kuf_kernels[i].middle_cols(
+            sparse_gp.label_count(j), envs_struc.cols());
+        EXPECT_LT((tiled - envs_struc).cwiseAbs().maxCoeff(), 1e-10);
+      }
+    }
+  }
+}
+
+TEST_F(StructureTest, ChunkedKuf) {
+  // Check that adding a training structure appends its Kuf columns without
+  // moving the existing chunks, and that the chunked Kuf matches the kernels
+  // computed directly.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels{&kernel_norm};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  test_struc.energy = Eigen::VectorXd::Random(1);
+  test_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  test_struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(test_struc);
+  sparse_gp.add_specific_environments(test_struc, {0, 1, 2});
+
+  int n_frames = 32;
+  for (int n = 1; n < n_frames; n++) {
+    std::vector<const double *> chunk_data;
+    const ChunkedMatrix &Kuf = sparse_gp.Kuf_kernels[0];
+    for (int c = 0; c < Kuf.n_chunks(); c++) {
+      chunk_data.push_back(Kuf.chunks[c].data());
+    }
+
+    sparse_gp.add_training_structure(test_struc);
+    for (int c = 0; c < chunk_data.size(); c++) {
+      EXPECT_EQ(Kuf.chunks[c].data(), chunk_data[c]);
+    }
+  }
+  // The spare columns of the last chunk are bounded by the chunk capacity.
+  const ChunkedMatrix &Kuf_chunks = sparse_gp.Kuf_kernels[0];
+  int n_last = Kuf_chunks.n_chunks() - 1;
+  EXPECT_GT(n_last, 0);
+  EXPECT_LT(Kuf_chunks.chunks[n_last].cols() - Kuf_chunks.chunk_cols[n_last],
+            ChunkedMatrix::chunk_capacity);
+
+  // Adding sparse environments moves the rows of every chunk.
+  sparse_gp.add_specific_environments(test_struc, {3, 4});
+  Eigen::MatrixXd envs_struc =
+      kernel_norm.envs_struc(sparse_gp.sparse_descriptors[0],
+                             test_struc.descriptors[0],
+                             kernel_norm.kernel_hyperparameters);
+  Eigen::MatrixXd Kuf = sparse_gp.Kuf_kernels[0].dense();
+  EXPECT_EQ(Kuf.cols(), n_frames * envs_struc.cols());
+  for (int n = 0; n < n_frames; n++) {
+    Eigen::MatrixXd block =
+        Kuf.middleCols(sparse_gp.label_count(n), envs_struc.cols());
+    EXPECT_LT((block - envs_struc).cwiseAbs().maxCoeff(), 1e-10);
+  }
+  EXPECT_EQ(sparse_gp.stacked_Kuf(), Kuf);
+
+  // The chunked matrix is serialized as a dense matrix.
+  nlohmann::json j = sparse_gp.Kuf_kernels[0];
+  ChunkedMatrix Kuf_json = j;
+  EXPECT_EQ(Kuf_json.n_chunks(), 1);
+  EXPECT_EQ(Kuf_json.dense(), Kuf);
+}
+
+TEST_F(StructureTest, BlockDiagonalKuu) {
+  // Check the solution of a model with two kernels, which is computed from
+  // the kernel matrices, against the stacked Kuu and Kuf.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  B2 ps_2 = ps;
+  std::vector<Descriptor *> b2_calcs{&ps, &ps_2};
+  std::vector<Kernel *> kernels{&kernel_norm, &kernel};
+  std::vector<Structure> strucs;
+  for (int n = 0; n < 3; n++) {
+    Eigen::MatrixXd struc_positions =
+        Eigen::MatrixXd::Random(n_atoms, 3) * cell_size / 2;
+    Structure struc(cell, species, struc_positions, cutoff, b2_calcs);
+    struc.energy = Eigen::VectorXd::Random(1);
+    struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+    struc.stresses = Eigen::VectorXd::Random(6);
+    strucs.push_back(struc);
+  }
+
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  sparse_gp.add_training_structure(strucs[0]);
+  sparse_gp.add_specific_environments(strucs[0], {0, 1, 2});
+  sparse_gp.update_matrices_QR();
+  sparse_gp.add_training_structure(strucs[1]);
+  sparse_gp.add_specific_environments(strucs[1], {3, 4});
+  sparse_gp.update_matrices_QR();
+  sparse_gp.add_training_structure(strucs[2]);
+  sparse_gp.update_matrices_QR();
+
+  Eigen::MatrixXd Kuu = sparse_gp.stacked_Kuu();
+  Eigen::MatrixXd Kuf = sparse_gp.stacked_Kuf();
+  int n_sparse_1 = sparse_gp.Kuu_kernels[0].rows();
+  int n_sparse_2 = sparse_gp.Kuu_kernels[1].rows();
+  EXPECT_EQ(Kuu.block(0, n_sparse_1, n_sparse_1, n_sparse_2).norm(), 0);
+  EXPECT_EQ(Kuf.bottomRows(n_sparse_2), sparse_gp.Kuf_kernels[1].dense());
+
+  Eigen::MatrixXd Sigma_inv =
+      Kuu + sparse_gp.Kuu_jitter * Eigen::MatrixXd::Identity(Kuu.rows(),
+                                                             Kuu.cols()) +
+      Kuf * sparse_gp.noise_vector.asDiagonal() * Kuf.transpose();
+  Eigen::VectorXd alpha = Sigma_inv.ldlt().solve(
+      Kuf * sparse_gp.noise_vector.asDiagonal() * sparse_gp.y);
+  double alpha_max = alpha.cwiseAbs().maxCoeff();
+  EXPECT_LE((sparse_gp.alpha - alpha).cwiseAbs().maxCoeff(), 1e-6 * alpha_max);
+
+  SparseGP full_gp = sparse_gp;
+  full_gp.factor_valid = false;
+  full_gp.update_matrices_QR();
+  EXPECT_LE((sparse_gp.alpha - full_gp.alpha).cwiseAbs().maxCoeff(),
+            1e-8 * alpha_max);
+}
+
+TEST_F(StructureTest, LikeGradTwoKernels) {
+  // Check the likelihood gradient of a model with two kernels against
+  // finite differences and the likelihood computed from the full Qff.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  B2 ps_2 = ps;
+  std::vector<Descriptor *> b2_calcs{&ps, &ps_2};
+  std::vector<Kernel *> kernels{&kernel_norm, &kernel};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  for (int n = 0; n < 2; n++) {
+    Eigen::MatrixXd struc_positions =
+        Eigen::MatrixXd::Random(n_atoms, 3) * cell_size / 2;
+    Structure struc(cell, species, struc_positions, cutoff, b2_calcs);
+    struc.energy = Eigen::VectorXd::Random(1);
+    struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+    struc.stresses = Eigen::VectorXd::Random(6);
+    sparse_gp.add_training_structure(struc);
+    sparse_gp.add_specific_environments(struc, {0, 1, 2, 3});
+  }
+  sparse_gp.update_matrices_QR();
+
+  Eigen::VectorXd hyps = sparse_gp.hyperparameters;
+  double like = sparse_gp.compute_likelihood_gradient(hyps);
+  Eigen::VectorXd like_grad = sparse_gp.likelihood_gradient;
+
+  sparse_gp.compute_likelihood();
+  EXPECT_NEAR(like, sparse_gp.log_marginal_likelihood, 1e-6 * abs(like));
+
+  double pert = 1e-4;
+  for (int i = 0; i < hyps.size(); i++) {
+    Eigen::VectorXd hyps_up = hyps, hyps_down = hyps;
+    hyps_up(i) += pert;
+    hyps_down(i) -= pert;
+    double like_up = sparse_gp.compute_likelihood_gradient(hyps_up);
+    double like_down = sparse_gp.compute_likelihood_gradient(hyps_down);
+    double fin_diff = (like_up - like_down) / (2 * pert);
+    EXPECT_NEAR(like_grad(i), fin_diff, 1e-6 * std::max(1., abs(fin_diff)));
+  }
+}
+
+TEST_F(StructureTest, CachedKernelGradients) {
+  // Check that the cached ICM kernels give the same Kuu and Kuf gradients
+  // as recomputing them, before and after the training set changes.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  NormalizedDotProduct_ICM kernel_icm(2.0, 2, icm_coeffs);
+  std::vector<Kernel *> kernels{&kernel_icm};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  test_struc.energy = Eigen::VectorXd::Random(1);
+  test_struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  test_struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(test_struc);
+  sparse_gp.add_specific_environments(test_struc, {0, 1, 2, 3});
+
+  Eigen::VectorXd new_hyps = kernel_icm.kernel_hyperparameters;
+  std::vector<const Structure *> strucs;
+  for (int step = 0; step < 2; step++) {
+    strucs.clear();
+    for (int s = 0; s < sparse_gp.n_strucs; s++)
+      strucs.push_back(&sparse_gp.training_structures[s]);
+    for (int n = 0; n < 2; n++) {
+      new_hyps = new_hyps.array() * 1.1;
+      const ClusterDescriptor &envs = sparse_gp.sparse_descriptors[0];
+      const ChunkedMatrix &Kuf = sparse_gp.Kuf_kernels[0];
+
+      long long generation = sparse_gp.cache_generation;
+      std::vector<Eigen::MatrixXd> Kuu_grad = kernel_icm.Kuu_grad(
+          envs, sparse_gp.Kuu_kernels[0], new_hyps, generation);
+      std::vector<Eigen::MatrixXd> Kuu_grad_ref =
+          kernel_icm.envs_envs_grad(envs, envs, new_hyps);
+      std::vector<Eigen::MatrixXd> Kuf_grad = kernel_icm.Kuf_grad(
+          envs, strucs, 0, Kuf, new_hyps, generation);
+      std::vector<Eigen::MatrixXd> Kuf_grad_ref = kernel_icm.Kernel::Kuf_grad(
+          envs, strucs, 0, Kuf, new_hyps, -1);
+      EXPECT_EQ(kernel_icm.Kuf_key.generation, generation);
+
+      EXPECT_EQ(Kuu_grad.size(), Kuu_grad_ref.size());
+      EXPECT_EQ(Kuf_grad.size(), Kuf_grad_ref.size());
+      for (int i = 0; i < Kuu_grad.size(); i++) {
+        double Kuu_max = Kuu_grad_ref[i].cwiseAbs().maxCoeff();
+        double Kuf_max = Kuf_grad_ref[i].cwiseAbs().maxCoeff();
+        EXPECT_LE((Kuu_grad[i] - Kuu_grad_ref[i]).cwiseAbs().maxCoeff(),
+                  1e-10 * Kuu_max);
+        EXPECT_LE((Kuf_grad[i] - Kuf_grad_ref[i]).cwiseAbs().maxCoeff(),
+                  1e-10 * Kuf_max);
+      }
+    }
+
+    // Changing the training set and the sparse set invalidates the cache.
+    long long generation = sparse_gp.cache_generation;
+    sparse_gp.add_training_structure(test_struc_2);
+    EXPECT_NE(sparse_gp.cache_generation, generation);
+    generation = sparse_gp.cache_generation;
+    sparse_gp.add_specific_environments(test_struc, {4, 5});
+    EXPECT_NE(sparse_gp.cache_generation, generation);
+  }
+
+  // Sets that aren't cached leave the cache alone, and clearing releases it.
+  strucs.clear();
+  for (int s = 0; s < sparse_gp.n_strucs; s++)
+    strucs.push_back(&sparse_gp.training_structures[s]);
+  long long generation = kernel_icm.Kuf_key.generation;
+  kernel_icm.Kuf_grad(sparse_gp.sparse_descriptors[0], strucs, 0,
+                      sparse_gp.Kuf_kernels[0], new_hyps, -1);
+  EXPECT_EQ(kernel_icm.Kuf_key.generation, generation);
+  sparse_gp.clear_kernel_caches();
+  EXPECT_TRUE(kernel_icm.Kuf_basis.empty());
+  EXPECT_TRUE(kernel_icm.Kuu_basis.empty());
+  EXPECT_FALSE(kernel_icm.Kuf_key.valid());
+
+  // Setting the hyperparameters directly doesn't fill the cache.
+  sparse_gp.set_hyperparameters(sparse_gp.hyperparameters);
+  EXPECT_TRUE(kernel_icm.Kuf_basis.empty());
+  EXPECT_TRUE(kernel_icm.Kuu_basis.empty());
+}
+
+TEST_F(StructureTest, BatchLikelihoodGradient) {
+  // Check the likelihood of a batch against a model trained on the batch
+  // alone, and the stochastic trace estimate against the exact gradient.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels{&kernel};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  SparseGP batch_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  std::vector<Descriptor *> b2_calcs{&ps};
+  for (int n = 0; n < 3; n++) {
+    Eigen::MatrixXd struc_positions =
+        Eigen::MatrixXd::Random(n_atoms, 3) * cell_size / 2;
+    Structure struc(cell, species, struc_positions, cutoff, b2_calcs);
+    struc.energy = Eigen::VectorXd::Random(1);
+    struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+    struc.stresses = Eigen::VectorXd::Random(6);
+    sparse_gp.add_training_structure(struc);
+    sparse_gp.add_specific_environments(struc, {0, 1, 2});
+    if (n < 2)
+      batch_gp.add_training_structure(struc);
+    batch_gp.add_specific_environments(struc, {0, 1, 2});
+  }
+  sparse_gp.update_matrices_QR();
+  Eigen::VectorXd hyps = sparse_gp.hyperparameters;
+
+  // The batch model has the same sparse environments but only the labels of
+  // the first two structures.
+  // Repeated indices are counted once, so a batch with as many indices as
+  // the training set can still be a subset of it.
+  double like = sparse_gp.compute_batch_likelihood_gradient(hyps, {1, 0, 1});
+  Eigen::VectorXd like_grad = sparse_gp.likelihood_gradient;
+  double batch_like = batch_gp.compute_likelihood_gradient(hyps);
+  EXPECT_NEAR(like, batch_like, 1e-8 * abs(like));
+  for (int i = 0; i < hyps.size(); i++) {
+    EXPECT_NEAR(like_grad(i), batch_gp.likelihood_gradient(i),
+                1e-8 * std::max(1., abs(like_grad(i))));
+  }
+  EXPECT_THROW(sparse_gp.compute_batch_likelihood_gradient(hyps, {0, 3}),
+               std::runtime_error);
+  EXPECT_THROW(sparse_gp.compute_batch_likelihood_gradient(hyps, {-1}),
+               std::runtime_error);
+  EXPECT_THROW(sparse_gp.compute_batch_likelihood_gradient(hyps, {}),
+               std::runtime_error);
+
+  // Hutchinson's estimate is unbiased, so it converges to the exact
+  // gradient as the number of probes grows.
+  like = sparse_gp.compute_likelihood_gradient(hyps);
+  like_grad = sparse_gp.likelihood_gradient;
+  double est_like =
+      sparse_gp.compute_batch_likelihood_gradient(hyps, {0, 1, 2}, 20000);
+  Eigen::VectorXd est_grad = sparse_gp.likelihood_gradient;
+  EXPECT_NEAR(like, est_like, 1e-8 * abs(like));
+  EXPECT_LT((est_grad - like_grad).norm(), 0.05 * like_grad.norm());
+}
+
+TEST_F(StructureTest, AdamOptimizer) {
+  // Check that mini-batch Adam steps increase the likelihood.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels{&kernel};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  std::vector<Descriptor *> b2_calcs{&ps};
+  for (int n = 0; n < 4; n++) {
+    Eigen::MatrixXd struc_positions =
+        Eigen::MatrixXd::Random(n_atoms, 3) * cell_size / 2;
+    Structure struc(cell, species, struc_positions, cutoff, b2_calcs);
+    struc.energy = Eigen::VectorXd::Random(1);
+    struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+    struc.stresses = Eigen::VectorXd::Random(6);
+    sparse_gp.add_training_structure(struc);
+    sparse_gp.add_specific_environments(struc, {0, 1, 2});
+  }
+  sparse_gp.update_matrices_QR();
+
+  Eigen::VectorXd hyps = sparse_gp.hyperparameters;
+  double like = sparse_gp.compute_likelihood_gradient(hyps);
+  Eigen::VectorXd new_hyps =
+      sparse_gp.optimize_hyperparameters_adam(50, 2, 0.05, 10);
+  double new_like = sparse_gp.compute_likelihood_gradient(new_hyps);
+
+  EXPECT_GT(new_like, like);
+  EXPECT_EQ(new_hyps, sparse_gp.hyperparameters);
+  EXPECT_EQ(new_hyps(hyps.size() - 1), sparse_gp.stress_noise);
+}
+
+TEST_F(StructureTest, BinaryFile) {
+  // Check that models and structures written in the binary format, directly
+  // or converted from JSON, match the originals.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels{&kernel_norm};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  std::vector<Descriptor *> b2_calcs{&ps};
+  Structure struc(cell, species, positions, cutoff, b2_calcs);
+  struc.energy = Eigen::VectorXd::Random(1);
+  struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(struc);
+  sparse_gp.add_specific_environments(struc, {0, 1, 2, 3});
+  sparse_gp.update_matrices_QR();
+
+  std::string json_file = temp_file("sparse_gp.json");
+  std::string binary_file = temp_file("sparse_gp.bin");
+  std::string converted_file = temp_file("sparse_gp_converted.bin");
+  SparseGP::to_binary(binary_file, sparse_gp);
+  SparseGP::to_json(json_file, sparse_gp);
+  SparseGP::json_to_binary(json_file, converted_file);
+  for (std::string file : {binary_file, converted_file}) {
+    SparseGP loaded = SparseGP::from_binary(file);
+    EXPECT_EQ(loaded.hyperparameters, sparse_gp.hyperparameters);
+    EXPECT_EQ(loaded.Kuf_kernels[0].dense(), sparse_gp.Kuf_kernels[0].dense());
+    EXPECT_EQ(loaded.y, sparse_gp.y);
+    EXPECT_EQ(loaded.sparse_descriptors[0].descriptors,
+              sparse_gp.sparse_descriptors[0].descriptors);
+    EXPECT_EQ(loaded.training_structures[0].descriptors[0].descriptors,
+              struc.descriptors[0].descriptors);
+
+    // The factors are read from the file rather than recomputed.
+    EXPECT_TRUE(loaded.factor_valid);
+    EXPECT_EQ(loaded.factor_clusters, sparse_gp.factor_clusters);
+    EXPECT_EQ(loaded.R_factor, sparse_gp.R_factor);
+    EXPECT_EQ(loaded.L_factor, sparse_gp.L_factor);
+    EXPECT_EQ(loaded.Q_b_factor, sparse_gp.Q_b_factor);
+    EXPECT_EQ(loaded.alpha, sparse_gp.alpha);
+  }
+  for (std::string file : {json_file, binary_file, converted_file})
+    std::remove(file.c_str());
+
+  // Single precision force derivatives are stored as float blobs.
+  struc.descriptors[0].compress_force_dervs();
+  std::string struc_file = temp_file("structure.bin");
+  Structure::to_binary(struc_file, struc);
+  Structure loaded_struc = Structure::from_binary(struc_file);
+  std::remove(struc_file.c_str());
+  EXPECT_EQ(loaded_struc.positions, struc.positions);
+  EXPECT_EQ(loaded_struc.species, struc.species);
+  EXPECT_EQ(loaded_struc.descriptors[0].compact_force_dervs,
+            struc.descriptors[0].compact_force_dervs);
+  EXPECT_EQ(loaded_struc.neighbor_count, struc.neighbor_count);
+
+  std::string desc_file = temp_file("descriptors.bin");
+  write_binary(desc_file, struc.descriptors[0], "DescriptorValues");
+  DescriptorValues loaded_desc =
+      read_binary<DescriptorValues>(desc_file, "DescriptorValues");
+  EXPECT_EQ(loaded_desc.descriptor_norms,
+            struc.descriptors[0].descriptor_norms);
+  EXPECT_THROW(read_binary<Structure>(desc_file, "Structure"),
+               std::runtime_error);
+  std::remove(desc_file.c_str());
+}
+
+TEST_F(StructureTest, StreamedJson) {
+  // Check that streamed JSON files match the dump of the full JSON tree and
+  // are read back exactly.
+  double sigma_e = 1;
+  double sigma_f = 2;
+  double sigma_s = 3;
+
+  std::vector<Kernel *> kernels{&kernel_norm};
+  SparseGP sparse_gp = SparseGP(kernels, sigma_e, sigma_f, sigma_s);
+  std::vector<Descriptor *> b2_calcs{&ps};
+  Structure struc(cell, species, positions, cutoff, b2_calcs);
+  struc.energy = Eigen::VectorXd::Random(1);
+  struc.forces = Eigen::VectorXd::Random(n_atoms * 3);
+  struc.stresses = Eigen::VectorXd::Random(6);
+  sparse_gp.add_training_structure(struc);
+  sparse_gp.add_specific_environments(struc, {0, 1, 2, 3});
+  sparse_gp.update_matrices_QR();
+
+  std::string gp_file = temp_file("sparse_gp_stream.json");
+  SparseGP::to_json(gp_file, sparse_gp);
+  std::ifstream file(gp_file);
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  file.close();
+  EXPECT_EQ(text, nlohmann::json(sparse_gp).dump());
+
+  SparseGP loaded = SparseGP::from_json(gp_file);
+  std::remove(gp_file.c_str());
+  EXPECT_EQ(loaded.hyperparameters, sparse_gp.hyperparameters);
+  EXPECT_EQ(loaded.Kuu_kernels[0], sparse_gp.Kuu_kernels[0]);
+  EXPECT_EQ(loaded.Kuf_kernels[0].dense(), sparse_gp.Kuf_kernels[0].dense());
+  EXPECT_EQ(loaded.training_structures[0].descriptors[0].descriptor_force_dervs,
+            struc.descriptors[0].descriptor_force_dervs);
+  EXPECT_EQ(loaded.training_structures[0].species, struc.species);
+  EXPECT_EQ(loaded.sparse_indices, sparse_gp.sparse_indices);
+  EXPECT_EQ(loaded.alpha, sparse_gp.alpha);
+
+  // Single precision force derivatives are read back as floats.
+  struc.descriptors[0].compress_force_dervs();
+  std::string struc_file = temp_file("structure_stream.json");
+  Structure::to_json(struc_file, struc);
+  Structure loaded_struc = Structure::from_json(struc_file);
+  std::remove(struc_file.c_str());
+  EXPECT_EQ(loaded_struc.positions, struc.positions);
+  EXPECT_EQ(loaded_struc.neighbor_count, struc.neighbor_count);
+  EXPECT_EQ(loaded_struc.descriptors[0].compact_force_dervs,
+            struc.descriptors[0].compact_force_dervs);
+}
@@ -559,3 +559,177 @@ TEST_F(StructureTest, StrucStrucFull) {
     }
   }
 }
+
+TEST_F(StructureTest, CellListNeighbors) {
+  // Check that the linked-cell search reproduces the brute-force neighbor
+  // lists in a small triclinic cell, where neighbors extend over several
+  // periodic images.
+  Eigen::MatrixXd tri_cell(3, 3);
+  tri_cell << 4.0, 0.0, 0.0, 1.3, 3.8, 0.0, 0.7, -1.1, 4.2;
+  int n_tri = 20;
+  Eigen::MatrixXd tri_positions = Eigen::MatrixXd::Random(n_tri, 3) * 4.0;
+  std::vector<int> tri_species;
+  for (int i = 0; i < n_tri; i++) {
+    tri_species.push_back(rand() % n_species);
+  }
+
+  std::vector<Descriptor *> no_descriptors;
+  Structure cell_list(tri_cell, tri_species, tri_positions, cutoff,
+                      no_descriptors);
+  Structure brute_force = cell_list;
+  brute_force.compute_neighbors_brute_force();
+
+  EXPECT_GT(cell_list.sweep, 1);
+  EXPECT_EQ(cell_list.n_neighbors, brute_force.n_neighbors);
+  EXPECT_EQ(cell_list.neighbor_count, brute_force.neighbor_count);
+  EXPECT_EQ(cell_list.cumulative_neighbor_count,
+            brute_force.cumulative_neighbor_count);
+  EXPECT_EQ(cell_list.structure_indices, brute_force.structure_indices);
+  EXPECT_EQ(cell_list.neighbor_species, brute_force.neighbor_species);
+  EXPECT_EQ(cell_list.relative_positions, brute_force.relative_positions);
+}
+
+TEST_F(StructureTest, CellListCubicCells) {
+  // Check the linked-cell search against the brute-force search at fixed
+  // density as the number of atoms grows.
+  double density = 0.05;
+  double neighbor_cutoff = 4.0;
+  std::vector<Descriptor *> no_descriptors;
+
+  for (int n_atoms = 32; n_atoms <= 256; n_atoms *= 2) {
+    double box_size = cbrt(n_atoms / density);
+    Eigen::MatrixXd box = Eigen::MatrixXd::Identity(3, 3) * box_size;
+    Eigen::MatrixXd box_positions =
+        Eigen::MatrixXd::Random(n_atoms, 3) * box_size;
+    std::vector<int> box_species(n_atoms, 0);
+
+    Structure cell_list(box, box_species, box_positions, neighbor_cutoff,
+                        no_descriptors);
+    Structure brute_force = cell_list;
+    brute_force.compute_neighbors_brute_force();
+
+    EXPECT_EQ(cell_list.neighbor_count, brute_force.neighbor_count);
+    EXPECT_EQ(cell_list.structure_indices, brute_force.structure_indices);
+    EXPECT_EQ(cell_list.relative_positions, brute_force.relative_positions);
+  }
+}
+
+TEST_F(StructureTest, NeighborListReuse) {
+  // Structures built from a persistent neighbor list should match structures
+  // built from scratch, whether or not the candidates are rebuilt.
+  double skin = 0.5;
+  NeighborList neighbor_list(cutoff, skin);
+  Eigen::MatrixXd current_positions = positions;
+
+  for (int step = 0; step < 6; step++) {
+    // Move the atoms by less than half the skin, except on the last step.
+    double step_size = (step < 5) ? 0.02 : 1.0;
+    current_positions +=
+        Eigen::MatrixXd::Random(n_atoms, 3) * step_size / sqrt(3);
+
+    Structure reused(cell, species, current_positions, neighbor_list, dc);
+    Structure fresh(cell, species, current_positions, cutoff, dc);
+
+    EXPECT_EQ(reused.neighbor_count, fresh.neighbor_count);
+    EXPECT_EQ(reused.cumulative_neighbor_count,
+              fresh.cumulative_neighbor_count);
+    EXPECT_EQ(reused.structure_indices, fresh.structure_indices);
+    EXPECT_EQ(reused.neighbor_species, fresh.neighbor_species);
+    EXPECT_EQ(reused.relative_positions, fresh.relative_positions);
+    EXPECT_EQ(reused.descriptors[0].descriptors,
+              fresh.descriptors[0].descriptors);
+  }
+
+  // Candidates are built on the first step and after the large move.
+  EXPECT_EQ(neighbor_list.n_builds, 2);
+}
+
+TEST_F(StructureTest, NormDotSelfKernel) {
+  // Check the self kernel against the diagonal of the full kernel matrix,
+  // including the second derivative terms of higher powers.
+  std::vector<double> powers{1, 2, 3};
+  for (double p : powers) {
+    NormalizedDotProduct kernel_p(sigma, p);
+    Eigen::VectorXd self_kern =
+        kernel_p.self_kernel_struc(struc_desc, kernel_p.kernel_hyperparameters);
+    Eigen::MatrixXd full_kern = kernel_p.struc_struc(
+        struc_desc, struc_desc, kernel_p.kernel_hyperparameters);
+
+    for (int i = 0; i < self_kern.size(); i++) {
+      EXPECT_NEAR(self_kern(i), full_kern(i, i),
+                  1e-8 * (1 + std::abs(full_kern(i, i))));
+    }
+  }
+}
+
+TEST_F(StructureTest, NormDotEnvsStruc) {
+  // Summing the kernels of all clusters of a structure gives the first row
+  // of the structure/structure kernel.
+  ClusterDescriptor envs;
+  envs.add_all_clusters(struc_desc);
+  std::vector<double> powers{1, 2, 3};
+  for (double p : powers) {
+    NormalizedDotProduct kernel_p(sigma, p);
+    Eigen::MatrixXd kern_mat =
+        kernel_p.envs_struc(envs, struc_desc, kernel_p.kernel_hyperparameters);
+    Eigen::MatrixXd full_kern = kernel_p.struc_struc(
+        struc_desc, struc_desc, kernel_p.kernel_hyperparameters);
+    Eigen::VectorXd kern_sum = kern_mat.colwise().sum();
+
+    for (int i = 0; i < kern_sum.size(); i++) {
+      EXPECT_NEAR(kern_sum(i), full_kern(0, i),
+                  1e-8 * (1 + std::abs(full_kern(0, i))));
+    }
+  }
+}
+
+TEST_F(StructureTest, SinglePrecisionKernels) {
+  // Compare single precision dot products with the double precision path.
+  // Errors are measured relative to the largest entry of each matrix.
+  NormalizedDotProduct kernel_sq(sigma, 2);
+  NormalizedDotProduct_ICM kernel_icm(sigma, 2, icm_coeffs);
+  std::vector<Kernel *> test_kernels{&kernel_norm, &kernel_sq, &kernel,
+                                     &kernel_icm};
+
+  Structure compact_struc = test_struc;
+  compact_struc.descriptors[0].compress_force_dervs();
+  std::vector<DescriptorValues *> test_descs{&struc_desc,
+                                             &compact_struc.descriptors[0]};
+
+  ClusterDescriptor envs;
+  envs.add_all_clusters(test_struc_2.descriptors[0]);
+
+  double thresh = 1e-5;
+  auto relative_error = [](const Eigen::MatrixXd &exact,
+                           const Eigen::MatrixXd &approx) {
+    return (exact - approx).cwiseAbs().maxCoeff() /
+           exact.cwiseAbs().maxCoeff();
+  };
+
+  for (Kernel *test_kernel : test_kernels) {
+    Eigen::VectorXd hyps = test_kernel->kernel_hyperparameters;
+    for (DescriptorValues *desc : test_descs) {
+      test_kernel->single_precision = false;
+      Eigen::MatrixXd envs_envs_double =
+          test_kernel->envs_envs(envs, envs, hyps);
+      Eigen::MatrixXd envs_struc_double =
+          test_kernel->envs_struc(envs, *desc, hyps);
+      Eigen::MatrixXd struc_struc_double =
+          test_kernel->struc_struc(*desc, *desc, hyps);
+
+      test_kernel->single_precision = true;
+      Eigen::MatrixXd envs_envs_single =
+          test_kernel->envs_envs(envs, envs, hyps);
+      Eigen::MatrixXd envs_struc_single =
+          test_kernel->envs_struc(envs, *desc, hyps);
+      Eigen::MatrixXd struc_struc_single =
+          test_kernel->struc_struc(*desc, *desc, hyps);
+      test_kernel->single_precision = false;
+
+      EXPECT_LT(relative_error(envs_envs_double, envs_envs_single), thresh);
+      EXPECT_LT(relative_error(envs_struc_double, envs_struc_single), thresh);
+      EXPECT_LT(relative_error(struc_struc_double, struc_struc_single),
+                thresh);
+    }
+  }
+}
@@ -4,6 +4,7 @@
 #include "b3.h"
 #include "structure.h"
 #include "four_body.h"
+#include "neighbor_list.h"
 #include "normalized_dot_product.h"
 #include "norm_dot_icm.h"
 #include "squared_exponential.h"
@@ -15,9 +16,16 @@
 #include <Eigen/Dense>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
 #include <iostream>
 #include <stdlib.h>
 
+// Path of a file in the temporary directory of the tests. Tests remove the
+// files they write.
+inline std::string temp_file(const std::string &name) {
+  return ::testing::TempDir() + name;
+}
+
 class StructureTest : public ::testing::Test {
 public:
   int n_atoms = 10;
@@ -94,4 +102,20 @@ public:
     kernel_3_norm = NormalizedDotProduct(sigma, power);
     kernel_3 = SquaredExponential(sigma, ls);
   }
+
+  // Structure of n atoms with random species and positions, in a cubic cell
+  // with the density of the test structures.
+  Structure random_structure(int n,
+                             std::vector<Descriptor *> descriptor_calculators) {
+    double size = cell_size * pow(double(n) / n_atoms, 1. / 3.);
+    Eigen::MatrixXd struc_cell = Eigen::MatrixXd::Identity(3, 3) * size;
+    Eigen::MatrixXd struc_positions =
+        (Eigen::MatrixXd::Random(n, 3).array() + 1) * size / 2;
+    std::vector<int> struc_species;
+    for (int i = 0; i < n; i++) {
+      struc_species.push_back(rand() % n_species);
+    }
+    return Structure(struc_cell, struc_species, struc_positions, cutoff,
+                     descriptor_calculators);
+  }
 };
@@ -0,0 +1,39 @@
+#include <chrono>
+#include <iostream>
+
+#include <Eigen/Dense>
+
+#include "b2_simd.h"
+
+// Time the dispatched B2 contraction kernel against the scalar version on a
+// column with a few hundred neighbor rows.
+int main() {
+  int n_m = 9;
+  int n_rows = 3 * 120, ld = n_rows, n_reps = 20000;
+  Eigen::VectorXd vals = Eigen::VectorXd::Random(2 * n_m);
+  Eigen::MatrixXd dervs = Eigen::MatrixXd::Random(ld, 2 * n_m);
+  Eigen::VectorXd out_dervs = Eigen::VectorXd::Zero(n_rows);
+  Eigen::VectorXd out_dots = Eigen::VectorXd::Zero(n_rows);
+
+  auto t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n_reps; i++) {
+    contract_b2_column(n_rows, n_m, vals.data(), vals.data() + n_m, 1,
+                       dervs.data(), dervs.data() + n_m * ld, ld, 1e-3,
+                       out_dervs.data(), out_dots.data());
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n_reps; i++) {
+    contract_b2_column_scalar(n_rows, n_m, vals.data(), vals.data() + n_m, 1,
+                              dervs.data(), dervs.data() + n_m * ld, ld, 1e-3,
+                              out_dervs.data(), out_dots.data());
+  }
+  auto t3 = std::chrono::steady_clock::now();
+
+  std::chrono::duration<double, std::micro> simd = t2 - t1;
+  std::chrono::duration<double, std::micro> scalar = t3 - t2;
+  std::cout << "B2 contraction (" << b2_simd_isa()
+            << "): " << simd.count() / n_reps << " us, scalar "
+            << scalar.count() / n_reps << " us" << std::endl;
+
+  return 0;
+}
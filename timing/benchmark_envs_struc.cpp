@@ -0,0 +1,63 @@
+#include <chrono>
+#include <iostream>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "b2.h"
+#include "normalized_dot_product.h"
+#include "structure.h"
+
+// Time NormalizedDotProduct::envs_struc for a 100-atom structure against
+// growing sets of sparse environments, in double and single precision.
+int main() {
+  int n_atoms = 100;
+  int n_species = 3;
+  double cutoff = 5;
+  double cell_size = 10 * pow(double(n_atoms) / 1000, 1. / 3.);
+
+  std::vector<double> radial_hyps{0, cutoff};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{n_species, 3, 3};
+  B2 ps("chebyshev", "cosine", radial_hyps, cutoff_hyps,
+        descriptor_settings);
+  std::vector<Descriptor *> dc{&ps};
+
+  Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * cell_size;
+  Eigen::MatrixXd positions =
+      (Eigen::MatrixXd::Random(n_atoms, 3).array() + 1) * cell_size / 2;
+  std::vector<int> species;
+  for (int i = 0; i < n_atoms; i++) {
+    species.push_back(rand() % n_species);
+  }
+  Structure struc(cell, species, positions, cutoff / 2, dc);
+
+  double sigma = 2.0;
+  std::vector<double> powers{1, 2};
+  std::vector<int> sparse_sizes{100, 1000, 10000};
+  ClusterDescriptor sparse_envs;
+  for (int n_sparse : sparse_sizes) {
+    while (sparse_envs.n_clusters < n_sparse) {
+      sparse_envs.add_all_clusters(struc.descriptors[0]);
+    }
+
+    for (double power : powers) {
+      for (int single = 0; single < 2; single++) {
+        NormalizedDotProduct kernel(sigma, power);
+        kernel.single_precision = single;
+        auto t1 = std::chrono::steady_clock::now();
+        Eigen::MatrixXd kern_mat = kernel.envs_struc(
+            sparse_envs, struc.descriptors[0], kernel.kernel_hyperparameters);
+        auto t2 = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::milli> duration = t2 - t1;
+        std::cout << "envs_struc, power " << power << ", "
+                  << (single ? "single" : "double") << " precision, "
+                  << sparse_envs.n_clusters
+                  << " sparse environments: " << duration.count() << " ms"
+                  << std::endl;
+      }
+    }
+  }
+
+  return 0;
+}
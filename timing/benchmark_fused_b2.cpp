@@ -0,0 +1,56 @@
+#include <chrono>
+#include <iostream>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "b2.h"
+#include "structure.h"
+
+// Time the fused B2 calculation against the two-pass reference for a
+// 100-atom structure with different cutoffs for each pair of species.
+int main() {
+  int n_atoms = 100;
+  int n_species = 3;
+  double cell_size = 10;
+  double cutoff = 5;
+
+  Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * cell_size;
+  Eigen::MatrixXd positions =
+      Eigen::MatrixXd::Random(n_atoms, 3) * cell_size / 2;
+  std::vector<int> species;
+  for (int i = 0; i < n_atoms; i++) {
+    species.push_back(rand() % n_species);
+  }
+  std::vector<Descriptor *> no_descriptors;
+  Structure struc(cell, species, positions, cutoff, no_descriptors);
+
+  Eigen::MatrixXd cutoff_matrix(n_species, n_species);
+  cutoff_matrix << 5.0, 4.5, 4.0, 4.5, 3.5, 5.0, 4.0, 5.0, 4.8;
+  std::vector<double> radial_hyps{0, cutoff};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{n_species, 6, 4};
+  B2 b2("chebyshev", "cosine", radial_hyps, cutoff_hyps, descriptor_settings,
+        cutoff_matrix);
+
+  int n_reps = 20;
+  auto t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n_reps; i++) {
+    b2.compute_struc(struc);
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  for (int i = 0; i < n_reps; i++) {
+    b2.compute_struc_two_pass(struc);
+  }
+  auto t3 = std::chrono::steady_clock::now();
+
+  std::chrono::duration<double, std::micro> fused = t2 - t1;
+  std::chrono::duration<double, std::micro> two_pass = t3 - t2;
+  double fused_per_atom = fused.count() / (n_reps * n_atoms);
+  double two_pass_per_atom = two_pass.count() / (n_reps * n_atoms);
+  std::cout << "B2 per atom: fused " << fused_per_atom << " us, two-pass "
+            << two_pass_per_atom << " us, speedup "
+            << two_pass_per_atom / fused_per_atom << "x" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,39 @@
+#include <chrono>
+#include <iostream>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "structure.h"
+
+// Time the linked-cell and brute-force neighbor searches at fixed density as
+// the number of atoms grows.
+int main() {
+  double density = 0.05;
+  double cutoff = 4.0;
+
+  for (int n_atoms = 32; n_atoms <= 1024; n_atoms *= 2) {
+    double box_size = cbrt(n_atoms / density);
+    Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * box_size;
+    Eigen::MatrixXd positions = Eigen::MatrixXd::Random(n_atoms, 3) * box_size;
+    std::vector<int> species(n_atoms, 0);
+
+    Structure struc(cell, species, positions);
+    struc.cutoff = cutoff;
+    struc.sweep = ceil(cutoff / struc.single_sweep_cutoff);
+
+    auto t1 = std::chrono::steady_clock::now();
+    struc.compute_neighbors();
+    auto t2 = std::chrono::steady_clock::now();
+    struc.compute_neighbors_brute_force();
+    auto t3 = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double, std::milli> cell_list = t2 - t1;
+    std::chrono::duration<double, std::milli> brute_force = t3 - t2;
+    std::cout << n_atoms << " atoms: cell list " << cell_list.count()
+              << " ms, brute force " << brute_force.count() << " ms"
+              << std::endl;
+  }
+
+  return 0;
+}
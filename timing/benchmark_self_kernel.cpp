@@ -0,0 +1,53 @@
+#include <chrono>
+#include <iostream>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "b2.h"
+#include "normalized_dot_product.h"
+#include "structure.h"
+
+// Time NormalizedDotProduct::self_kernel_struc for cells whose full force
+// derivative product would not fit in memory comfortably.
+int main() {
+  int n_species = 3;
+  double cutoff = 5;
+  std::vector<double> radial_hyps{0, cutoff};
+  std::vector<double> cutoff_hyps;
+  std::vector<int> descriptor_settings{n_species, 3, 3};
+  B2 ps("chebyshev", "cosine", radial_hyps, cutoff_hyps,
+        descriptor_settings);
+  std::vector<Descriptor *> dc{&ps};
+  NormalizedDotProduct kernel(2.0, 1);
+
+  std::vector<int> sizes{500, 1000, 2000};
+  for (int n_atoms : sizes) {
+    double cell_size = 10 * pow(double(n_atoms) / 10, 1. / 3.);
+    Eigen::MatrixXd cell = Eigen::MatrixXd::Identity(3, 3) * cell_size;
+    Eigen::MatrixXd positions =
+        (Eigen::MatrixXd::Random(n_atoms, 3).array() + 1) * cell_size / 2;
+    std::vector<int> species;
+    for (int i = 0; i < n_atoms; i++) {
+      species.push_back(rand() % n_species);
+    }
+    Structure struc(cell, species, positions, cutoff, dc);
+
+    int n_neighbors = 0;
+    for (int s = 0; s < n_species; s++) {
+      n_neighbors += struc.descriptors[0].neighbor_coordinates[s].rows();
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    Eigen::VectorXd self_kern = kernel.self_kernel_struc(
+        struc.descriptors[0], kernel.kernel_hyperparameters);
+    auto t2 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> duration = t2 - t1;
+    std::cout << "Self kernel, " << n_atoms << " atoms: " << duration.count()
+              << " ms (dense force product would take "
+              << 8. * 9 * n_neighbors * n_neighbors / 1e9 << " GB)"
+              << std::endl;
+  }
+
+  return 0;
+}